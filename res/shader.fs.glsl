@@ -3,6 +3,10 @@
 layout(location = 0) in vec3 frag_color;
 layout(location = 0) out vec4 out_color;
 
+// Specialization constants, see ntf::shader_feature
+layout(constant_id = 1) const bool GRAYSCALE = false;
+
 void main() {
-  out_color = vec4(frag_color, 1.);
+  vec3 color = GRAYSCALE ? vec3(dot(frag_color, vec3(.2126, .7152, .0722))) : frag_color;
+  out_color = vec4(color, 1.);
 }
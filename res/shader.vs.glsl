@@ -5,6 +5,13 @@ layout(location = 1) in vec3 att_color;
 
 layout(location = 0) out vec3 frag_color;
 
+// Specialization constants, see ntf::shader_feature
+layout(constant_id = 0) const bool VERTEX_COLOR = true;
+
+layout(push_constant) uniform draw_params {
+  mat4 transform;
+} params;
+
 // vec2 positions[3] = vec2[](
 //   vec2(.0, -.5),
 //   vec2(.5, .5),
@@ -20,6 +27,6 @@ layout(location = 0) out vec3 frag_color;
 void main() {
   // gl_Position = vec4(positions[gl_VertexIndex].xy, .0, 1.);
   // frag_color = colors[gl_VertexIndex];
-  gl_Position = vec4(att_coords, 0.f, 1.f);
-  frag_color = att_color;
+  gl_Position = params.transform * vec4(att_coords, 0.f, 1.f);
+  frag_color = VERTEX_COLOR ? att_color : vec3(1.);
 }
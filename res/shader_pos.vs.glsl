@@ -0,0 +1,15 @@
+#version 450
+
+// Positions only, for pipelines binding just the positions buffer of the split layout
+layout(location = 0) in vec2 att_coords;
+
+layout(location = 0) out vec3 frag_color;
+
+layout(push_constant) uniform draw_params {
+  mat4 transform;
+} params;
+
+void main() {
+  gl_Position = params.transform * vec4(att_coords, 0.f, 1.f);
+  frag_color = vec3(1.);
+}
@@ -0,0 +1,37 @@
+#version 450
+#extension GL_EXT_buffer_reference : require
+
+layout(location = 0) out vec3 frag_color;
+
+// Specialization constants, see ntf::shader_feature
+layout(constant_id = 0) const bool VERTEX_COLOR = true;
+
+// Vertices read as plain floats, the layout (interleaved or split) comes with the push
+// constants
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer vertex_data {
+  float values[];
+};
+
+// Same as ntf::draw_push_constants
+layout(push_constant) uniform draw_params {
+  mat4 transform;
+  vertex_data vertices;
+  uint position_stride; // In floats, like the rest
+  uint color_offset;
+  uint color_stride;
+} params;
+
+void main() {
+  // gl_VertexIndex already has the index buffer applied
+  uint position = uint(gl_VertexIndex)*params.position_stride;
+  vec2 coords = vec2(params.vertices.values[position], params.vertices.values[position + 1]);
+  gl_Position = params.transform * vec4(coords, 0.f, 1.f);
+
+  if (VERTEX_COLOR) {
+    uint color = params.color_offset + uint(gl_VertexIndex)*params.color_stride;
+    frag_color = vec3(params.vertices.values[color], params.vertices.values[color + 1],
+                      params.vertices.values[color + 2]);
+  } else {
+    frag_color = vec3(1.);
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+namespace ntf {
+
+// Heap allocations made through operator new on the calling thread
+// The global operator new/delete replacements doing the counting live in alloc_counter.cpp,
+// allocations made with malloc (eg. by the driver) are not seen
+struct alloc_counts {
+  uint64_t count{0};
+  uint64_t bytes{0};
+};
+
+alloc_counts thread_alloc_counts();
+
+// Counts the allocations this thread makes from construction on
+class alloc_scope {
+public:
+  alloc_scope() : _start(thread_alloc_counts()) {}
+
+public:
+  alloc_counts delta() const {
+    const auto now = thread_alloc_counts();
+    return {now.count - _start.count, now.bytes - _start.bytes};
+  }
+
+private:
+  alloc_counts _start;
+};
+
+} // namespace ntf
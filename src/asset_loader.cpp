@@ -0,0 +1,394 @@
+#include "asset_loader.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Reads up to size bytes at offset, less only at the end of the file or on errors
+std::size_t read_at(int fd, void* dst, std::size_t size, std::size_t offset) {
+  std::size_t total{0};
+  while (total < size) {
+    const ssize_t n = pread(fd, static_cast<std::byte*>(dst) + total, size - total,
+                            static_cast<off_t>(offset + total));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    total += static_cast<std::size_t>(n);
+  }
+  return total;
+}
+
+// Straight into a string sized up front, no stream buffers in between
+std::optional<std::string> file_contents(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+
+  std::optional<std::string> out;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    std::string data(static_cast<std::size_t>(st.st_size), '\0');
+    if (read_at(fd, data.data(), data.size(), 0) == data.size()) {
+      out = std::move(data);
+    }
+  }
+
+  close(fd);
+  return out;
+}
+
+// Mesh files are this header, then the vertices, then the 16 bit indices, all packed
+struct mesh_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t vertex_count;
+  uint32_t index_count;
+};
+
+constexpr uint32_t MESH_MAGIC = 0x4D46544E; // "NTFM"
+
+// Same header for both, the version tells how the vertices are laid out after it
+constexpr uint32_t MESH_VERSION_INTERLEAVED = 1;
+constexpr uint32_t MESH_VERSION_SPLIT = 2;
+
+// Mounted if present, anything not in it is loaded from the loose files
+constexpr const char* PACK_PATH = "res/assets.pack";
+
+constexpr const char* GEOMETRY_OOM = "Not enough device memory for the scene geometry";
+
+struct mesh_layout {
+  mesh_header header;
+  std::size_t vert_sz;
+  std::size_t indx_sz;
+  ntf::vertex_layout vertices;
+};
+
+// Checks the header against the file size
+mesh_layout mesh_layout_of(const mesh_header& header, std::size_t file_size,
+                           std::string_view path) {
+  const std::size_t vert_sz = sizeof(ntf::vertex)*header.vertex_count;
+  const std::size_t indx_sz = sizeof(uint16_t)*header.index_count;
+  const bool known_version = header.version == MESH_VERSION_INTERLEAVED ||
+                             header.version == MESH_VERSION_SPLIT;
+  if (header.magic != MESH_MAGIC || !known_version ||
+      file_size != sizeof(header) + vert_sz + indx_sz) {
+    throw std::runtime_error{fmt::format("Invalid mesh file {}", path)};
+  }
+  const auto vertices = header.version == MESH_VERSION_SPLIT ? ntf::vertex_layout::split :
+                                                               ntf::vertex_layout::interleaved;
+  return mesh_layout{header, vert_sz, indx_sz, vertices};
+}
+
+// Only the header, the rest gets streamed
+mesh_layout read_mesh_layout(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error{fmt::format("Failed to open file {}", path)};
+  }
+
+  mesh_header header{};
+  struct stat st{};
+  const bool ok = fstat(fd, &st) == 0 && read_at(fd, &header, sizeof(header), 0) == sizeof(header);
+  close(fd);
+  if (!ok) {
+    throw std::runtime_error{fmt::format("Invalid mesh file {}", path)};
+  }
+  return mesh_layout_of(header, static_cast<std::size_t>(st.st_size), path);
+}
+
+// Spans into the data, nothing gets copied
+ntf::geometry_source parse_mesh(std::span<const std::byte> data, std::string_view path) {
+  mesh_header header{};
+  if (data.size() >= sizeof(header)) {
+    std::memcpy(&header, data.data(), sizeof(header));
+  }
+  const auto [_, vert_sz, indx_sz, vertices] = mesh_layout_of(header, data.size(), path);
+
+  const std::byte* verts = data.data() + sizeof(header);
+  return ntf::geometry_source{
+    {verts, vert_sz},
+    {reinterpret_cast<const uint16_t*>(verts + vert_sz), header.index_count},
+    nullptr,
+    vertices,
+  };
+}
+
+ntf::geometry_source parse_mesh(const ntf::mapped_file& file, std::string_view path) {
+  auto src = parse_mesh({file.data(), file.size()}, path);
+  src.file = &file;
+  return src;
+}
+
+} // namespace
+
+namespace ntf {
+
+asset_loader::asset_loader(vk_context& context, job_system& jobs, thread_executor& render_exec,
+                           pipeline_registry& pipelines) :
+  _context(context), _jobs(jobs), _render_exec(render_exec), _pipelines(pipelines),
+  _streamer(context, jobs, render_exec) {
+  // A pack that can't be mounted is as good as no pack, everything comes from the loose files
+  if (std::filesystem::exists(PACK_PATH)) {
+    try {
+      _pack.emplace(PACK_PATH);
+    } catch (const std::exception& ex) {
+      fmt::print(stderr, "Ignoring asset pack {}: {}\n", PACK_PATH, ex.what());
+      _pack.reset();
+    }
+  }
+}
+
+task<std::string> asset_loader::read_file(std::string path) {
+  if (const auto* packed = _find_packed(path)) {
+    std::string contents(packed->size, '\0');
+    co_await _pack->unpack(*packed, std::as_writable_bytes(std::span{contents}), _jobs);
+    co_return contents;
+  }
+
+  co_await schedule_on(_jobs);
+
+  auto contents = file_contents(path);
+  if (!contents) {
+    throw std::runtime_error{fmt::format("Failed to load file {}", path)};
+  }
+  co_return std::move(*contents);
+}
+
+task<std::string> asset_loader::load_spirv(std::string path) {
+  auto code = co_await read_file(path);
+
+  // Still on the worker that read the file, so the checks don't touch the render thread
+  if (!is_valid_spirv(code)) {
+    throw std::runtime_error{fmt::format("Invalid SPIR-V binary {}", path)};
+  }
+  co_return code;
+}
+
+task<std::string> asset_loader::load_shader(std::string path, shader_stage stage,
+                                           std::vector<shader_define> defines) {
+  // Without shaderc there's nothing to do with the source, not even worth reading it
+  std::string glsl_path = fmt::format("{}.glsl", path);
+  if (shader_compiler::can_compile() &&
+      (_find_packed(glsl_path) || std::filesystem::exists(glsl_path))) {
+    auto source = co_await read_file(glsl_path);
+
+    // Compiling takes a while, never on the render thread
+    co_await schedule_on(_jobs);
+    if (auto spirv = _compiler.compile(source, glsl_path, stage, defines)) {
+      co_return std::move(*spirv);
+    }
+  }
+
+  // Only the prebuilt one is there (or the source doesn't compile), defines can't apply
+  if (!defines.empty()) {
+    fmt::print(stderr, "Shader {} loaded without its defines\n", path);
+  }
+  co_return co_await load_spirv(fmt::format("{}.spv", path));
+}
+
+task<pipeline_registry::pipeline_id> asset_loader::load_pipeline(std::string vert_path,
+                                                                std::string frag_path) {
+  auto [vert_src, frag_src] = co_await when_all(
+    load_shader(std::move(vert_path), shader_stage::vertex),
+    load_shader(std::move(frag_path), shader_stage::fragment)
+  );
+
+  co_await _render_exec.schedule();
+  _context.create_graphics_pipeline(vert_src, frag_src);
+
+  const auto vert = _pipelines.add_shader(std::move(vert_src));
+  const auto frag = _pipelines.add_shader(std::move(frag_src));
+  co_return _pipelines.set_fallback(_context.default_pipeline_desc(vert, frag),
+                                    _context.graphics_pipeline());
+}
+
+task<std::optional<pipeline_registry::pipeline_id>> asset_loader::load_pulling_pipeline(
+  std::string vert_path, pipeline_registry::pipeline_id base) {
+  if (!_context.vertex_pulling()) {
+    co_return std::nullopt;
+  }
+
+  // A shader that is there but doesn't load fails like any other
+  const std::string glsl_path = fmt::format("{}.glsl", vert_path);
+  const std::string spirv_path = fmt::format("{}.spv", vert_path);
+  if (!_find_packed(glsl_path) && !_find_packed(spirv_path) &&
+      !std::filesystem::exists(glsl_path) && !std::filesystem::exists(spirv_path)) {
+    fmt::print(stderr, "Vertex pulling disabled: {} not found\n", spirv_path);
+    co_return std::nullopt;
+  }
+  auto vert_src = co_await load_shader(std::move(vert_path), shader_stage::vertex);
+
+  co_await _render_exec.schedule();
+  const auto vert = _pipelines.add_shader(std::move(vert_src));
+  co_return _pipelines.request(
+    _context.pulling_pipeline_desc(vert, _pipelines.desc(base).frag_shader)
+  );
+}
+
+task<void> asset_loader::load_geometry(std::string path) {
+  if (const auto* packed = _find_packed(path)) {
+    co_await _load_packed_geometry(*packed, std::move(path));
+    co_return;
+  }
+
+  // Opening and mapping files can block, do it on a worker
+  co_await schedule_on(_jobs);
+
+  if (!std::filesystem::exists(path)) {
+    co_await _render_exec.schedule();
+    co_await _finish_uploads(_context.create_buffers());
+    co_return;
+  }
+
+  // With a discrete GPU and no host memory import the data has to go through staging
+  // memory anyway, so read it there directly instead of mapping it and copying it over
+  // Host writable device memory goes below, create_buffers copies the mapping straight in
+  if (!_context.direct_write() && !_context.host_import_alignment()) {
+    const auto layout = read_mesh_layout(path);
+
+    co_await _render_exec.schedule();
+    if (!_context.create_geometry_buffers(layout.vert_sz, layout.indx_sz, layout.vertices)) {
+      throw std::runtime_error{GEOMETRY_OOM};
+    }
+    std::vector<stream_loader::range> ranges{
+      {sizeof(mesh_header), layout.vert_sz, _context.vertex_buffer(), 0},
+      {sizeof(mesh_header) + layout.vert_sz, layout.indx_sz, _context.index_buffer(), 0},
+    };
+    co_await _streamer.stream(path, std::move(ranges));
+    co_return;
+  }
+
+  // Mapped with the import alignment, so the transfer queue can read the pages directly
+  // Stays mapped in the coroutine frame until the uploads finish
+  mapped_file file{path, _context.host_import_alignment()};
+  const auto src = parse_mesh(file, path);
+
+  co_await _render_exec.schedule();
+  co_await _finish_uploads(_context.create_buffers(src));
+}
+
+task<void> asset_loader::_load_packed_geometry(const asset_pack::entry& packed, std::string path) {
+  if (packed.size < sizeof(mesh_header)) {
+    throw std::runtime_error{fmt::format("Invalid mesh file {}", path)};
+  }
+
+  // Device memory the host writes to takes the data as it is, no staging and no copies
+  // The workers decompress into host memory, the header has to be read before allocating
+  if (_context.direct_write()) {
+    std::vector<std::byte> data(packed.size);
+    co_await _pack->unpack(packed, data, _jobs);
+    co_await _render_exec.schedule();
+    co_await _finish_uploads(_context.create_buffers(parse_mesh(data, path)));
+    co_return;
+  }
+
+  co_await _render_exec.schedule();
+  auto staging = _context.create_staging_buffer(packed.size);
+  if (!staging) {
+    throw std::runtime_error{GEOMETRY_OOM};
+  }
+
+  // The workers decompress straight into the staging memory, then it gets copied over
+  // The staging buffer has to go away on the render thread whatever happens
+  std::exception_ptr error;
+  try {
+    co_await _pack->unpack(packed, {staging->data, packed.size}, _jobs);
+    co_await _render_exec.schedule();
+
+    mesh_header header;
+    std::memcpy(&header, staging->data, sizeof(header));
+    const auto layout = mesh_layout_of(header, packed.size, path);
+    if (!_context.create_geometry_buffers(layout.vert_sz, layout.indx_sz, layout.vertices)) {
+      throw std::runtime_error{GEOMETRY_OOM};
+    }
+
+    std::vector<buffer_upload> uploads{
+      _context.submit_copy(staging->buffer, _context.vertex_buffer(),
+                           {sizeof(mesh_header), 0, layout.vert_sz}),
+      _context.submit_copy(staging->buffer, _context.index_buffer(),
+                           {sizeof(mesh_header) + layout.vert_sz, 0, layout.indx_sz}),
+    };
+    co_await _finish_uploads(std::move(uploads));
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  co_await _render_exec.schedule();
+  _context.destroy_staging_buffer(*staging);
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+const asset_pack::entry* asset_loader::_find_packed(std::string_view path) const {
+  return _pack ? _pack->find(path) : nullptr;
+}
+
+task<void> asset_loader::_finish_uploads(std::optional<std::vector<buffer_upload>> pending) {
+  if (!pending) {
+    // Nothing to draw without it, and nothing else is going to free memory during init
+    throw std::runtime_error{GEOMETRY_OOM};
+  }
+  auto& uploads = *pending;
+  if (uploads.empty()) {
+    co_return; // Written straight into device memory
+  }
+
+  // Let the render thread do something else while the transfer queue works
+  co_await _render_exec.wait_until([this, &uploads]() {
+    for (const auto& upload : uploads) {
+      if (!_context.is_upload_done(upload)) {
+        return false;
+      }
+    }
+    return true;
+  });
+
+  for (auto& upload : uploads) {
+    _context.finish_upload(upload);
+  }
+}
+
+task<pipeline_registry::pipeline_id> asset_loader::load_scene() {
+  auto loaded = co_await when_all(
+    load_pipeline("res/shader.vs", "res/shader.fs"),
+    load_geometry("res/scene.mesh")
+  );
+
+  auto pipeline = std::get<0>(loaded);
+
+  // The default pipeline can't read split vertices, not even while the rest compile
+  co_await _render_exec.schedule();
+  if (_context.geometry_layout() != vertex_layout::interleaved) {
+    const auto& base = _pipelines.desc(pipeline);
+    const auto desc = _context.default_pipeline_desc(base.vert_shader, base.frag_shader,
+                                                     _context.geometry_layout());
+    pipeline = _pipelines.set_fallback(desc);
+  }
+
+  const auto pulling = co_await load_pulling_pipeline("res/shader_pull.vs", pipeline);
+  co_return pulling.value_or(pipeline);
+}
+
+} // namespace ntf
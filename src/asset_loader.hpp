@@ -0,0 +1,78 @@
+#pragma once
+
+#include "asset_pack.hpp"
+#include "async_task.hpp"
+#include "job_system.hpp"
+#include "vulkan_context.hpp"
+#include "mapped_file.hpp"
+#include "pipeline_registry.hpp"
+#include "shader_compiler.hpp"
+#include "stream_loader.hpp"
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ntf {
+
+// Loads assets as coroutines, so dependency chains read top to bottom and independent
+// loads run concurrently. File reads and decoding run on the job system workers, anything
+// touching the vulkan context hops back to the render thread through its executor, which
+// also polls the upload fences. No thread ever blocks waiting for a load
+// Files in res/assets.pack (if there is one) are taken from it instead of the loose files
+class asset_loader {
+public:
+  asset_loader(vk_context& context, job_system& jobs, thread_executor& render_exec,
+               pipeline_registry& pipelines);
+
+public:
+  // Whole file contents, read (or decompressed) on the workers
+  task<std::string> read_file(std::string path);
+
+  // Reads and validates a SPIR-V binary
+  task<std::string> load_spirv(std::string path);
+
+  // SPIR-V for path.glsl compiled with the defines (cached on disk), or the prebuilt
+  // path.spv when there's no source, no shaderc in the build or it can't be compiled
+  task<std::string> load_shader(std::string path, shader_stage stage,
+                                std::vector<shader_define> defines = {});
+
+  // Both stages load concurrently, the pipeline gets created once both are ready
+  // The paths go without extension, see load_shader
+  // It becomes the registry fallback, and its shaders are kept for other pipelines
+  task<pipeline_registry::pipeline_id> load_pipeline(std::string vert_path,
+                                                     std::string frag_path);
+
+  // Like base (from load_pipeline) but pulling its vertices by address, std::nullopt if
+  // the device can't or the vertex shader is missing. Not compiled until it's resolved
+  task<std::optional<pipeline_registry::pipeline_id>> load_pulling_pipeline(
+    std::string vert_path, pipeline_registry::pipeline_id base);
+
+  // Uploads the vertex and index buffers from a mesh file (the builtin quad if there's no file),
+  // done once the transfer queue finishes. Depending on the device the file gets mapped and
+  // copied or imported, or streamed through staging memory
+  task<void> load_geometry(std::string path);
+
+  // Everything needed to draw the first frame, returns the pipeline the scene draws with
+  // That's the vertex pulling one when the device supports it
+  task<pipeline_registry::pipeline_id> load_scene();
+
+private:
+  task<void> _load_packed_geometry(const asset_pack::entry& packed, std::string path);
+  const asset_pack::entry* _find_packed(std::string_view path) const;
+
+  // On the render thread, throws if the uploads couldn't even start
+  task<void> _finish_uploads(std::optional<std::vector<buffer_upload>> pending);
+
+private:
+  vk_context& _context;
+  job_system& _jobs;
+  thread_executor& _render_exec;
+  pipeline_registry& _pipelines;
+  stream_loader _streamer;
+  shader_compiler _compiler;
+  std::optional<asset_pack> _pack;
+};
+
+} // namespace ntf
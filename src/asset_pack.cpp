@@ -0,0 +1,156 @@
+#include "asset_pack.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef NTF_HAS_LZ4
+#include <lz4.h>
+#endif
+#ifdef NTF_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+bool codec_supported(ntf::asset_pack::codec c) {
+  switch (c) {
+    case ntf::asset_pack::codec::none:
+      return true;
+    case ntf::asset_pack::codec::lz4:
+#ifdef NTF_HAS_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case ntf::asset_pack::codec::zstd:
+#ifdef NTF_HAS_ZSTD
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+} // namespace
+
+namespace ntf {
+
+asset_pack::asset_pack(const std::string& path) :
+  _path(path), _file(path) {
+  auto invalid = [this](std::string_view why) {
+    return std::runtime_error{fmt::format("Invalid asset pack {}: {}", _path, why)};
+  };
+
+  if (_file.size() < sizeof(header)) {
+    throw invalid("truncated header");
+  }
+  std::memcpy(&_header, _file.data(), sizeof(header));
+  if (_header.magic != MAGIC || _header.version != VERSION || _header.chunk_size == 0) {
+    throw invalid("bad header");
+  }
+
+  // The tables are used in place, mmap gives page alignment and every record is 8 byte sized
+  const std::size_t entries_sz = sizeof(entry)*_header.entry_count;
+  const std::size_t chunks_sz = sizeof(chunk)*_header.chunk_count;
+  if (_file.size() < sizeof(header) + entries_sz + chunks_sz) {
+    throw invalid("truncated tables");
+  }
+  const std::byte* tables = _file.data() + sizeof(header);
+  _entries = {reinterpret_cast<const entry*>(tables), _header.entry_count};
+  _chunks = {reinterpret_cast<const chunk*>(tables + entries_sz), _header.chunk_count};
+
+  for (const auto& c : _chunks) {
+    if (c.offset + c.stored_size > _file.size() || c.raw_size > _header.chunk_size) {
+      throw invalid("chunk out of bounds");
+    }
+  }
+
+  for (const auto& e : _entries) {
+    const std::string_view name{e.name, strnlen(e.name, MAX_NAME)};
+    if (name.size() == MAX_NAME || e.first_chunk + uint64_t{e.chunk_count} > _chunks.size()) {
+      throw invalid("bad entry");
+    }
+    if (!codec_supported(e.compression)) {
+      throw invalid(fmt::format("{} uses a codec this build doesn't have", name));
+    }
+
+    // Chunk i goes at i*chunk_size, so only the last one can be short
+    uint64_t total{0};
+    bool full_chunks{true};
+    for (uint32_t i = 0; i < e.chunk_count; ++i) {
+      const auto& c = _chunks[e.first_chunk + i];
+      total += c.raw_size;
+      full_chunks = full_chunks && (i + 1 == e.chunk_count || c.raw_size == _header.chunk_size);
+    }
+    if (total != e.size || !full_chunks) {
+      throw invalid(fmt::format("{} chunks don't add up", name));
+    }
+    _by_name.emplace(name, &e);
+  }
+}
+
+const asset_pack::entry* asset_pack::find(std::string_view name) const {
+  auto it = _by_name.find(name);
+  return it == _by_name.end() ? nullptr : it->second;
+}
+
+task<void> asset_pack::unpack(const entry& e, std::span<std::byte> dst, job_system& jobs) const {
+  if (dst.size() < e.size) {
+    throw std::runtime_error{fmt::format("Not enough room to unpack {}", e.name)};
+  }
+  co_await schedule_on(jobs);
+
+  // Every chunk knows where it goes, so they don't depend on each other
+  // Waiting from a worker runs other jobs (probably our own chunks) in the meantime
+  job_counter counter;
+  std::atomic<bool> failed{false};
+  jobs.parallel_for("unpack chunks", e.chunk_count, 1, counter,
+    [this, &e, &failed, out = dst.data()](std::size_t begin, std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i) {
+        const auto offset = static_cast<std::size_t>(i)*_header.chunk_size;
+        if (!_unpack_chunk(e, _chunks[e.first_chunk + i], out + offset)) {
+          failed.store(true, std::memory_order_relaxed);
+        }
+      }
+    }
+  );
+  jobs.wait(counter);
+
+  if (failed.load(std::memory_order_relaxed)) {
+    throw std::runtime_error{fmt::format("Corrupted entry {} in asset pack {}", e.name, _path)};
+  }
+}
+
+bool asset_pack::_unpack_chunk(const entry& e, const chunk& c, std::byte* dst) const {
+  const std::byte* src = _file.data() + c.offset;
+  if (c.stored_size == c.raw_size) {
+    std::memcpy(dst, src, c.raw_size);
+    return true;
+  }
+
+  switch (e.compression) {
+#ifdef NTF_HAS_LZ4
+    case codec::lz4: {
+      const int n = LZ4_decompress_safe(reinterpret_cast<const char*>(src),
+                                        reinterpret_cast<char*>(dst),
+                                        static_cast<int>(c.stored_size),
+                                        static_cast<int>(c.raw_size));
+      return n == static_cast<int>(c.raw_size);
+    }
+#endif
+#ifdef NTF_HAS_ZSTD
+    case codec::zstd: {
+      const std::size_t n = ZSTD_decompress(dst, c.raw_size, src, c.stored_size);
+      return !ZSTD_isError(n) && n == c.raw_size;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+} // namespace ntf
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "async_task.hpp"
+#include "job_system.hpp"
+#include "mapped_file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ntf {
+
+// One file holding a whole content bundle (meshes, shaders, ...), built by tools/make_pack.py
+// Layout: header, entry table, chunk table, then the chunk data. Every entry is split in
+// chunks compressed on their own, so they can be decompressed in parallel straight into
+// their place in the destination. Chunks that don't compress are stored as they are
+class asset_pack {
+public:
+  static constexpr uint32_t MAGIC = 0x504B544E; // "NTKP"
+  static constexpr uint32_t VERSION = 1;
+  static constexpr std::size_t MAX_NAME = 64;
+
+  enum class codec : uint32_t {
+    none = 0,
+    lz4,
+    zstd,
+  };
+
+  struct header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t chunk_count;
+    uint32_t chunk_size; // Uncompressed size of every chunk but the last of each entry
+    uint32_t reserved;
+  };
+
+  struct entry {
+    char name[MAX_NAME]; // Null terminated, the path the loose file would have
+    uint64_t size; // Uncompressed
+    codec compression;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    uint32_t reserved;
+  };
+
+  struct chunk {
+    uint64_t offset; // From the start of the pack
+    uint32_t stored_size; // Same as raw_size if stored uncompressed
+    uint32_t raw_size;
+  };
+
+public:
+  // Maps the pack and checks the tables, throws if it's broken or uses a missing codec
+  explicit asset_pack(const std::string& path);
+
+public:
+  const entry* find(std::string_view name) const;
+
+  // Decompresses on the workers into dst (at least entry.size bytes), done once all the
+  // chunks are. Throws if any chunk fails to decompress
+  task<void> unpack(const entry& e, std::span<std::byte> dst, job_system& jobs) const;
+
+  std::size_t entry_count() const { return _entries.size(); }
+
+private:
+  bool _unpack_chunk(const entry& e, const chunk& c, std::byte* dst) const;
+
+private:
+  std::string _path;
+  mapped_file _file;
+  header _header;
+  std::span<const entry> _entries;
+  std::span<const chunk> _chunks;
+  std::unordered_map<std::string_view, const entry*> _by_name;
+};
+
+} // namespace ntf
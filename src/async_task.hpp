@@ -0,0 +1,378 @@
+#pragma once
+
+#include "job_system.hpp"
+
+#include <atomic>
+#include <array>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace ntf {
+
+template<typename T = void>
+class task;
+
+namespace detail {
+
+template<typename T>
+using task_result = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+// Resumes whoever is awaiting the task once it finishes (symmetric transfer, no recursion)
+struct task_final_awaiter {
+  bool await_ready() const noexcept { return false; }
+
+  template<typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    return h.promise().continuation;
+  }
+
+  void await_resume() const noexcept {}
+};
+
+struct task_promise_base {
+  std::coroutine_handle<> continuation{std::noop_coroutine()};
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  task_final_awaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template<typename T>
+struct task_promise : public task_promise_base {
+  std::optional<T> value;
+
+  task<T> get_return_object() noexcept;
+
+  template<typename U>
+  void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+  T result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template<>
+struct task_promise<void> : public task_promise_base {
+  task<void> get_return_object() noexcept;
+
+  void return_void() const noexcept {}
+
+  void result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+} // namespace detail
+
+// Lazy coroutine, starts running when awaited
+// Resumes the awaiting coroutine on whichever thread the task finished on
+template<typename T>
+class task {
+public:
+  using promise_type = detail::task_promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+public:
+  explicit task(handle_type handle) noexcept : _handle(handle) {}
+
+  task(task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+  task& operator=(task&& other) noexcept {
+    if (this != &other) {
+      _destroy();
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+
+  task(const task&) = delete;
+  task& operator=(const task&) = delete;
+
+  ~task() { _destroy(); }
+
+public:
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    _handle.promise().continuation = awaiting;
+    return _handle;
+  }
+
+  T await_resume() { return _handle.promise().result(); }
+
+private:
+  void _destroy() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+private:
+  handle_type _handle;
+};
+
+namespace detail {
+
+template<typename T>
+task<T> task_promise<T>::get_return_object() noexcept {
+  return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+  return task<void>{std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+}
+
+// Starts right away and destroys itself at the end, used to drive tasks from non coroutines
+struct detached_task {
+  struct promise_type {
+    detached_task get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+template<typename T>
+detached_task run_detached(task<T>& t, std::optional<task_result<T>>& out,
+                           std::exception_ptr& error, std::atomic<bool>& done) {
+  try {
+    if constexpr (std::is_void_v<T>) {
+      co_await t;
+      out.emplace();
+    } else {
+      out.emplace(co_await t);
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // Nothing passed by reference can be touched after this, the waiter may be gone
+  done.store(true, std::memory_order_release);
+}
+
+// when_all bookkeeping: one count per child plus one for the parent itself
+struct when_all_latch {
+  std::atomic<std::size_t> remaining;
+  std::coroutine_handle<> parent;
+
+  bool count_down() noexcept { return remaining.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+};
+
+struct when_all_child {
+  struct promise_type {
+    when_all_latch* latch{nullptr};
+
+    when_all_child get_return_object() noexcept {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+
+    auto final_suspend() const noexcept {
+      // The last child to finish resumes the parent
+      struct awaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          when_all_latch* latch = h.promise().latch;
+          h.destroy();
+          return latch->count_down() ? latch->parent : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+      };
+      return awaiter{};
+    }
+
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+when_all_child make_when_all_child(task<T>& t, std::optional<task_result<T>>& out,
+                                   std::exception_ptr& error) {
+  try {
+    if constexpr (std::is_void_v<T>) {
+      co_await t;
+      out.emplace();
+    } else {
+      out.emplace(co_await t);
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+}
+
+template<std::size_t N>
+struct when_all_awaiter {
+  when_all_latch& latch;
+  std::array<when_all_child, N> children;
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> parent) noexcept {
+    latch.parent = parent;
+    for (auto& child : children) {
+      child.handle.promise().latch = &latch;
+      child.handle.resume();
+    }
+    // If every child already finished inline, keep going without suspending
+    return !latch.count_down();
+  }
+
+  void await_resume() const noexcept {}
+};
+
+} // namespace detail
+
+// Runs all the tasks concurrently and returns all of their results
+// void tasks produce a std::monostate. The first exception thrown (if any) is rethrown
+template<typename... Ts>
+task<std::tuple<detail::task_result<Ts>...>> when_all(task<Ts>... tasks) {
+  std::tuple<std::optional<detail::task_result<Ts>>...> results;
+  std::array<std::exception_ptr, sizeof...(Ts)> errors;
+  detail::when_all_latch latch{sizeof...(Ts) + 1, {}};
+
+  co_await [&]<std::size_t... I>(std::index_sequence<I...>) {
+    return detail::when_all_awaiter<sizeof...(Ts)>{
+      latch, {detail::make_when_all_child(tasks, std::get<I>(results), errors[I])...}
+    };
+  }(std::index_sequence_for<Ts...>{});
+
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  co_return std::apply([](auto&... r) {
+    return std::tuple<detail::task_result<Ts>...>{std::move(*r)...};
+  }, results);
+}
+
+// Resumes the awaiting coroutine inside a job, on any thread of the job system
+inline auto schedule_on(job_system& jobs) {
+  struct awaiter {
+    job_system& jobs;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { jobs.run("coroutine", [h]() { h.resume(); }); }
+    void await_resume() const noexcept {}
+  };
+  return awaiter{jobs};
+}
+
+// Resumes coroutines on one specific thread, whenever that thread calls poll()
+// Used to get back to the render thread for anything that touches the vulkan context
+class thread_executor {
+private:
+  struct entry {
+    std::coroutine_handle<> handle;
+    std::function<bool()> ready; // Checked on every poll, empty means ready right away
+  };
+
+public:
+  thread_executor() = default;
+
+  thread_executor(const thread_executor&) = delete;
+  thread_executor& operator=(const thread_executor&) = delete;
+
+public:
+  auto schedule() {
+    struct awaiter {
+      thread_executor& exec;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { exec._post({h, {}}); }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{*this};
+  }
+
+  // Resume on the executor thread once pred() returns true (eg. a fence got signaled)
+  template<typename Pred>
+  auto wait_until(Pred&& pred) {
+    struct awaiter {
+      thread_executor& exec;
+      std::function<bool()> ready;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { exec._post({h, std::move(ready)}); }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{*this, std::forward<Pred>(pred)};
+  }
+
+  // Resumes every ready coroutine, returns false if there was nothing to do
+  bool poll() {
+    {
+      std::scoped_lock lock{_mtx};
+      for (auto& e : _pending) {
+        _polling.emplace_back(std::move(e));
+      }
+      _pending.clear();
+    }
+
+    bool resumed{false};
+    std::size_t kept{0};
+    for (std::size_t i = 0; i < _polling.size(); ++i) {
+      auto e = std::move(_polling[i]);
+      if (e.ready && !e.ready()) {
+        _polling[kept++] = std::move(e);
+        continue;
+      }
+      e.handle.resume(); // Anything it posts goes to _pending, not to this list
+      resumed = true;
+    }
+    _polling.resize(kept);
+
+    return resumed;
+  }
+
+private:
+  void _post(entry e) {
+    std::scoped_lock lock{_mtx};
+    _pending.emplace_back(std::move(e));
+  }
+
+private:
+  std::mutex _mtx;
+  std::vector<entry> _pending; // Guarded by _mtx
+  std::vector<entry> _polling; // Executor thread only
+};
+
+// Blocks until the task finishes, calling poll() in the meantime
+// poll should do something useful, like running jobs or a thread_executor
+template<typename T, typename Poll>
+T sync_wait(task<T> t, Poll&& poll) {
+  std::optional<detail::task_result<T>> result;
+  std::exception_ptr error;
+  std::atomic<bool> done{false};
+
+  detail::run_detached(t, result, error, done);
+  while (!done.load(std::memory_order_acquire)) {
+    poll();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  if constexpr (!std::is_void_v<T>) {
+    return std::move(*result);
+  }
+}
+
+} // namespace ntf
@@ -0,0 +1,65 @@
+#include "draw_list.hpp"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+namespace ntf {
+
+void draw_list::sort() {
+  _order.resize(_commands.size());
+  _scratch.resize(_commands.size());
+  for (std::size_t i = 0; i < _commands.size(); ++i) {
+    _order[i] = {_commands[i].key, static_cast<uint32_t>(i)};
+  }
+
+  _radix_sort(_order, _scratch);
+
+  _sorted.clear();
+  _sorted.reserve(_commands.size());
+  for (const auto& entry : _order) {
+    _sorted.emplace_back(_commands[entry.index]);
+  }
+}
+
+void draw_list::_radix_sort(std::span<sort_entry> entries, std::span<sort_entry> scratch) {
+  // Least significant byte first, a counting sort per byte keeps it stable
+  constexpr std::size_t RADIX = 256;
+  constexpr std::size_t PASSES = sizeof(uint64_t);
+
+  // All the histograms in one go over the keys
+  std::array<std::array<uint32_t, RADIX>, PASSES> counts{};
+  for (const auto& entry : entries) {
+    for (std::size_t pass = 0; pass < PASSES; ++pass) {
+      ++counts[pass][(entry.key >> (pass*8)) & 0xFF];
+    }
+  }
+
+  std::span<sort_entry> src = entries;
+  std::span<sort_entry> dst = scratch;
+  for (std::size_t pass = 0; pass < PASSES; ++pass) {
+    auto& count = counts[pass];
+
+    // Every key has the same byte here, this pass wouldn't move anything. Most of the key
+    // is often unused (a few pipelines, no descriptor sets), so this skips most passes
+    if (std::ranges::find(count, static_cast<uint32_t>(entries.size())) != count.end()) {
+      continue;
+    }
+
+    uint32_t offset{0};
+    for (auto& c : count) {
+      offset += std::exchange(c, offset);
+    }
+    for (const auto& entry : src) {
+      dst[count[(entry.key >> (pass*8)) & 0xFF]++] = entry;
+    }
+    std::swap(src, dst);
+  }
+
+  // Odd number of passes done, the result is in the scratch space
+  if (src.data() != entries.data()) {
+    std::ranges::copy(src, entries.begin());
+  }
+}
+
+} // namespace ntf
@@ -0,0 +1,114 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include "linear_arena.hpp"
+#include "pipeline_desc.hpp"
+#include "vk_resources.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace ntf {
+
+// Per draw data pushed directly into the command buffer, no descriptors needed
+// The vertex fields are only read by pipelines pulling their vertices (see
+// vk_context::pulling_pipeline_desc), the rest get them from the bound vertex buffer
+// Vertex i has its position at float i*position_stride and its color at float
+// color_offset + i*color_stride, which covers both vertex layouts
+struct draw_push_constants {
+  glm::mat4 transform;
+  VkDeviceAddress vertices{0}; // Device address of the vertex buffer
+  uint32_t position_stride{0}; // In floats, like the rest
+  uint32_t color_offset{0};
+  uint32_t color_stride{0};
+};
+
+// The pulling shaders declare the same block (res/shader_pull.vs.glsl)
+static_assert(offsetof(draw_push_constants, vertices) == 64);
+
+// Sort key of a draw, the most expensive state to change in the highest bits so sorting
+// groups draws sharing it: pipeline, descriptor set, geometry and then depth (front to back)
+// Fields wider than their bits get truncated, which only makes sorting less effective
+struct draw_key {
+  static constexpr uint32_t PIPELINE_BITS = 16;
+  static constexpr uint32_t DESCRIPTOR_SET_BITS = 12;
+  static constexpr uint32_t GEOMETRY_BITS = 16;
+  static constexpr uint32_t DEPTH_BITS = 20;
+  static_assert(PIPELINE_BITS + DESCRIPTOR_SET_BITS + GEOMETRY_BITS + DEPTH_BITS == 64);
+
+  // depth in [0, 1], clamped
+  static constexpr uint64_t make(uint32_t pipeline, uint32_t descriptor_set, uint32_t geometry,
+                                 float depth) {
+    constexpr uint64_t DEPTH_MAX = (1ull << DEPTH_BITS) - 1;
+    const float clamped = depth < 0.f ? 0.f : (depth > 1.f ? 1.f : depth);
+    const auto quantized = static_cast<uint64_t>(clamped*static_cast<float>(DEPTH_MAX));
+
+    uint64_t key = pipeline & ((1ull << PIPELINE_BITS) - 1);
+    key = (key << DESCRIPTOR_SET_BITS) | (descriptor_set & ((1ull << DESCRIPTOR_SET_BITS) - 1));
+    key = (key << GEOMETRY_BITS) | (geometry & ((1ull << GEOMETRY_BITS) - 1));
+    return (key << DEPTH_BITS) | quantized;
+  }
+};
+
+struct draw_command {
+  uint64_t key;
+  pipeline_handle pipeline;
+  const pipeline_desc* state; // Dynamic state to draw with, has to outlive recording
+  uint32_t geometry; // There's a single geometry for now, always 0
+  draw_push_constants push;
+};
+
+// State changes while recording a frame, the fewer per draw the better sorted it was
+struct draw_stats {
+  uint32_t draws{0};
+  uint32_t pipeline_binds{0};
+  uint32_t geometry_binds{0};
+};
+
+// A frame's draws, radix sorted by key before recording
+// Lives in the frame arena, so building it every frame doesn't allocate once warmed up
+class draw_list {
+public:
+  explicit draw_list(linear_arena& arena) :
+    _commands(arena), _sorted(arena), _order(arena), _scratch(arena) {}
+
+public:
+  void reserve(std::size_t count) { _commands.reserve(count); }
+
+  // state is what the pipeline leaves to dynamic state, see vk_context::set_draw_pipeline
+  void add(uint64_t key, pipeline_handle pipeline, const pipeline_desc& state, uint32_t geometry,
+           const draw_push_constants& push) {
+    _commands.emplace_back(key, pipeline, &state, geometry, push);
+  }
+
+  // Stable, draws with the same key keep the order they were added in
+  void sort();
+
+  // In key order after sort, insertion order before
+  std::span<const draw_command> commands() const {
+    return _sorted.empty() ? std::span<const draw_command>{_commands} : _sorted;
+  }
+
+  std::size_t size() const { return _commands.size(); }
+
+private:
+  // Only keys and indices move around while sorting, the commands get gathered once
+  struct sort_entry {
+    uint64_t key;
+    uint32_t index;
+  };
+
+  static void _radix_sort(std::span<sort_entry> entries, std::span<sort_entry> scratch);
+
+private:
+  arena_vector<draw_command> _commands;
+  arena_vector<draw_command> _sorted;
+  arena_vector<sort_entry> _order, _scratch;
+};
+
+} // namespace ntf
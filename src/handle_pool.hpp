@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ntf {
+
+// Index into a handle_pool plus the generation of the slot when it was handed out
+// Releasing a slot bumps its generation, so handles to it that are still around go stale
+// instead of silently pointing at whatever takes the slot next
+template<typename Tag>
+struct handle {
+  static constexpr uint32_t INVALID_INDEX = UINT32_MAX;
+
+  uint32_t index{INVALID_INDEX};
+  uint32_t generation{0};
+
+  explicit operator bool() const { return index != INVALID_INDEX; }
+  bool operator==(const handle&) const = default;
+};
+
+// Struct of arrays storage addressed by generational handles
+// Every field lives in its own contiguous column, so lookups are a bounds and generation
+// check plus an index, and scanning a single field over all slots touches only that field
+// Freed slots are reused, columns never shrink
+template<typename Tag, typename... Ts>
+class handle_pool {
+  // Columns are vectors, and std::vector<bool> can't hand out references
+  static_assert((!std::is_same_v<Ts, bool> && ...), "Use uint8_t columns instead of bool");
+
+public:
+  using handle_type = handle<Tag>;
+
+  template<std::size_t I>
+  using column_type = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+public:
+  handle_pool() = default;
+
+  handle_pool(const handle_pool&) = delete;
+  handle_pool& operator=(const handle_pool&) = delete;
+
+public:
+  handle_type allocate(Ts... values) {
+    uint32_t index;
+    if (!_free.empty()) {
+      index = _free.back();
+      _free.pop_back();
+      _assign(index, std::index_sequence_for<Ts...>{}, std::move(values)...);
+    } else {
+      index = static_cast<uint32_t>(_generations.size());
+      _append(std::index_sequence_for<Ts...>{}, std::move(values)...);
+      _generations.emplace_back(0);
+      _alive.emplace_back(0);
+    }
+
+    _alive[index] = 1;
+    return handle_type{index, _generations[index]};
+  }
+
+  void release(handle_type h) {
+    _check(h);
+    ++_generations[h.index];
+    _alive[h.index] = 0;
+    _free.emplace_back(h.index);
+  }
+
+  bool valid(handle_type h) const {
+    return h.index < _generations.size() && _alive[h.index] &&
+           _generations[h.index] == h.generation;
+  }
+
+  // Throws on stale handles, using one is always a bug
+  template<std::size_t I>
+  column_type<I>& get(handle_type h) {
+    _check(h);
+    return std::get<I>(_columns)[h.index];
+  }
+
+  template<std::size_t I>
+  const column_type<I>& get(handle_type h) const {
+    _check(h);
+    return std::get<I>(_columns)[h.index];
+  }
+
+  // Whole column, dead slots included (check alive() when scanning)
+  template<std::size_t I>
+  std::span<const column_type<I>> column() const { return std::get<I>(_columns); }
+
+  bool alive(uint32_t index) const { return _alive[index]; }
+
+  // f(handle) for every live slot, in index order
+  template<typename F>
+  void for_each(F&& f) const {
+    for (uint32_t i = 0; i < _generations.size(); ++i) {
+      if (_alive[i]) {
+        f(handle_type{i, _generations[i]});
+      }
+    }
+  }
+
+  std::size_t size() const { return _generations.size() - _free.size(); }
+  std::size_t capacity() const { return _generations.size(); }
+
+private:
+  void _check(handle_type h) const {
+    if (!valid(h)) {
+      throw std::runtime_error{"Stale or invalid resource handle"};
+    }
+  }
+
+  template<std::size_t... Is>
+  void _assign(uint32_t index, std::index_sequence<Is...>, Ts&&... values) {
+    ((std::get<Is>(_columns)[index] = std::move(values)), ...);
+  }
+
+  template<std::size_t... Is>
+  void _append(std::index_sequence<Is...>, Ts&&... values) {
+    (std::get<Is>(_columns).emplace_back(std::move(values)), ...);
+  }
+
+private:
+  std::tuple<std::vector<Ts>...> _columns;
+  std::vector<uint32_t> _generations;
+  std::vector<uint8_t> _alive;
+  std::vector<uint32_t> _free;
+};
+
+} // namespace ntf
@@ -0,0 +1,115 @@
+#include "io_ring.hpp"
+
+#include <cerrno>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
+
+namespace ntf {
+
+#ifdef NTF_HAS_LIBURING
+
+io_ring::io_ring(job_system& jobs, uint32_t entries) :
+  _jobs(jobs), _entries(entries) {
+  if (io_uring_queue_init(entries, &_ring, 0) < 0) {
+    throw std::runtime_error{"Failed to create io_uring"};
+  }
+}
+
+io_ring::~io_ring() {
+  // The kernel might still be writing into the buffers, let the reads land first
+  while (in_flight() > 0) {
+    _reaped.clear();
+    _reap(_reaped);
+    std::this_thread::yield();
+  }
+  io_uring_queue_exit(&_ring);
+}
+
+bool io_ring::submit_read(int fd, void* dst, uint32_t size, uint64_t offset, uint64_t user_data) {
+  io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+  if (!sqe) {
+    return false;
+  }
+  io_uring_prep_read(sqe, fd, dst, size, offset);
+  io_uring_sqe_set_data64(sqe, user_data);
+  _in_flight.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void io_ring::flush() {
+  io_uring_submit(&_ring);
+}
+
+void io_ring::_reap(std::vector<completion>& out) {
+  io_uring_cqe* cqe;
+  while (io_uring_peek_cqe(&_ring, &cqe) == 0) {
+    out.emplace_back(completion{io_uring_cqe_get_data64(cqe), cqe->res});
+    io_uring_cqe_seen(&_ring, cqe);
+    _in_flight.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+#else
+
+io_ring::io_ring(job_system& jobs, uint32_t entries) :
+  _jobs(jobs), _entries(entries) {
+  _done.reserve(entries);
+}
+
+io_ring::~io_ring() {
+  // Jobs still running hold a pointer to us
+  while (in_flight() > 0) {
+    _reaped.clear();
+    _reap(_reaped);
+    std::this_thread::yield();
+  }
+}
+
+bool io_ring::submit_read(int fd, void* dst, uint32_t size, uint64_t offset, uint64_t user_data) {
+  if (in_flight() >= _entries) {
+    return false;
+  }
+  _in_flight.fetch_add(1, std::memory_order_relaxed);
+
+  _jobs.run("io_ring read", [this, fd, dst, size, offset, user_data]() {
+    // pread can come back short (signals, pipes), keep going until EOF
+    std::size_t total{0};
+    int32_t result{0};
+    while (total < size) {
+      const ssize_t n = pread(fd, static_cast<std::byte*>(dst) + total, size - total,
+                              static_cast<off_t>(offset + total));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        result = n < 0 ? -errno : 0;
+        break;
+      }
+      total += static_cast<std::size_t>(n);
+    }
+    if (result == 0) {
+      result = static_cast<int32_t>(total);
+    }
+
+    std::scoped_lock lock{_done_mtx};
+    _done.emplace_back(completion{user_data, result});
+  });
+  return true;
+}
+
+void io_ring::flush() {} // Already running
+
+void io_ring::_reap(std::vector<completion>& out) {
+  {
+    std::scoped_lock lock{_done_mtx};
+    out.swap(_done);
+  }
+  // Only now, the destructor waits for the jobs to be done with the mutex
+  _in_flight.fetch_sub(static_cast<uint32_t>(out.size()), std::memory_order_release);
+}
+
+#endif
+
+} // namespace ntf
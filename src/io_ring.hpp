@@ -0,0 +1,70 @@
+#pragma once
+
+#include "job_system.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef NTF_HAS_LIBURING
+#include <liburing.h>
+#endif
+
+namespace ntf {
+
+// Asynchronous file reads, submitted and reaped from a single thread
+// With liburing the reads go through io_uring, otherwise they run as pread jobs on the
+// workers. Either way nothing blocks the submitting thread
+class io_ring {
+public:
+  struct completion {
+    uint64_t user_data;
+    int32_t result; // Bytes read, or -errno
+  };
+
+  explicit io_ring(job_system& jobs, uint32_t entries = 64);
+  ~io_ring();
+
+  io_ring(const io_ring&) = delete;
+  io_ring& operator=(const io_ring&) = delete;
+
+public:
+  // Queues a read of size bytes at offset into dst, false if the queue is full
+  bool submit_read(int fd, void* dst, uint32_t size, uint64_t offset, uint64_t user_data);
+
+  // Hands the queued reads to the kernel
+  void flush();
+
+  // Calls f(completion) for every read that finished since the last call, without waiting
+  template<typename F>
+  std::size_t reap(F&& f) {
+    _reaped.clear();
+    _reap(_reaped);
+    for (const auto& c : _reaped) {
+      f(c);
+    }
+    return _reaped.size();
+  }
+
+  uint32_t in_flight() const { return _in_flight.load(std::memory_order_acquire); }
+
+private:
+  void _reap(std::vector<completion>& out);
+
+private:
+  job_system& _jobs;
+  uint32_t _entries;
+  std::atomic<uint32_t> _in_flight{0};
+  std::vector<completion> _reaped; // Reused, reaping doesn't allocate once warm
+
+#ifdef NTF_HAS_LIBURING
+  io_uring _ring;
+#else
+  std::mutex _done_mtx;
+  std::vector<completion> _done; // Filled by the workers
+#endif
+};
+
+} // namespace ntf
@@ -0,0 +1,294 @@
+#include "job_system.hpp"
+
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+// Which worker of which job system is running on this thread. Owner threads are told
+// apart by id instead, a thread can own several systems at once
+thread_local const ntf::job_system* t_system{nullptr};
+thread_local uint32_t t_index{0};
+
+} // namespace
+
+namespace ntf {
+
+bool job_deque::push(job* j) {
+  const int64_t bottom = _bottom.load(std::memory_order_relaxed);
+  const int64_t top = _top.load(std::memory_order_acquire);
+  if (bottom - top >= CAPACITY) {
+    return false;
+  }
+
+  _buffer[bottom & (CAPACITY-1)].store(j, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  _bottom.store(bottom + 1, std::memory_order_relaxed);
+  return true;
+}
+
+job* job_deque::pop() {
+  const int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+  _bottom.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = _top.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    // Empty
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  job* j = _buffer[bottom & (CAPACITY-1)].load(std::memory_order_relaxed);
+  if (top == bottom) {
+    // Last element, race against the thieves for it
+    if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      j = nullptr;
+    }
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return j;
+}
+
+job* job_deque::steal() {
+  int64_t top = _top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const int64_t bottom = _bottom.load(std::memory_order_acquire);
+
+  if (top >= bottom) {
+    return nullptr;
+  }
+
+  job* j = _buffer[top & (CAPACITY-1)].load(std::memory_order_relaxed);
+  if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return nullptr; // Someone else got it first
+  }
+  return j;
+}
+
+job_system::job_system(job_system_config config) :
+  _profiler(std::move(config.profiler)), _owner(std::this_thread::get_id()) {
+  uint32_t worker_count = config.worker_count;
+  if (worker_count == 0) {
+    const uint32_t cores = std::thread::hardware_concurrency();
+    worker_count = cores > 1 ? cores - 1 : 1;
+  }
+
+  // Participant 0 is the calling thread
+  for (uint32_t i = 0; i < worker_count + 1; ++i) {
+    _participants.emplace_back(std::make_unique<participant>());
+  }
+  _external_queue.resize((_participants.size() + 1)*JOB_POOL_SIZE);
+
+  for (uint32_t i = 1; i < worker_count + 1; ++i) {
+    _workers.emplace_back([this, i]() { _worker_main(i); });
+
+#ifdef __linux__
+    if (config.pin_workers) {
+      const uint32_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % cores, &cpus);
+      pthread_setaffinity_np(_workers.back().native_handle(), sizeof(cpus), &cpus);
+    }
+#endif
+  }
+}
+
+job_system::~job_system() {
+  // Jobs still queued are dropped, wait on their counters before getting here
+  _should_stop.store(true, std::memory_order_release);
+  _work_epoch.fetch_add(1, std::memory_order_release);
+  _work_epoch.notify_all();
+
+  for (auto& worker : _workers) {
+    worker.join();
+  }
+}
+
+uint32_t job_system::_this_index() const {
+  if (t_system == this) {
+    return t_index;
+  }
+  return std::this_thread::get_id() == _owner ? 0 : EXTERNAL_THREAD;
+}
+
+job& job_system::_alloc_job() {
+  const uint32_t index = _this_index();
+
+  job* j;
+  if (index == EXTERNAL_THREAD) {
+    std::scoped_lock lock{_external_mtx};
+    j = &_external_pool[_external_next_slot++ % JOB_POOL_SIZE];
+  } else {
+    auto& self = *_participants[index];
+    j = &self.pool[self.next_slot++ % JOB_POOL_SIZE];
+  }
+
+  // Every slot is in flight, help out until the oldest one finishes
+  while (!j->done.load(std::memory_order_acquire)) {
+    if (job* other = _find_job(index)) {
+      _execute(*other, index);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  j->done.store(false, std::memory_order_relaxed);
+  return *j;
+}
+
+void job_system::_submit(job& j, job_counter* dependency) {
+  if (j.counter) {
+    j.counter->_pending.fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  if (dependency) {
+    dependency->_lock_wait();
+    if (dependency->_pending.load(std::memory_order_acquire) != 0) {
+      // Scheduled by whoever finishes the last job of the dependency
+      j.next = dependency->_waiting;
+      dependency->_waiting = &j;
+      dependency->_unlock();
+      return;
+    }
+    dependency->_unlock();
+  }
+
+  _push(j);
+}
+
+void job_system::_push(job& j) {
+  const uint32_t index = _this_index();
+
+  if (index == EXTERNAL_THREAD || !_participants[index]->deque.push(&j)) {
+    std::scoped_lock lock{_external_mtx};
+    const std::size_t count = _external_count.load(std::memory_order_relaxed);
+    _external_queue[(_external_head + count) % _external_queue.size()] = &j;
+    _external_count.store(count + 1, std::memory_order_release);
+  }
+
+  _work_epoch.fetch_add(1, std::memory_order_release);
+  _work_epoch.notify_one();
+}
+
+job* job_system::_find_job(uint32_t index) {
+  if (index != EXTERNAL_THREAD) {
+    if (job* j = _participants[index]->deque.pop()) {
+      return j;
+    }
+  }
+
+  if (_external_count.load(std::memory_order_acquire) > 0) {
+    std::scoped_lock lock{_external_mtx};
+    const std::size_t count = _external_count.load(std::memory_order_relaxed);
+    if (count > 0) {
+      job* j = _external_queue[_external_head];
+      _external_head = (_external_head + 1) % _external_queue.size();
+      _external_count.store(count - 1, std::memory_order_release);
+      return j;
+    }
+  }
+
+  // Steal from the others, starting with our neighbour so thieves spread out
+  const uint32_t count = thread_count();
+  const uint32_t first = index == EXTERNAL_THREAD ? 0 : index + 1;
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint32_t victim = (first + i) % count;
+    if (victim == index) {
+      continue;
+    }
+
+    // A failed steal means another thread made progress, so retry while there is work left
+    auto& deque = _participants[victim]->deque;
+    while (!deque.empty()) {
+      if (job* j = deque.steal()) {
+        return j;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+void job_system::_execute(job& j, uint32_t index) {
+  if (_profiler.on_begin) {
+    _profiler.on_begin(j.name, index);
+  }
+
+  j.invoke(j);
+
+  if (_profiler.on_end) {
+    _profiler.on_end(j.name, index);
+  }
+
+  job_counter* counter = j.counter;
+  j.done.store(true, std::memory_order_release); // The slot can be reused from here on
+
+  if (!counter) {
+    return;
+  }
+
+  job* waiting{nullptr};
+  counter->_lock_wait();
+  if (counter->_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    waiting = std::exchange(counter->_waiting, nullptr);
+  }
+  counter->_unlock(); // The counter might be destroyed after this
+
+  while (waiting) {
+    job* next = waiting->next;
+    _push(*waiting);
+    waiting = next;
+  }
+}
+
+void job_system::_worker_main(uint32_t index) {
+  t_system = this;
+  t_index = index;
+
+  while (true) {
+    const uint32_t epoch = _work_epoch.load(std::memory_order_acquire);
+    if (_should_stop.load(std::memory_order_acquire)) {
+      break;
+    }
+
+    if (job* j = _find_job(index)) {
+      _execute(*j, index);
+      continue;
+    }
+
+    // Nothing to do, sleep until something gets submitted
+    _work_epoch.wait(epoch, std::memory_order_acquire);
+  }
+}
+
+void job_system::wait(const job_counter& counter) {
+  const uint32_t index = _this_index();
+
+  while (!counter.done()) {
+    if (job* j = _find_job(index)) {
+      _execute(*j, index);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+bool job_system::run_one() {
+  const uint32_t index = _this_index();
+
+  if (job* j = _find_job(index)) {
+    _execute(*j, index);
+    return true;
+  }
+  return false;
+}
+
+} // namespace ntf
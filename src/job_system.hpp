@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ntf {
+
+class job_system;
+
+// Counts pending jobs. Waiting on a counter runs other jobs until it reaches zero,
+// and jobs can be scheduled to start only after a counter is done
+class job_counter {
+public:
+  job_counter() = default;
+
+  job_counter(const job_counter&) = delete;
+  job_counter& operator=(const job_counter&) = delete;
+
+public:
+  // Also checks the lock, so a counter is never reported done while the last job
+  // is still touching it (it might get destroyed right after)
+  bool done() const {
+    return _pending.load(std::memory_order_acquire) == 0 && !_lock.test(std::memory_order_acquire);
+  }
+
+private:
+  void _lock_wait() {
+    while (_lock.test_and_set(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  void _unlock() { _lock.clear(std::memory_order_release); }
+
+private:
+  std::atomic<uint32_t> _pending{0};
+  std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+  struct job* _waiting{nullptr}; // Jobs to schedule once the counter reaches zero
+
+  friend class job_system;
+};
+
+// A unit of work, the callable is stored inline so submitting never allocates
+struct job {
+  static constexpr std::size_t STORAGE_SIZE = 64;
+
+  void (*invoke)(job&){nullptr};
+  alignas(std::max_align_t) std::byte storage[STORAGE_SIZE];
+
+  const char* name{nullptr};
+  job_counter* counter{nullptr}; // Signaled when the job finishes
+  job* next{nullptr}; // For the waiting list of a counter
+  std::atomic<bool> done{true}; // The slot can be reused
+};
+
+// Chase-Lev work-stealing deque with a fixed capacity
+// The owner thread pushes and pops from the bottom, other threads steal from the top
+class job_deque {
+public:
+  static constexpr int64_t CAPACITY = 4096;
+
+public:
+  bool push(job* j);
+  job* pop();
+  job* steal();
+
+  bool empty() const {
+    return _bottom.load(std::memory_order_acquire) <= _top.load(std::memory_order_acquire);
+  }
+
+private:
+  alignas(64) std::atomic<int64_t> _top{0};
+  alignas(64) std::atomic<int64_t> _bottom{0};
+  std::array<std::atomic<job*>, CAPACITY> _buffer{};
+};
+
+struct job_profiler {
+  // Called on the thread running the job, with the index of that thread (0 is the owner)
+  std::function<void(const char* name, uint32_t thread)> on_begin;
+  std::function<void(const char* name, uint32_t thread)> on_end;
+};
+
+struct job_system_config {
+  // Worker threads to spawn, by default one per core minus the owner thread
+  uint32_t worker_count{0};
+
+  // Pin each worker to a core (worker i runs on core i+1, the owner keeps its affinity)
+  bool pin_workers{false};
+
+  job_profiler profiler{};
+};
+
+// Work-stealing job scheduler
+// The thread constructing the system becomes participant 0: it gets its own deque and
+// runs jobs while waiting on counters. Any other thread can submit and wait too,
+// its jobs go through a shared queue instead
+class job_system {
+private:
+  static constexpr std::size_t JOB_POOL_SIZE = 1024;
+  static constexpr uint32_t EXTERNAL_THREAD = UINT32_MAX;
+
+  // Per participant state, each one in its own cache lines
+  struct alignas(64) participant {
+    job_deque deque;
+    std::array<job, JOB_POOL_SIZE> pool;
+    std::size_t next_slot{0};
+  };
+
+public:
+  explicit job_system(job_system_config config = {});
+  ~job_system();
+
+  job_system(const job_system&) = delete;
+  job_system& operator=(const job_system&) = delete;
+
+public:
+  // Run f on any thread, counter is signaled when done
+  // Jobs must not throw, there is nobody to catch the exception
+  template<typename F>
+  void run(const char* name, job_counter& counter, F&& f) {
+    _submit(_make_job(name, &counter, std::forward<F>(f)), nullptr);
+  }
+
+  // Fire and forget, for jobs nobody waits on (eg. resuming a coroutine)
+  template<typename F>
+  void run(const char* name, F&& f) {
+    _submit(_make_job(name, nullptr, std::forward<F>(f)), nullptr);
+  }
+
+  // Same, but the job doesn't start before dependency is done
+  template<typename F>
+  void run_after(const job_counter& dependency, const char* name, job_counter& counter, F&& f) {
+    _submit(_make_job(name, &counter, std::forward<F>(f)), const_cast<job_counter*>(&dependency));
+  }
+
+  // Split [0, count) in batches of batch_size and run f(begin, end) for each one
+  template<typename F>
+  void parallel_for(const char* name, std::size_t count, std::size_t batch_size,
+                    job_counter& counter, F&& f) {
+    batch_size = batch_size ? batch_size : 1;
+    for (std::size_t begin = 0; begin < count; begin += batch_size) {
+      const std::size_t end = std::min(begin + batch_size, count);
+      run(name, counter, [f, begin, end]() { f(begin, end); });
+    }
+  }
+
+  // Run jobs on the calling thread until the counter reaches zero
+  void wait(const job_counter& counter);
+
+  // Run at most one pending job on the calling thread, returns false if there was none
+  bool run_one();
+
+  uint32_t thread_count() const { return static_cast<uint32_t>(_participants.size()); }
+
+private:
+  template<typename F>
+  job& _make_job(const char* name, job_counter* counter, F&& f) {
+    using fun_t = std::decay_t<F>;
+    static_assert(sizeof(fun_t) <= job::STORAGE_SIZE, "Job callable too big, capture less");
+    static_assert(alignof(fun_t) <= alignof(std::max_align_t));
+
+    job& j = _alloc_job();
+    new (j.storage) fun_t{std::forward<F>(f)};
+    j.invoke = +[](job& self) {
+      auto& fun = *std::launder(reinterpret_cast<fun_t*>(self.storage));
+      fun();
+      fun.~fun_t();
+    };
+    j.name = name;
+    j.counter = counter;
+    j.next = nullptr;
+    return j;
+  }
+
+  job& _alloc_job();
+  void _submit(job& j, job_counter* dependency);
+  void _push(job& j);
+  job* _find_job(uint32_t index);
+  void _execute(job& j, uint32_t index);
+  void _worker_main(uint32_t index);
+  uint32_t _this_index() const;
+
+private:
+  job_profiler _profiler;
+  std::thread::id _owner; // Participant 0, the thread that constructed the system
+  std::vector<std::unique_ptr<participant>> _participants;
+  std::vector<std::thread> _workers;
+
+  // Jobs submitted from threads that are not participants, or that didn't fit in a deque
+  // The ring can hold every job slot at once, so pushing to it never fails
+  std::mutex _external_mtx;
+  std::vector<job*> _external_queue;
+  std::size_t _external_head{0};
+  std::atomic<std::size_t> _external_count{0};
+  std::array<job, JOB_POOL_SIZE> _external_pool;
+  std::size_t _external_next_slot{0};
+
+  // Bumped on every submit, idle workers sleep on it
+  std::atomic<uint32_t> _work_epoch{0};
+  std::atomic<bool> _should_stop{false};
+};
+
+} // namespace ntf
@@ -0,0 +1,35 @@
+#include "linear_arena.hpp"
+
+#include <algorithm>
+
+namespace ntf {
+
+linear_arena::linear_arena(std::size_t capacity) :
+  _data(std::make_unique_for_overwrite<std::byte[]>(capacity)), _capacity(capacity) {}
+
+void linear_arena::reset() {
+  _peak = std::max(_peak, used());
+
+  if (!_overflow.empty()) {
+    // Didn't fit last time, grow so the next round is all pointer bumps again
+    _overflow.clear();
+    _capacity = std::max(_capacity*2, _peak);
+    _data = std::make_unique_for_overwrite<std::byte[]>(_capacity);
+  }
+
+  _offset = 0;
+  _overflow_size = 0;
+}
+
+void* linear_arena::_allocate_overflow(std::size_t size, std::size_t align) {
+  // new only guarantees the default alignment, so pad for anything bigger
+  const std::size_t padded = size + (align > alignof(std::max_align_t) ? align : 0);
+  auto& block = _overflow.emplace_back(std::make_unique_for_overwrite<std::byte[]>(padded));
+  _overflow_size += size;
+
+  void* ptr = block.get();
+  std::size_t space = padded;
+  return std::align(align, size, ptr, space);
+}
+
+} // namespace ntf
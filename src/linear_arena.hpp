@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace ntf {
+
+// Bump allocator for short lived data, everything gets freed at once by reset()
+// Allocations that don't fit go to the heap until the next reset, which grows the block
+// so the same load fits next time. Not thread safe, each thread needs its own arena
+class linear_arena {
+public:
+  static constexpr std::size_t DEFAULT_CAPACITY = 64*1024;
+
+public:
+  explicit linear_arena(std::size_t capacity = DEFAULT_CAPACITY);
+
+  linear_arena(linear_arena&&) noexcept = default;
+  linear_arena& operator=(linear_arena&&) noexcept = default;
+
+  linear_arena(const linear_arena&) = delete;
+  linear_arena& operator=(const linear_arena&) = delete;
+
+public:
+  void* allocate(std::size_t size, std::size_t align) {
+    const auto base = reinterpret_cast<std::uintptr_t>(_data.get());
+    const std::size_t offset = ((base + _offset + align - 1) & ~(align - 1)) - base;
+    if (offset + size > _capacity) {
+      return _allocate_overflow(size, align);
+    }
+
+    _offset = offset + size;
+    return _data.get() + offset;
+  }
+
+  template<typename T>
+  T* allocate(std::size_t count = 1) {
+    return static_cast<T*>(allocate(count*sizeof(T), alignof(T)));
+  }
+
+  // Invalidates everything allocated so far. Destructors are not called
+  void reset();
+
+  std::size_t used() const { return _offset + _overflow_size; }
+  std::size_t capacity() const { return _capacity; }
+  std::size_t peak() const { return _peak; } // Most bytes in use between two resets
+
+private:
+  void* _allocate_overflow(std::size_t size, std::size_t align);
+
+private:
+  std::unique_ptr<std::byte[]> _data;
+  std::size_t _capacity;
+  std::size_t _offset{0};
+  std::size_t _peak{0};
+
+  std::vector<std::unique_ptr<std::byte[]>> _overflow;
+  std::size_t _overflow_size{0};
+};
+
+// Lets STL containers allocate from an arena, deallocate does nothing
+template<typename T>
+class arena_allocator {
+public:
+  using value_type = T;
+
+public:
+  arena_allocator(linear_arena& arena) noexcept : _arena(&arena) {}
+
+  template<typename U>
+  arena_allocator(const arena_allocator<U>& other) noexcept : _arena(other._arena) {}
+
+public:
+  T* allocate(std::size_t n) { return _arena->allocate<T>(n); }
+  void deallocate(T*, std::size_t) noexcept {}
+
+  template<typename U>
+  bool operator==(const arena_allocator<U>& other) const noexcept { return _arena == other._arena; }
+
+private:
+  linear_arena* _arena;
+
+  template<typename U>
+  friend class arena_allocator;
+};
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+} // namespace ntf
@@ -1,40 +1,73 @@
-#include "vulkan_context.hpp"
+#include "render_thread.hpp"
+#include "simulation.hpp"
 
 #include <fmt/format.h>
 
 #include <cassert>
-#include <optional>
-#include <string>
-#include <sstream>
-#include <fstream>
+#include <charconv>
+#include <deque>
+#include <string_view>
 
 constexpr std::size_t WIDTH = 800;
 constexpr std::size_t HEIGHT = 600;
 
-static std::optional<std::string> file_contents(std::string_view path) {
-  std::string out {};
-  std::fstream fs{path.data()};
-
-  if (!fs.is_open()) {
-    return std::nullopt;
-  }
-
-  std::ostringstream ss;
-  ss << fs.rdbuf();
-  out = ss.str();
-
-  fs.close();
-  return out;
-}
-
 #ifdef NDEBUG
 const bool enable_validation_layers = false;
 #else
 const bool enable_validation_layers = true;
 #endif
 
+// How often to retry handing key events to a full simulation queue
+constexpr double KEY_RETRY_SECONDS = .005;
+
+// Instances per pass of --bench-vertex-fetch when not given
+constexpr uint32_t BENCH_INSTANCES = 64;
+
+struct app_threads {
+  ntf::simulation* sim;
+  ntf::render_thread* renderer;
+  std::deque<ntf::key_event> pending_keys; // Didn't fit in the simulation queue yet
+};
+
+// Hands the pending key events to the simulation in order, stops at the first one that
+// doesn't fit. Dropping them instead could lose a release and leave a key held forever
+void flush_keys(app_threads& app) {
+  while (!app.pending_keys.empty() && app.sim->push_event(app.pending_keys.front())) {
+    app.pending_keys.pop_front();
+  }
+}
+
+int main(int argc, char** argv) {
+  ntf::render_options options;
+  options.enable_layers = enable_validation_layers;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg{argv[i]};
+    if (arg == "--check-allocs") {
+      // Validation layers allocate from the render thread too, they'd fail the check
+      options.check_allocs = true;
+      options.enable_layers = false;
+    } else if (arg == "--bench-vertex-fetch") {
+      options.bench_instances = BENCH_INSTANCES;
+
+      // Optionally followed by the instance count
+      if (i + 1 < argc) {
+        const std::string_view count{argv[i + 1]};
+        uint32_t instances{0};
+        const auto [end, ec] = std::from_chars(count.data(), count.data() + count.size(),
+                                               instances);
+        if (ec == std::errc{} && end == count.data() + count.size() && instances > 0) {
+          options.bench_instances = instances;
+          ++i;
+        }
+      }
+    } else {
+      fmt::print(stderr,
+                 "Unknown argument {}\nUsage: {} [--check-allocs] [--bench-vertex-fetch [N]]\n",
+                 arg, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
 
-int main() {
   glfwInit();
 
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -53,72 +86,53 @@ int main() {
   }
 
   std::vector<const char*> extensions(glfw_extensions, glfw_extensions+glfw_extension_count);
-  if (enable_validation_layers) {
+  if (options.enable_layers) {
     extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME); // for setting up a debug messenger
   }
 
-  ntf::vk_context context;
-  try {
-    context.create_instance(enable_validation_layers, extensions);
-
-    context.create_surface([win](VkInstance instance, VkSurfaceKHR* surface) -> bool {
-      // Create window surface (has to be done before device selection)
-      // It needs the VK_KHR_surface extension, but it is already included
-      // in the glfw extension list
-      return glfwCreateWindowSurface(instance, win, nullptr, surface);
-      // If not using glfw, it has to be done passing an XCB connection and
-      // window details from X11 in vkCreateXcbSurfaceKHR
-      // (who cares about windows right?)
-    });
-
-    context.pick_physical_device();
-
-    context.create_logical_device();
-
-    context.create_swapchain([win](std::size_t& width, std::size_t& height) {
-      int w{0}, h{0}; // Not the same as WIDTH, HEIGHT in high DPI screens
-      glfwGetFramebufferSize(win, &w, &h);
-      width = static_cast<std::size_t>(w);
-      height = static_cast<std::size_t>(h);
-    });
-
-    context.create_imageviews();
-
-    context.create_renderpass();
-
-    auto vert_src = file_contents("res/shader.vs.spv");
-    auto frag_src = file_contents("res/shader.fs.spv");
+  // The simulation and the render thread own the application state and the vulkan context
+  // this thread only handles window events
+  ntf::simulation sim;
+  ntf::render_thread renderer{win, options, std::move(extensions), sim.snapshots()};
 
-    context.create_graphics_pipeline(vert_src.value(), frag_src.value());
+  app_threads app{&sim, &renderer, {}};
+  glfwSetWindowUserPointer(win, &app);
 
-    context.create_framebuffers();
-
-    context.create_commandpool();
-    context.create_commandbuffers();
-
-    context.create_sync_objects();
+  glfwSetFramebufferSizeCallback(win, +[](GLFWwindow* win, int w, int h) {
+    auto app = reinterpret_cast<app_threads*>(glfwGetWindowUserPointer(win));
+    if (!app->renderer->push_event(ntf::resize_event{w, h})) {
+      fmt::print(stderr, "Render event queue full, dropped resize event\n");
+    }
+  });
 
-    context.create_buffers();
+  glfwSetKeyCallback(win, +[](GLFWwindow* win, int key, int scancode, int action, int mods) {
+    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
+      glfwSetWindowShouldClose(win, 1);
+      return;
+    }
 
-    glfwSetWindowUserPointer(win, &context);
+    auto app = reinterpret_cast<app_threads*>(glfwGetWindowUserPointer(win));
+    app->pending_keys.push_back(ntf::key_event{key, scancode, action, mods});
+    flush_keys(*app);
+  });
 
-    glfwSetFramebufferSizeCallback(win, +[](GLFWwindow* win, int, int) {
-      auto ctx = reinterpret_cast<ntf::vk_context*>(glfwGetWindowUserPointer(win));
-      ctx->flag_dirty_framebuffer();
-    });
+  try {
+    sim.start();
+    renderer.start();
 
+    // Rendering doesn't depend on this loop anymore, so we can block until something happens
+    // Unless some key events are still waiting for room in the simulation queue
     while (!glfwWindowShouldClose(win)) {
-      glfwPollEvents();
-
-      if (glfwGetKey(win, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-        glfwSetWindowShouldClose(win, 1);
+      if (app.pending_keys.empty()) {
+        glfwWaitEvents();
+      } else {
+        glfwWaitEventsTimeout(KEY_RETRY_SECONDS);
+        flush_keys(app);
       }
-
-      context.draw_frame();
     }
-    context.wait_idle();
 
-    context.destroy();
+    renderer.stop();
+    sim.stop();
   } catch (const std::exception& ex) {
     fmt::print(stderr, "{}\n", ex.what());
 
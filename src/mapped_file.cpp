@@ -0,0 +1,116 @@
+#include "mapped_file.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+namespace ntf {
+
+mapped_file::mapped_file(const std::string& path, std::size_t alignment) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error{fmt::format("Failed to open file {}", path)};
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error{fmt::format("Failed to map file {}", path)};
+  }
+
+  const auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  alignment = std::max(alignment, page);
+  _size = static_cast<std::size_t>(st.st_size);
+  _mapped_size = (_size + alignment - 1) & ~(alignment - 1);
+
+  // Reserve zeroed pages with room to align, then put the file on top of the aligned part
+  // Pages past the end of the file stay anonymous, reading them doesn't SIGBUS
+  _reservation_size = _mapped_size + alignment - page;
+  _reservation = mmap(nullptr, _reservation_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (_reservation == MAP_FAILED) {
+    _reservation = nullptr;
+    close(fd);
+    throw std::runtime_error{fmt::format("Failed to map file {}", path)};
+  }
+
+  const auto base = reinterpret_cast<std::uintptr_t>(_reservation);
+  void* aligned = reinterpret_cast<void*>((base + alignment - 1) & ~(alignment - 1));
+  void* mapped = mmap(aligned, _size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  close(fd); // The mapping keeps its own reference
+  if (mapped == MAP_FAILED) {
+    _unmap();
+    throw std::runtime_error{fmt::format("Failed to map file {}", path)};
+  }
+
+  // Mostly read front to back, once, so start reading ahead right away
+  madvise(mapped, _size, MADV_SEQUENTIAL);
+  madvise(mapped, _size, MADV_WILLNEED);
+  _data = static_cast<const std::byte*>(mapped);
+}
+
+mapped_file::~mapped_file() {
+  _unmap();
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept :
+  _reservation(std::exchange(other._reservation, nullptr)),
+  _reservation_size(std::exchange(other._reservation_size, 0)),
+  _data(std::exchange(other._data, nullptr)),
+  _size(std::exchange(other._size, 0)),
+  _mapped_size(std::exchange(other._mapped_size, 0)) {}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept {
+  if (this != &other) {
+    _unmap();
+    _reservation = std::exchange(other._reservation, nullptr);
+    _reservation_size = std::exchange(other._reservation_size, 0);
+    _data = std::exchange(other._data, nullptr);
+    _size = std::exchange(other._size, 0);
+    _mapped_size = std::exchange(other._mapped_size, 0);
+  }
+  return *this;
+}
+
+void mapped_file::_unmap() {
+  if (_reservation) {
+    munmap(_reservation, _reservation_size);
+  }
+  _reservation = nullptr;
+  _data = nullptr;
+  _size = 0;
+  _mapped_size = 0;
+}
+
+bool replace_file(const std::string& path, std::span<const char> data) {
+  const std::string tmp_path = fmt::format("{}.tmp", path);
+  std::error_code err;
+
+  // Closed by hand, a failed flush (eg. a full disk) only shows up there
+  std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  file.close();
+  if (!file) {
+    std::filesystem::remove(tmp_path, err);
+    return false;
+  }
+
+  std::filesystem::rename(tmp_path, path, err);
+  if (err) {
+    std::error_code ignored;
+    std::filesystem::remove(tmp_path, ignored);
+    return false;
+  }
+  return true;
+}
+
+} // namespace ntf
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string>
+
+namespace ntf {
+
+// Read only view of a whole file through mmap, pages get read in as they are touched
+// The mapping can be over-aligned, with the tail padded with zeros up to the alignment,
+// which is what importing it as external host memory needs
+class mapped_file {
+public:
+  mapped_file() = default;
+
+  // Alignment below the page size gets rounded up to it
+  explicit mapped_file(const std::string& path, std::size_t alignment = 0);
+  ~mapped_file();
+
+  mapped_file(mapped_file&& other) noexcept;
+  mapped_file& operator=(mapped_file&& other) noexcept;
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+public:
+  const std::byte* data() const { return _data; }
+  std::size_t size() const { return _size; }
+
+  // Size of the mapping, a multiple of the alignment
+  std::size_t mapped_size() const { return _mapped_size; }
+
+  std::span<const std::byte> bytes() const { return {_data, _size}; }
+  explicit operator bool() const { return _data != nullptr; }
+
+private:
+  void _unmap();
+
+private:
+  void* _reservation{nullptr}; // Whole address range, including the alignment slack
+  std::size_t _reservation_size{0};
+  const std::byte* _data{nullptr};
+  std::size_t _size{0};
+  std::size_t _mapped_size{0};
+};
+
+// Written aside and renamed, so a crash halfway never leaves a truncated file behind
+bool replace_file(const std::string& path, std::span<const char> data);
+
+} // namespace ntf
@@ -0,0 +1,226 @@
+#include "mip_residency.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace ntf {
+
+mip_residency::mip_residency(callbacks cb, uint32_t frames_in_flight) :
+  _cb(std::move(cb)), _frames_in_flight(frames_in_flight) {}
+
+mip_residency::~mip_residency() {
+  detach();
+}
+
+void mip_residency::attach(vk_memory_budget& budget) {
+  detach();
+  _budget = &budget;
+  _evictor = budget.add_evictor(memory_category::textures,
+    [this](uint32_t heap, VkDeviceSize bytes) -> VkDeviceSize {
+      // Textures only live in device local memory, evicting them frees nothing elsewhere
+      return _budget->is_device_local(heap) ? evict(bytes) : 0;
+    }
+  );
+}
+
+void mip_residency::detach() {
+  if (_budget) {
+    _budget->remove_evictor(_evictor);
+    _budget = nullptr;
+  }
+}
+
+VkDeviceSize mip_residency::mip_bytes(const texture_desc& desc, uint32_t mip) {
+  const VkDeviceSize w = std::max(desc.width >> mip, 1u);
+  const VkDeviceSize h = std::max(desc.height >> mip, 1u);
+  return w*h*desc.texel_size;
+}
+
+auto mip_residency::add(const texture_desc& desc) -> texture_id {
+  texture_id id;
+  if (!_free_ids.empty()) {
+    id = _free_ids.back();
+    _free_ids.pop_back();
+  } else {
+    id = static_cast<texture_id>(_textures.size());
+    _textures.emplace_back();
+  }
+
+  auto& t = _textures[id];
+  const uint32_t generation = t.generation;
+  t = texture_state{};
+  t.generation = generation;
+  t.desc = desc;
+  t.alive = true;
+
+  // First mip that fits in the tail size, or the last one
+  const uint32_t last = desc.mip_count ? desc.mip_count - 1 : 0;
+  while (t.tail_mip < last && std::max(desc.width, desc.height) >> t.tail_mip > TAIL_SIZE) {
+    ++t.tail_mip;
+  }
+  t.resident_mip = t.tail_mip;
+  t.wanted_mip = t.tail_mip;
+
+  for (uint32_t mip = t.tail_mip; mip < desc.mip_count; ++mip) {
+    _resident_bytes += mip_bytes(desc, mip);
+  }
+  return id;
+}
+
+void mip_residency::remove(texture_id id) {
+  auto& t = _textures[id];
+  for (uint32_t mip = t.resident_mip; mip < t.desc.mip_count; ++mip) {
+    _resident_bytes -= mip_bytes(t.desc, mip);
+  }
+  t.alive = false;
+  t.pending_mip = NO_MIP;
+  ++t.generation; // Whatever is still streaming for it lands nowhere
+  _free_ids.emplace_back(id);
+}
+
+void mip_residency::report_screen_size(texture_id id, float width, float height) {
+  auto& t = _textures[id];
+  t.screen_width = std::max(t.screen_width, width);
+  t.screen_height = std::max(t.screen_height, height);
+}
+
+void mip_residency::on_stream_done(const stream_ticket& ticket, bool ok) {
+  auto& t = _textures[ticket.id];
+  if (!t.alive || t.generation != ticket.generation || t.pending_mip != ticket.mip) {
+    return;
+  }
+  t.pending_mip = NO_MIP;
+  if (ok) {
+    t.resident_mip = ticket.mip;
+    t.unneeded_frames = 0;
+    _resident_bytes += mip_bytes(t.desc, ticket.mip);
+  }
+}
+
+uint32_t mip_residency::_wanted_mip(const texture_state& t) const {
+  if (t.screen_width <= 0.f || t.screen_height <= 0.f) {
+    return t.tail_mip; // Not on screen
+  }
+
+  // One texel per pixel, past that the GPU would sample a coarser mip anyway
+  const float ratio = std::max(static_cast<float>(t.desc.width)/t.screen_width,
+                               static_cast<float>(t.desc.height)/t.screen_height);
+  if (ratio <= 1.f) {
+    return 0;
+  }
+  const auto mip = static_cast<uint32_t>(std::floor(std::log2(ratio)));
+  return std::min(mip, t.tail_mip);
+}
+
+void mip_residency::update() {
+  _evict_retired(_frame);
+  _candidates.clear();
+
+  for (texture_id id = 0; id < _textures.size(); ++id) {
+    auto& t = _textures[id];
+    if (!t.alive) {
+      continue;
+    }
+
+    t.wanted_mip = _wanted_mip(t);
+    const float area = t.screen_width*t.screen_height;
+    t.screen_width = t.screen_height = 0.f;
+
+    // A mip waiting to be evicted still has its image, it can't be streamed in again yet
+    if (t.resident_mip > t.wanted_mip && t.pending_mip == NO_MIP &&
+        !_is_retired(id, t.resident_mip - 1)) {
+      // Missing levels, weighted by how much of the screen shows them blurry
+      const auto deficit = static_cast<float>(t.resident_mip - t.wanted_mip);
+      _candidates.emplace_back(load_candidate{id, deficit*std::max(area, 1.f)});
+    }
+
+    // Finer than needed for a while, give one level back
+    if (t.resident_mip < t.wanted_mip && t.pending_mip == NO_MIP) {
+      if (++t.unneeded_frames > EVICT_DELAY) {
+        _drop_finest(id);
+        t.unneeded_frames = 0;
+      }
+    } else {
+      t.unneeded_frames = 0;
+    }
+  }
+
+  const auto count = std::min<std::size_t>(_candidates.size(), MAX_LOADS_PER_UPDATE);
+  std::partial_sort(_candidates.begin(), _candidates.begin() + count, _candidates.end(),
+    [](const load_candidate& a, const load_candidate& b) { return a.score > b.score; }
+  );
+
+  // One level at a time, every level needs the coarser ones anyway
+  for (std::size_t i = 0; i < count; ++i) {
+    auto& t = _textures[_candidates[i].id];
+    const uint32_t mip = t.resident_mip - 1;
+    if (!_cb.stream_in(stream_ticket{_candidates[i].id, mip, t.generation})) {
+      break; // Out of budget, the rest won't fit either
+    }
+    t.pending_mip = mip;
+  }
+  ++_frame;
+}
+
+void mip_residency::release_retired() {
+  _evict_retired(UINT64_MAX);
+}
+
+void mip_residency::_evict_retired(uint64_t frame) {
+  // The fence of the frame a mip was dropped on got waited for frames_in_flight updates later
+  std::erase_if(_retired, [this, frame](const retired_mip& retired) {
+    if (frame < retired.last_frame) {
+      return false;
+    }
+    // Removed textures have their images freed by the caller
+    if (_textures[retired.id].generation == retired.generation) {
+      _cb.evict(retired.id, retired.mip);
+    }
+    return true;
+  });
+}
+
+VkDeviceSize mip_residency::evict(VkDeviceSize bytes) {
+  // Surplus first (resident finer than wanted), then whatever is least visible
+  auto surplus = [](const texture_state& t) {
+    return static_cast<int64_t>(t.wanted_mip) - static_cast<int64_t>(t.resident_mip);
+  };
+
+  VkDeviceSize freed{0};
+  while (freed < bytes) {
+    texture_id victim{NO_MIP};
+    for (texture_id id = 0; id < _textures.size(); ++id) {
+      const auto& t = _textures[id];
+      if (!t.alive || t.resident_mip >= t.tail_mip || t.pending_mip != NO_MIP) {
+        continue;
+      }
+      if (victim == NO_MIP || surplus(t) > surplus(_textures[victim])) {
+        victim = id;
+      }
+    }
+    if (victim == NO_MIP) {
+      break;
+    }
+
+    freed += mip_bytes(_textures[victim].desc, _textures[victim].resident_mip);
+    _drop_finest(victim);
+  }
+  return freed;
+}
+
+bool mip_residency::_is_retired(texture_id id, uint32_t mip) const {
+  const uint32_t generation = _textures[id].generation;
+  return std::any_of(_retired.begin(), _retired.end(), [&](const retired_mip& retired) {
+    return retired.id == id && retired.mip == mip && retired.generation == generation;
+  });
+}
+
+void mip_residency::_drop_finest(texture_id id) {
+  auto& t = _textures[id];
+  _retired.emplace_back(retired_mip{id, t.resident_mip, t.generation, _frame + _frames_in_flight});
+  _resident_bytes -= mip_bytes(t.desc, t.resident_mip);
+  ++t.resident_mip;
+}
+
+} // namespace ntf
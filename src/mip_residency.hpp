@@ -0,0 +1,148 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include "vk_memory_budget.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace ntf {
+
+// Decides which mips of each texture live in device memory
+// Textures start with only their tail resident (the mips at most TAIL_SIZE texels wide).
+// Every frame the renderer reports how big each texture shows up on screen, which gives the
+// mip it needs. update() streams in the missing mips one level at a time, the most visible
+// deficits first, and drops mips that haven't been needed for a while. Under memory pressure
+// evict() gives back the least needed mips, attach() registers it as the textures evictor
+// of a vk_memory_budget. The image side lives in the callbacks: stream_in starts loading a
+// mip, and the loader reports back with on_stream_done. Dropped mips only reach the evict
+// callback once the frames that could sample them are done, eviction can happen in the
+// middle of a frame. Shaders should clamp to resident_mip() (minLod)
+class mip_residency {
+public:
+  using texture_id = uint32_t;
+
+  static constexpr uint32_t TAIL_SIZE = 64;
+  static constexpr uint32_t NO_MIP = UINT32_MAX;
+
+  // Frames a mip has to go unneeded before it gets dropped, so it doesn't thrash
+  static constexpr uint32_t EVICT_DELAY = 120;
+
+  // Mips started per update, each one is a whole upload
+  static constexpr uint32_t MAX_LOADS_PER_UPDATE = 4;
+
+  struct texture_desc {
+    uint32_t width;
+    uint32_t height;
+    uint32_t mip_count;
+    uint32_t texel_size; // Bytes, uncompressed formats
+  };
+
+  // Identifies one stream_in, the generation tells apart textures reusing the same id
+  struct stream_ticket {
+    texture_id id;
+    uint32_t mip;
+    uint32_t generation;
+  };
+
+  struct callbacks {
+    // Starts loading ticket.mip, returns false if it can't right now (eg. over budget)
+    // The ticket goes back to on_stream_done
+    std::function<bool(const stream_ticket&)> stream_in;
+    // The mip has to go, every frame that could sample it is done
+    std::function<void(texture_id, uint32_t mip)> evict;
+  };
+
+private:
+  struct texture_state {
+    texture_desc desc{};
+    uint32_t tail_mip{0}; // Always resident
+    uint32_t resident_mip{0}; // Finest resident mip, everything coarser is resident too
+    uint32_t wanted_mip{0};
+    uint32_t pending_mip{NO_MIP}; // Being streamed in
+    uint32_t unneeded_frames{0}; // In a row with the finest mip unneeded
+    uint32_t generation{0}; // Bumped on remove, stale tickets don't match anymore
+    float screen_width{0.f}, screen_height{0.f}; // Largest use this frame
+    bool alive{false};
+  };
+
+  struct load_candidate {
+    texture_id id;
+    float score;
+  };
+
+  // Dropped, but frames still in flight can be sampling it
+  struct retired_mip {
+    texture_id id;
+    uint32_t mip;
+    uint32_t generation;
+    uint64_t last_frame; // Evicted once update() ran on this frame
+  };
+
+public:
+  // Once per frame update() counts frames, frames_in_flight of them can be sampling a mip
+  mip_residency(callbacks cb, uint32_t frames_in_flight);
+  ~mip_residency();
+
+  // The evictor registered by attach points back here
+  mip_residency(const mip_residency&) = delete;
+  mip_residency& operator=(const mip_residency&) = delete;
+
+public:
+  // The tail has to be resident already, it's uploaded with the texture
+  texture_id add(const texture_desc& desc);
+  // Its images are the caller's from here on, dropped mips not evicted yet included
+  void remove(texture_id id);
+
+  // Size on screen in pixels of one use of the texture this frame, the largest use wins
+  void report_screen_size(texture_id id, float width, float height);
+
+  // From the loader, once the mip stream_in started is in place (or failed to be)
+  // Tickets of removed textures are ignored, even if the id got reused since
+  void on_stream_done(const stream_ticket& ticket, bool ok);
+
+  // Once per frame, after every report_screen_size and after waiting for the frame's fence
+  // Evicts the dropped mips no frame in flight samples anymore
+  void update();
+
+  // Evicts every dropped mip right away, once the device is idle
+  void release_retired();
+
+  // Frees at least bytes if possible, least needed mips first, never the tails
+  // Returns how much it freed
+  VkDeviceSize evict(VkDeviceSize bytes);
+
+  // Registers evict as the textures evictor of budget, for the device local heaps
+  // Detached on destruction, or when attaching somewhere else
+  void attach(vk_memory_budget& budget);
+  void detach();
+
+  uint32_t resident_mip(texture_id id) const { return _textures[id].resident_mip; }
+  uint32_t wanted_mip(texture_id id) const { return _textures[id].wanted_mip; }
+  VkDeviceSize resident_bytes() const { return _resident_bytes; }
+
+  static VkDeviceSize mip_bytes(const texture_desc& desc, uint32_t mip);
+
+private:
+  uint32_t _wanted_mip(const texture_state& t) const;
+  void _drop_finest(texture_id id);
+  bool _is_retired(texture_id id, uint32_t mip) const;
+  void _evict_retired(uint64_t frame);
+
+private:
+  callbacks _cb;
+  vk_memory_budget* _budget{nullptr};
+  vk_memory_budget::evictor_id _evictor{0};
+  std::vector<texture_state> _textures;
+  std::vector<texture_id> _free_ids;
+  std::vector<load_candidate> _candidates; // Reused every update
+  std::vector<retired_mip> _retired;
+  uint32_t _frames_in_flight;
+  uint64_t _frame{0}; // Updates so far
+  VkDeviceSize _resident_bytes{0};
+};
+
+} // namespace ntf
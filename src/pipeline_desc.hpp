@@ -0,0 +1,156 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <type_traits>
+
+namespace ntf {
+
+// FNV-1a, stable across runs so hashes can be stored
+class fnv1a {
+public:
+  static constexpr uint64_t OFFSET_BASIS = 0xcbf29ce484222325ull;
+  static constexpr uint64_t PRIME = 0x100000001b3ull;
+
+public:
+  void add(const void* data, std::size_t size) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+      _value = (_value ^ bytes[i])*PRIME;
+    }
+  }
+
+  // Scalars and enums only, anything with padding would hash garbage
+  template<typename T>
+  requires(std::is_scalar_v<T>)
+  void add(T value) { add(&value, sizeof(value)); }
+
+  uint64_t value() const { return _value; }
+
+private:
+  uint64_t _value{OFFSET_BASIS};
+};
+
+inline uint64_t shader_hash(std::string_view spirv) {
+  fnv1a h;
+  h.add(spirv.data(), spirv.size());
+  return h.value();
+}
+
+// Shader features toggled with specialization constants, the value is the constant_id
+// of a bool constant in the shaders (see res/shader.*.glsl)
+enum class shader_feature : uint32_t {
+  vertex_color = 0, // Vertex stage, white without it
+  grayscale = 1, // Fragment stage
+};
+
+constexpr uint32_t SHADER_FEATURE_COUNT = 2;
+
+// Set of shader features, one variant of the same SPIR-V modules
+// Usable at compile time, so variants can be named as constants
+class variant_key {
+public:
+  constexpr variant_key() = default;
+  constexpr variant_key(std::initializer_list<shader_feature> features) {
+    for (auto feature : features) {
+      _bits |= bit(feature);
+    }
+  }
+
+  static constexpr variant_key from_bits(uint32_t bits) {
+    variant_key key;
+    key._bits = bits;
+    return key;
+  }
+
+public:
+  constexpr bool has(shader_feature feature) const { return _bits & bit(feature); }
+
+  constexpr variant_key with(shader_feature feature) const {
+    return from_bits(_bits | bit(feature));
+  }
+  constexpr variant_key without(shader_feature feature) const {
+    return from_bits(_bits & ~bit(feature));
+  }
+
+  constexpr uint32_t bits() const { return _bits; }
+
+  constexpr bool operator==(const variant_key&) const = default;
+
+private:
+  static constexpr uint32_t bit(shader_feature feature) {
+    return 1u << static_cast<uint32_t>(feature);
+  }
+
+private:
+  uint32_t _bits{0};
+};
+
+// What the shaders do without any specialization
+constexpr variant_key DEFAULT_VARIANT{shader_feature::vertex_color};
+
+// Everything a graphics pipeline gets built from. Two equal descriptions give the same
+// pipeline, so they can share it
+struct pipeline_desc {
+  static constexpr std::size_t MAX_BINDINGS = 4;
+  static constexpr std::size_t MAX_ATTRIBUTES = 8;
+
+  // shader_hash of the SPIR-V for each stage
+  uint64_t vert_shader{0};
+  uint64_t frag_shader{0};
+  variant_key variant{DEFAULT_VARIANT}; // Specialization of both stages
+
+  // Vertex layout, one binding per stream. Attribute i goes to location i and is read from
+  // binding attribute_bindings[i]
+  uint32_t binding_count{0};
+  std::array<uint32_t, MAX_BINDINGS> binding_strides{};
+  uint32_t attribute_count{0};
+  std::array<uint32_t, MAX_ATTRIBUTES> attribute_bindings{};
+  std::array<VkFormat, MAX_ATTRIBUTES> attribute_formats{};
+  std::array<uint32_t, MAX_ATTRIBUTES> attribute_offsets{};
+
+  // Render state
+  VkPrimitiveTopology topology{VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST};
+  VkPolygonMode polygon_mode{VK_POLYGON_MODE_FILL};
+  VkCullModeFlags cull_mode{VK_CULL_MODE_BACK_BIT};
+  VkFrontFace front_face{VK_FRONT_FACE_CLOCKWISE};
+  bool blend{false}; // Alpha blending
+
+  // Render target
+  VkFormat color_format{VK_FORMAT_UNDEFINED};
+
+  bool operator==(const pipeline_desc&) const = default;
+};
+
+// Field by field, the padding between them never gets hashed
+inline uint64_t hash_value(const pipeline_desc& desc) {
+  fnv1a h;
+  h.add(desc.vert_shader);
+  h.add(desc.frag_shader);
+  h.add(desc.variant.bits());
+  h.add(desc.binding_count);
+  for (uint32_t i = 0; i < desc.binding_count; ++i) {
+    h.add(desc.binding_strides[i]);
+  }
+  h.add(desc.attribute_count);
+  for (uint32_t i = 0; i < desc.attribute_count; ++i) {
+    h.add(desc.attribute_bindings[i]);
+    h.add(desc.attribute_formats[i]);
+    h.add(desc.attribute_offsets[i]);
+  }
+  h.add(desc.topology);
+  h.add(desc.polygon_mode);
+  h.add(desc.cull_mode);
+  h.add(desc.front_face);
+  h.add(desc.blend);
+  h.add(desc.color_format);
+  return h.value();
+}
+
+} // namespace ntf
@@ -0,0 +1,371 @@
+#include "pipeline_registry.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// The list stores each field on its own, in the same order they get hashed
+template<typename T>
+void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+class list_reader {
+public:
+  explicit list_reader(std::span<const char> data) :
+    _data(data) {}
+
+public:
+  template<typename T>
+  bool get(T& value) {
+    if (_data.size() < sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, _data.data(), sizeof(value));
+    _data = _data.subspan(sizeof(value));
+    return true;
+  }
+
+private:
+  std::span<const char> _data;
+};
+
+void put_desc(std::string& out, const ntf::pipeline_desc& desc) {
+  put(out, desc.vert_shader);
+  put(out, desc.frag_shader);
+  put(out, desc.variant.bits());
+  put(out, desc.binding_count);
+  for (uint32_t i = 0; i < desc.binding_count; ++i) {
+    put(out, desc.binding_strides[i]);
+  }
+  put(out, desc.attribute_count);
+  for (uint32_t i = 0; i < desc.attribute_count; ++i) {
+    put(out, desc.attribute_bindings[i]);
+    put(out, desc.attribute_formats[i]);
+    put(out, desc.attribute_offsets[i]);
+  }
+  put(out, desc.topology);
+  put(out, desc.polygon_mode);
+  put(out, desc.cull_mode);
+  put(out, desc.front_face);
+  put(out, desc.blend);
+  put(out, desc.color_format);
+}
+
+bool get_desc(list_reader& in, ntf::pipeline_desc& desc) {
+  uint32_t variant{0};
+  if (!in.get(desc.vert_shader) || !in.get(desc.frag_shader) || !in.get(variant) ||
+      !in.get(desc.binding_count) || desc.binding_count > ntf::pipeline_desc::MAX_BINDINGS) {
+    return false;
+  }
+  desc.variant = ntf::variant_key::from_bits(variant);
+  for (uint32_t i = 0; i < desc.binding_count; ++i) {
+    if (!in.get(desc.binding_strides[i])) {
+      return false;
+    }
+  }
+  if (!in.get(desc.attribute_count) ||
+      desc.attribute_count > ntf::pipeline_desc::MAX_ATTRIBUTES) {
+    return false;
+  }
+  for (uint32_t i = 0; i < desc.attribute_count; ++i) {
+    if (!in.get(desc.attribute_bindings[i]) || !in.get(desc.attribute_formats[i]) ||
+        !in.get(desc.attribute_offsets[i]) ||
+        desc.attribute_bindings[i] >= desc.binding_count) {
+      return false;
+    }
+  }
+  return in.get(desc.topology) && in.get(desc.polygon_mode) && in.get(desc.cull_mode) &&
+         in.get(desc.front_face) && in.get(desc.blend) && in.get(desc.color_format);
+}
+
+} // namespace
+
+namespace ntf {
+
+pipeline_registry::pipeline_registry(vk_context& context, job_system& jobs) :
+  _context(context), _jobs(jobs) {}
+
+pipeline_registry::~pipeline_registry() {
+  destroy();
+}
+
+uint64_t pipeline_registry::add_shader(std::string spirv) {
+  const uint64_t hash = shader_hash(spirv);
+  _shaders.try_emplace(hash, std::move(spirv));
+  return hash;
+}
+
+auto pipeline_registry::set_fallback(const pipeline_desc& desc,
+                                     pipeline_handle pipeline) -> pipeline_id {
+  const pipeline_id id = request(desc);
+  auto& e = *_entries[_entries[id]->source];
+  if (e.state.load(std::memory_order_relaxed) == compile_state::idle) {
+    e.handle = pipeline;
+    e.state.store(compile_state::adopted, std::memory_order_relaxed);
+    if (_context.pipeline_libraries()) {
+      _in_flight.emplace_back(_entries[id]->source);
+      _optimize(_entries[id]->source);
+    }
+  }
+  _fallback = e.handle;
+  _target_format = desc.color_format;
+  return id;
+}
+
+auto pipeline_registry::set_fallback(const pipeline_desc& desc) -> pipeline_id {
+  const pipeline_id id = request(desc);
+  auto& e = *_entries[_entries[id]->source];
+  if (e.state.load(std::memory_order_relaxed) == compile_state::compiling) {
+    _jobs.wait(_compiles);
+    poll();
+  }
+
+  switch (e.state.load(std::memory_order_relaxed)) {
+    case compile_state::idle:
+      e.handle = _context.adopt_pipeline(
+        _context.build_pipeline(e.canonical, _context.current_target(),
+                                _shaders.at(e.desc.vert_shader), _shaders.at(e.desc.frag_shader)),
+        e.canonical
+      );
+      e.state.store(compile_state::adopted, std::memory_order_relaxed);
+      if (_context.pipeline_libraries()) {
+        _in_flight.emplace_back(_entries[id]->source);
+        _optimize(_entries[id]->source);
+      }
+      break;
+    case compile_state::failed:
+      throw std::runtime_error{fmt::format("Failed to compile fallback pipeline: {}", e.error)};
+    default:
+      break;
+  }
+
+  _fallback = e.handle;
+  _target_format = desc.color_format;
+  return id;
+}
+
+auto pipeline_registry::request(const pipeline_desc& desc) -> pipeline_id {
+  const uint64_t hash = hash_value(desc);
+  auto [first, last] = _by_hash.equal_range(hash);
+  for (auto it = first; it != last; ++it) {
+    if (_entries[it->second]->desc == desc) {
+      return it->second;
+    }
+  }
+
+  if (!_shaders.contains(desc.vert_shader) || !_shaders.contains(desc.frag_shader)) {
+    throw std::runtime_error{"Pipeline requested with unknown shaders"};
+  }
+
+  const auto id = static_cast<pipeline_id>(_entries.size());
+  auto& e = *_entries.emplace_back(std::make_unique<entry>());
+  e.desc = desc;
+  e.canonical = _context.canonical_pipeline_desc(desc);
+  e.source = id;
+  _by_hash.emplace(hash, id);
+
+  // Same pipeline as another one, only the dynamic state differs
+  const uint64_t canonical_hash = hash_value(e.canonical);
+  auto [canon_first, canon_last] = _by_canonical_hash.equal_range(canonical_hash);
+  for (auto it = canon_first; it != canon_last; ++it) {
+    if (_entries[it->second]->canonical == e.canonical) {
+      e.source = it->second;
+      return id;
+    }
+  }
+  _by_canonical_hash.emplace(canonical_hash, id);
+  return id;
+}
+
+pipeline_handle pipeline_registry::resolve(pipeline_id id) {
+  _entries[id]->used = true;
+  const pipeline_id source = _entries[id]->source;
+  auto& e = *_entries[source];
+  switch (e.state.load(std::memory_order_relaxed)) {
+    case compile_state::adopted:
+    case compile_state::optimizing:
+    case compile_state::optimized:
+      return e.handle;
+    case compile_state::idle:
+      _compile(source);
+      break;
+    default:
+      break;
+  }
+  return _fallback;
+}
+
+void pipeline_registry::poll() {
+  auto finished = [this](pipeline_id id) {
+    auto& e = *_entries[id];
+    switch (e.state.load(std::memory_order_acquire)) {
+      case compile_state::done:
+        e.handle = _context.adopt_pipeline(e.compiled, e.canonical);
+        e.state.store(compile_state::adopted, std::memory_order_relaxed);
+        if (_context.pipeline_libraries()) {
+          _optimize(id);
+          return false;
+        }
+        return true;
+      case compile_state::optimized:
+        if (e.compiled) {
+          _context.replace_pipeline(e.handle, e.compiled);
+        } else {
+          // The fast link keeps working, only slower
+          fmt::print(stderr, "Failed to optimize pipeline {}: {}\n", id, e.error);
+        }
+        e.state.store(compile_state::adopted, std::memory_order_relaxed);
+        return true;
+      case compile_state::failed:
+        // Stays on the fallback, trying again would only fail again
+        fmt::print(stderr, "Failed to compile pipeline {}: {}\n", id, e.error);
+        return true;
+      default:
+        return false;
+    }
+  };
+  _in_flight.erase(std::remove_if(_in_flight.begin(), _in_flight.end(), finished),
+                   _in_flight.end());
+}
+
+std::size_t pipeline_registry::warm_up(const std::string& path) {
+  std::vector<char> data;
+  if (std::ifstream file{path, std::ios::binary}) {
+    data.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  }
+
+  list_reader in{data};
+  uint32_t magic{0}, version{0}, count{0};
+  if (!in.get(magic) || !in.get(version) || !in.get(count) ||
+      magic != LIST_MAGIC || version != LIST_VERSION) {
+    return 0; // No list yet, or an old one
+  }
+
+  std::size_t started{0};
+  for (uint32_t i = 0; i < count; ++i) {
+    pipeline_desc desc{};
+    if (!get_desc(in, desc)) {
+      fmt::print(stderr, "Truncated pipeline list {}\n", path);
+      break;
+    }
+    // Written with other shaders or another swapchain format, these can't be built
+    if (!_shaders.contains(desc.vert_shader) || !_shaders.contains(desc.frag_shader) ||
+        desc.color_format != _target_format) {
+      continue;
+    }
+
+    const pipeline_id source = _entries[request(desc)]->source;
+    if (_entries[source]->state.load(std::memory_order_relaxed) == compile_state::idle) {
+      _compile(source);
+      ++started;
+    }
+  }
+
+  // This thread compiles too while it waits
+  _jobs.wait(_compiles);
+  poll();
+  return started;
+}
+
+bool pipeline_registry::save_used(const std::string& path) const {
+  // In hash order, the same set of pipelines always gives the same file
+  std::vector<std::pair<uint64_t, const pipeline_desc*>> used;
+  for (const auto& e : _entries) {
+    if (e->used) {
+      used.emplace_back(hash_value(e->desc), &e->desc);
+    }
+  }
+  std::ranges::sort(used, {}, &std::pair<uint64_t, const pipeline_desc*>::first);
+
+  std::string out;
+  put(out, LIST_MAGIC);
+  put(out, LIST_VERSION);
+  put(out, static_cast<uint32_t>(used.size()));
+  for (const auto& [hash, desc] : used) {
+    put_desc(out, *desc);
+  }
+  return replace_file(path, out);
+}
+
+void pipeline_registry::destroy() {
+  if (std::exchange(_destroyed, true)) {
+    return;
+  }
+  _jobs.wait(_compiles);
+
+  // Compiled after the last poll, the context doesn't know about these
+  for (pipeline_id id : _in_flight) {
+    auto& e = *_entries[id];
+    switch (e.state.load(std::memory_order_acquire)) {
+      case compile_state::done:
+        _context.destroy_pipeline(e.compiled);
+        e.state.store(compile_state::failed, std::memory_order_relaxed);
+        break;
+      case compile_state::optimized:
+        // The fast link is adopted already, it goes with the context
+        if (e.compiled) {
+          _context.destroy_pipeline(e.compiled);
+        }
+        e.state.store(compile_state::adopted, std::memory_order_relaxed);
+        break;
+      default:
+        break;
+    }
+  }
+  _in_flight.clear();
+}
+
+void pipeline_registry::_compile(pipeline_id id) {
+  auto& e = *_entries[id];
+  const std::string* vert = &_shaders.at(e.desc.vert_shader);
+  const std::string* frag = &_shaders.at(e.desc.frag_shader);
+  // The swapchain can get recreated while the job runs, it builds against what's current now
+  const pipeline_target target = _context.current_target();
+
+  e.state.store(compile_state::compiling, std::memory_order_relaxed);
+  _in_flight.emplace_back(id);
+
+  _jobs.run("compile pipeline", _compiles, [this, &e, vert, frag, target]() {
+    // Jobs can't throw, the error gets reported on the next poll
+    try {
+      e.compiled = _context.build_pipeline(e.canonical, target, *vert, *frag);
+      e.state.store(compile_state::done, std::memory_order_release);
+    } catch (const std::exception& ex) {
+      e.error = ex.what();
+      e.state.store(compile_state::failed, std::memory_order_release);
+    }
+  });
+}
+
+void pipeline_registry::_optimize(pipeline_id id) {
+  auto& e = *_entries[id];
+  const std::string* vert = &_shaders.at(e.desc.vert_shader);
+  const std::string* frag = &_shaders.at(e.desc.frag_shader);
+  const pipeline_target target = _context.current_target();
+
+  // Stays in flight, poll swaps the pipeline once the job is done
+  e.state.store(compile_state::optimizing, std::memory_order_relaxed);
+
+  _jobs.run("optimize pipeline", _compiles, [this, &e, vert, frag, target]() {
+    try {
+      e.compiled = _context.build_pipeline(e.canonical, target, *vert, *frag,
+                                           pipeline_link::optimized);
+    } catch (const std::exception& ex) {
+      e.compiled = VK_NULL_HANDLE;
+      e.error = ex.what();
+    }
+    e.state.store(compile_state::optimized, std::memory_order_release);
+  });
+}
+
+} // namespace ntf
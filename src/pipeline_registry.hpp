@@ -0,0 +1,127 @@
+#pragma once
+
+#include "job_system.hpp"
+#include "pipeline_desc.hpp"
+#include "vulkan_context.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ntf {
+
+// Every pipeline the renderer can draw with, keyed by its description
+// Requesting a description already known gives back the same pipeline. Nothing gets
+// compiled until the first time a pipeline is resolved for drawing: the compile starts on
+// a worker and the fallback pipeline gets drawn instead until it's done, so a new material
+// combination never stalls a frame. Descriptions only differing in state the device sets
+// dynamically share one pipeline. Render thread only, besides the compile jobs
+// With graphics pipeline libraries a compile is a fast link of the parts, an optimized link
+// of the same parts follows on a worker and replaces it once done
+// The pipelines drawn with get saved to a list at shutdown, so the next run can compile
+// all of them up front and never fall back at all
+class pipeline_registry {
+public:
+  using pipeline_id = uint32_t;
+
+  static constexpr uint32_t LIST_MAGIC = 0x5046544E; // "NTFP"
+  static constexpr uint32_t LIST_VERSION = 3;
+
+private:
+  enum class compile_state : uint8_t {
+    idle,
+    compiling,
+    done, // compiled is set, waiting for poll to adopt it
+    adopted,
+    optimizing, // Adopted, the optimized link is still running
+    optimized, // compiled is the optimized link, null if it failed, waiting for poll
+    failed,
+  };
+
+  struct entry {
+    pipeline_desc desc; // As requested, the dynamic state gets set from it
+    pipeline_desc canonical; // What actually gets compiled
+    pipeline_id source; // Entry owning the pipeline, itself unless it's shared
+    std::atomic<compile_state> state{compile_state::idle};
+    VkPipeline compiled{VK_NULL_HANDLE}; // Written by the compile job
+    std::string error; // Same
+    pipeline_handle handle;
+    bool used{false}; // Resolved at least once
+  };
+
+public:
+  pipeline_registry(vk_context& context, job_system& jobs);
+  ~pipeline_registry();
+
+  pipeline_registry(const pipeline_registry&) = delete;
+  pipeline_registry& operator=(const pipeline_registry&) = delete;
+
+public:
+  // Keeps the SPIR-V around for compiles, returns the hash descriptions refer to it by
+  uint64_t add_shader(std::string spirv);
+
+  // An already compiled pipeline, drawn in place of the ones still compiling
+  pipeline_id set_fallback(const pipeline_desc& desc, pipeline_handle pipeline);
+
+  // Same, compiled right here if it isn't yet. For when the current fallback can't draw
+  // the scene at all, like a vertex layout change. Throws if the compile fails
+  pipeline_id set_fallback(const pipeline_desc& desc);
+
+  // Registers the description (once), doesn't compile anything yet
+  // Throws if a shader it uses wasn't added
+  pipeline_id request(const pipeline_desc& desc);
+
+  // Same pipeline with other shader features, compiled and cached on its own
+  pipeline_id request(const pipeline_desc& desc, variant_key variant) {
+    auto specialized = desc;
+    specialized.variant = variant;
+    return request(specialized);
+  }
+
+  // The pipeline to draw with this frame, the fallback until the real one is ready
+  pipeline_handle resolve(pipeline_id id);
+
+  // The requested description, for vk_context::set_draw_pipeline
+  const pipeline_desc& desc(pipeline_id id) const { return _entries[id]->desc; }
+
+  // Once per frame, hands the finished compiles over to the context
+  void poll();
+
+  // Compiles every pipeline in a list written by save_used, all in parallel, and waits
+  // for them. Needs the shaders and the fallback in place, entries using other shaders or
+  // render targets are skipped. Returns how many pipelines got compiled
+  std::size_t warm_up(const std::string& path);
+
+  // Writes every pipeline resolved so far, returns false if the file couldn't be written
+  bool save_used(const std::string& path) const;
+
+  // Waits for the compiles in flight, before destroying the context or the job system
+  // Only the first call does anything, the destructor calls it too
+  void destroy();
+
+  std::size_t size() const { return _entries.size(); }
+  std::size_t compiling() const { return _in_flight.size(); }
+
+private:
+  void _compile(pipeline_id id);
+  void _optimize(pipeline_id id);
+
+private:
+  vk_context& _context;
+  job_system& _jobs;
+
+  std::vector<std::unique_ptr<entry>> _entries; // Stable, the compile jobs point into them
+  std::unordered_multimap<uint64_t, pipeline_id> _by_hash; // Equal hashes still get compared
+  std::unordered_multimap<uint64_t, pipeline_id> _by_canonical_hash; // Source entries only
+  std::unordered_map<uint64_t, std::string> _shaders; // Never erased, jobs read them
+  std::vector<pipeline_id> _in_flight;
+  pipeline_handle _fallback;
+  VkFormat _target_format{VK_FORMAT_UNDEFINED}; // The fallback's
+  job_counter _compiles;
+  bool _destroyed{false};
+};
+
+} // namespace ntf
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <chrono>
+
+namespace ntf {
+
+// Everything draw_frame needs to know about the application state
+struct render_state {
+  glm::vec2 position{0.f};
+  float rotation{0.f}; // Radians, kept in [0, 2pi)
+  float scale{1.f};
+};
+
+inline render_state interpolate(const render_state& prev, const render_state& curr, float alpha) {
+  // Take the short way around if the angle wrapped between both states
+  float rot_delta = curr.rotation - prev.rotation;
+  if (rot_delta > glm::pi<float>()) {
+    rot_delta -= glm::two_pi<float>();
+  } else if (rot_delta < -glm::pi<float>()) {
+    rot_delta += glm::two_pi<float>();
+  }
+
+  return render_state {
+    .position = glm::mix(prev.position, curr.position, alpha),
+    .rotation = prev.rotation + rot_delta*alpha,
+    .scale = glm::mix(prev.scale, curr.scale, alpha),
+  };
+}
+
+// Published by the simulation at the end of each fixed step
+// Keeps the last two states so the renderer can interpolate between them
+struct frame_snapshot {
+  using clock = std::chrono::steady_clock;
+
+  render_state prev, curr;
+  clock::time_point tick_time{}; // Time at which curr is reached
+  clock::duration tick_step{1};
+
+  // Renders one step behind the simulation, blending towards the newest state
+  render_state at(clock::time_point now) const {
+    float alpha = std::chrono::duration<float>(now - tick_time) /
+                  std::chrono::duration<float>(tick_step);
+    alpha = glm::clamp(alpha, 0.f, 1.f);
+    return interpolate(prev, curr, alpha);
+  }
+};
+
+} // namespace ntf
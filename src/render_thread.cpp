@@ -0,0 +1,330 @@
+#include "render_thread.hpp"
+#include "asset_loader.hpp"
+#include "vertex_fetch_bench.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+// Runs one init stage, reporting how long it took and how much it allocated
+template<typename F>
+void init_stage(std::string_view name, F&& f) {
+  const ntf::alloc_scope allocs;
+  const auto start = std::chrono::steady_clock::now();
+
+  f();
+
+  using ms = std::chrono::duration<double, std::milli>;
+  const auto elapsed = ms(std::chrono::steady_clock::now() - start);
+  const auto counts = allocs.delta();
+  fmt::print(" - {}: {:.2f}ms, {} allocations ({} bytes)\n",
+             name, elapsed.count(), counts.count, counts.bytes);
+}
+
+} // namespace
+
+namespace ntf {
+
+render_thread::render_thread(GLFWwindow* win, render_options options,
+                             std::vector<const char*> extensions,
+                             snapshot_buffer<frame_snapshot>& snapshots) :
+  _win(win), _options(options), _extensions(std::move(extensions)),
+  _snapshots(snapshots) {
+  // glfwGetFramebufferSize can only be called from the main thread, so take the
+  // initial size here and let resize events update it later
+  glfwGetFramebufferSize(_win, &_fb_width, &_fb_height);
+}
+
+render_thread::~render_thread() {
+  if (_thread.joinable()) {
+    _should_stop.store(true, std::memory_order_release);
+    _thread.join();
+  }
+}
+
+void render_thread::start() {
+  _thread = std::thread{[this]() { _run(); }};
+}
+
+void render_thread::stop() {
+  _should_stop.store(true, std::memory_order_release);
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+
+  if (_error) {
+    std::rethrow_exception(std::exchange(_error, nullptr));
+  }
+}
+
+void render_thread::_init_context() {
+  fmt::print("Render init stages:\n");
+
+  _init_device();
+  _mips.attach(_context.memory_budget());
+
+  // Shaders and geometry load concurrently, this thread keeps running jobs and
+  // resuming the loads that need the context until everything is in place
+  // (only counts what this thread allocates, not the workers)
+  asset_loader loader{_context, *_jobs, _executor, *_pipelines};
+  init_stage("load scene", [&]() {
+    _scene_pipeline = sync_wait(loader.load_scene(), [this]() { _poll_async(); });
+  });
+
+  init_stage("pipeline warm-up", [this]() {
+    const auto count = _pipelines->warm_up(PIPELINE_LIST_PATH);
+    fmt::print(" - {} pipelines precompiled\n", count);
+  });
+
+  _context.memory_budget().update();
+  _context.memory_budget().print();
+}
+
+void render_thread::_init_device() {
+  init_stage("instance", [this]() {
+    _context.create_instance(_options.enable_layers, _extensions);
+  });
+
+  init_stage("surface", [this]() {
+    _context.create_surface([win=_win](VkInstance instance, const VkAllocationCallbacks* allocator,
+                                       VkSurfaceKHR* surface) -> bool {
+      // Create window surface (has to be done before device selection)
+      // It needs the VK_KHR_surface extension, but it is already included
+      // in the glfw extension list
+      // glfwCreateWindowSurface is allowed from any thread
+      return glfwCreateWindowSurface(instance, win, allocator, surface);
+      // If not using glfw, it has to be done passing an XCB connection and
+      // window details from X11 in vkCreateXcbSurfaceKHR
+      // (who cares about windows right?)
+    });
+  });
+
+  init_stage("physical device", [this]() { _context.pick_physical_device(); });
+
+  init_stage("logical device", [this]() { _context.create_logical_device(); });
+
+  init_stage("swapchain", [this]() {
+    _context.create_swapchain([this](std::size_t& width, std::size_t& height) {
+      // Not the same as WIDTH, HEIGHT in high DPI screens
+      // Updated from resize events, since we can't ask GLFW from this thread
+      width = static_cast<std::size_t>(_fb_width);
+      height = static_cast<std::size_t>(_fb_height);
+    });
+    _context.create_imageviews();
+  });
+
+  init_stage("render pass", [this]() {
+    _context.create_renderpass();
+    _context.create_framebuffers();
+  });
+
+  init_stage("commands", [this]() {
+    _context.create_commandpool();
+    _context.create_commandbuffers();
+    _context.create_sync_objects();
+  });
+}
+
+void render_thread::_run_fetch_bench() {
+  fmt::print("Render init stages:\n");
+  _init_device();
+
+  asset_loader loader{_context, *_jobs, _executor, *_pipelines};
+  auto [vert_src, pos_vert_src, frag_src] = sync_wait(when_all(
+    loader.load_shader("res/shader.vs", shader_stage::vertex),
+    loader.load_shader("res/shader_pos.vs", shader_stage::vertex),
+    loader.load_shader("res/shader.fs", shader_stage::fragment)
+  ), [this]() { _poll_async(); });
+
+  vertex_fetch_bench bench{_context, _uploads};
+  bench.build_pipelines(vert_src, pos_vert_src, frag_src);
+  if (!bench.upload()) {
+    throw std::runtime_error{"Vertex fetch benchmark buffers don't fit in device memory"};
+  }
+
+  // No frames to spread them over, the scheduler still sends a frame budget per tick
+  while (!bench.ready()) {
+    _uploads.tick();
+    std::this_thread::yield();
+  }
+
+  fmt::print("Vertex fetch, {} instances of a {}x{} quad grid, best of {} runs:\n",
+             _options.bench_instances, vertex_fetch_bench::GRID_SIZE,
+             vertex_fetch_bench::GRID_SIZE, vertex_fetch_bench::RUNS);
+  for (const auto& result : bench.run(_options.bench_instances)) {
+    fmt::print(" - {}: {:.3f}ms, {} bytes fetched per vertex\n",
+               result.name, result.ms, result.fetched_bytes);
+  }
+
+  _should_stop.store(true, std::memory_order_release);
+  _request_close();
+}
+
+void render_thread::_handle_events() {
+  while (auto event = _events.pop()) {
+    if (auto* resize = std::get_if<resize_event>(&*event)) {
+      _fb_width = resize->width;
+      _fb_height = resize->height;
+      _context.flag_dirty_framebuffer();
+    }
+    // Key events are handled by the simulation
+  }
+}
+
+void render_thread::_record_frame(clock::duration elapsed, alloc_counts allocs,
+                                  bool swapchain_changed) {
+  // Recreating the swapchain is allowed to allocate, any other frame is not once warmed up
+  _steady_frames = swapchain_changed ? 0 : _steady_frames + 1;
+  if (_steady_frames > WARMUP_FRAMES && allocs.count > 0) {
+    if (_options.check_allocs) {
+      throw std::runtime_error{fmt::format("Steady state frame allocated {} times ({} bytes)",
+                                           allocs.count, allocs.bytes)};
+    }
+
+    // Validation layers allocate on their own, so only trust this without them
+    if (!_options.enable_layers && !_alloc_warned) {
+      fmt::print(stderr, "Steady state frame allocated {} times ({} bytes)\n",
+                 allocs.count, allocs.bytes);
+      _alloc_warned = true;
+    }
+  }
+  if (_options.check_allocs && _steady_frames == WARMUP_FRAMES + CHECK_FRAMES) {
+    fmt::print("Allocation check passed, {} steady state frames without allocations\n",
+               CHECK_FRAMES);
+    _should_stop.store(true, std::memory_order_release);
+    _request_close();
+  }
+
+  const auto now = clock::now();
+  if (_stats.frames == 0) {
+    _stats.since = now - elapsed;
+  }
+  ++_stats.frames;
+  _stats.total += elapsed;
+  _stats.worst = std::max(_stats.worst, elapsed);
+  _stats.allocs += allocs.count;
+  _stats.alloc_bytes += allocs.bytes;
+  const auto& draws = _context.last_draw_stats();
+  _stats.draws += draws.draws;
+  _stats.pipeline_binds += draws.pipeline_binds;
+  _stats.geometry_binds += draws.geometry_binds;
+
+  if (now - _stats.since < STATS_INTERVAL) {
+    return;
+  }
+
+  using ms = std::chrono::duration<double, std::milli>;
+  const double seconds = std::chrono::duration<double>(now - _stats.since).count();
+  fmt::print("{:.1f} fps, {:.2f}ms avg, {:.2f}ms worst, {:.1f} allocations/frame ({} bytes)\n",
+             _stats.frames/seconds, ms(_stats.total).count()/_stats.frames,
+             ms(_stats.worst).count(), static_cast<double>(_stats.allocs)/_stats.frames,
+             _stats.alloc_bytes);
+  fmt::print("{:.1f} draws/frame, {:.1f} pipeline binds/frame, {:.1f} geometry binds/frame\n",
+             static_cast<double>(_stats.draws)/_stats.frames,
+             static_cast<double>(_stats.pipeline_binds)/_stats.frames,
+             static_cast<double>(_stats.geometry_binds)/_stats.frames);
+  _stats = {};
+}
+
+void render_thread::_request_close() {
+  // Wake up the main thread so it can exit its event loop
+  glfwSetWindowShouldClose(_win, 1);
+  glfwPostEmptyEvent();
+}
+
+void render_thread::_shutdown() {
+  // Also the way out of a failed init, so anything here may not exist yet
+  // Safe to call again, everything it destroys is only destroyed once
+  _context.wait_idle();
+  _uploads.destroy();
+  _mips.release_retired();
+
+  // Compiles first, then every other job, the workers can be touching the context
+  if (_pipelines) {
+    _pipelines->destroy();
+  }
+  _jobs.reset();
+  _pipelines.reset();
+
+  _context.destroy();
+}
+
+void render_thread::_poll_async() {
+  if (!_executor.poll() && !_jobs->run_one()) {
+    std::this_thread::yield();
+  }
+}
+
+void render_thread::_run() {
+  try {
+    _jobs.emplace();
+    _pipelines.emplace(_context, *_jobs);
+
+    if (_options.bench_instances > 0) {
+      _run_fetch_bench();
+    } else {
+      _init_context();
+    }
+
+    while (!_should_stop.load(std::memory_order_acquire)) {
+      _handle_events();
+
+      // Loads started later on still get resumed here, one round per frame
+      _executor.poll();
+
+      if (_fb_width == 0 || _fb_height == 0) {
+        // Minimized window, there is nothing to present to until it gets resized again
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        _stats = {};
+        continue;
+      }
+
+      // Pick up the latest simulation step and blend it to the current time
+      const auto& snapshot = _snapshots.read();
+      const auto generation = _context.swapchain_generation();
+      const auto frame_start = clock::now();
+
+      // Everything done once per frame is counted. Polls and uploads only allocate when
+      // there's something new to pick up, which a steady state frame doesn't have
+      alloc_counts allocs;
+      {
+        const alloc_scope scope;
+        _pipelines->poll();
+        _context.set_draw_pipeline(_pipelines->resolve(_scene_pipeline),
+                                   _pipelines->desc(_scene_pipeline));
+        _context.draw_frame(snapshot.at(frame_start));
+        _uploads.tick();
+        _mips.update();
+        allocs = scope.delta();
+      }
+
+      _record_frame(clock::now() - frame_start, allocs,
+                    generation != _context.swapchain_generation());
+    }
+
+    // The benchmark pipelines aren't worth compiling ahead on the next run
+    if (_options.bench_instances == 0 && !_pipelines->save_used(PIPELINE_LIST_PATH)) {
+      fmt::print(stderr, "Failed to save the pipeline list {}\n", PIPELINE_LIST_PATH);
+    }
+    _shutdown();
+  } catch (...) {
+    _error = std::current_exception();
+
+    // Whatever got created goes too, the first error is the one reported
+    try {
+      _shutdown();
+    } catch (...) {
+    }
+
+    // The main thread reports the error once it's out of its event loop
+    _request_close();
+  }
+}
+
+} // namespace ntf
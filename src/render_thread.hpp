@@ -0,0 +1,125 @@
+#pragma once
+
+#include "vulkan_context.hpp"
+#include "spsc_queue.hpp"
+#include "snapshot_buffer.hpp"
+#include "render_state.hpp"
+#include "window_event.hpp"
+#include "job_system.hpp"
+#include "async_task.hpp"
+#include "alloc_counter.hpp"
+#include "upload_scheduler.hpp"
+#include "mip_residency.hpp"
+#include "pipeline_registry.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace ntf {
+
+// Picked from the command line
+struct render_options {
+  bool enable_layers{false};
+
+  // Throw as soon as a steady state frame allocates, stop once CHECK_FRAMES of them didn't
+  bool check_allocs{false};
+
+  // Time this many instances of a grid drawn from each vertex layout instead of drawing the
+  // scene, see vertex_fetch_bench. 0 draws the scene
+  uint32_t bench_instances{0};
+};
+
+// Owns the vulkan context and renders on its own thread, so polling the window system
+// and drawing frames don't block each other. The main thread only talks to it through
+// a lock-free event queue
+class render_thread {
+private:
+  using clock = std::chrono::steady_clock;
+
+  static constexpr std::size_t EVENT_QUEUE_SIZE = 256;
+
+  // Pipelines drawn with, compiled before the first frame of the next run
+  static constexpr const char* PIPELINE_LIST_PATH = "pipeline_list.bin";
+
+  // Frames to skip after start or a swapchain recreation before expecting zero allocations
+  static constexpr uint32_t WARMUP_FRAMES = 120;
+  static constexpr uint32_t CHECK_FRAMES = 600; // Steady frames checked with check_allocs
+  static constexpr clock::duration STATS_INTERVAL = std::chrono::seconds{5};
+
+  struct frame_stats {
+    clock::time_point since{};
+    uint32_t frames{0};
+    clock::duration total{0}, worst{0};
+    uint64_t allocs{0}, alloc_bytes{0};
+    uint64_t draws{0}, pipeline_binds{0}, geometry_binds{0};
+  };
+
+public:
+  render_thread(GLFWwindow* win, render_options options, std::vector<const char*> extensions,
+                snapshot_buffer<frame_snapshot>& snapshots);
+  ~render_thread();
+
+  render_thread(const render_thread&) = delete;
+  render_thread& operator=(const render_thread&) = delete;
+
+public:
+  void start();
+
+  // Asks the render loop to finish and joins the thread
+  // Rethrows any exception thrown on the render thread
+  void stop();
+
+  // Called from the main thread only, returns false if the event was dropped
+  bool push_event(const window_event& event) { return _events.push(event); }
+
+private:
+  void _run();
+  void _init_context();
+  void _init_device();
+  void _run_fetch_bench();
+  void _handle_events();
+  void _poll_async();
+  void _record_frame(clock::duration elapsed, alloc_counts allocs, bool swapchain_changed);
+  void _request_close();
+  void _shutdown();
+
+private:
+  GLFWwindow* _win;
+  render_options _options;
+  std::vector<const char*> _extensions;
+
+  vk_context _context;
+  upload_scheduler _uploads{_context}; // Runtime streaming, a frame budget worth per frame
+
+  // Texture mips to keep resident, and the textures evictor of the memory budget
+  // Nothing loads textures yet, so there are no mips to stream in or images to free
+  mip_residency _mips{mip_residency::callbacks{
+    [](const mip_residency::stream_ticket&) { return false; },
+    [](mip_residency::texture_id, uint32_t) {},
+  }, vk_context::MAX_FRAMES_IN_FLIGHT};
+  // Compiles on _jobs. Declared first so the workers join before it goes
+  std::optional<pipeline_registry> _pipelines;
+  pipeline_registry::pipeline_id _scene_pipeline{0};
+  std::optional<job_system> _jobs; // Created on the render thread, so it can run jobs too
+  thread_executor _executor; // Coroutines that need to run on the render thread
+  spsc_queue<window_event, EVENT_QUEUE_SIZE> _events;
+  snapshot_buffer<frame_snapshot>& _snapshots; // Written by the simulation thread
+
+  // Last known framebuffer size, only touched from the render thread after start()
+  int _fb_width{0}, _fb_height{0};
+
+  // Frame timing and allocations, reported every STATS_INTERVAL
+  frame_stats _stats;
+  uint32_t _steady_frames{0}; // Frames in a row without a swapchain recreation
+  bool _alloc_warned{false};
+
+  std::thread _thread;
+  std::atomic<bool> _should_stop{false};
+  std::exception_ptr _error;
+};
+
+} // namespace ntf
@@ -0,0 +1,150 @@
+#include "shader_compiler.hpp"
+#include "pipeline_desc.hpp"
+
+#include <fmt/format.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+constexpr uint32_t SPIRV_MAGIC = 0x07230203;
+
+uint64_t cache_key(std::string_view source, ntf::shader_stage stage,
+                   std::span<const ntf::shader_define> defines) {
+  // Sizes go in before each string, so moving bytes between them changes the key
+  auto add_string = [](ntf::fnv1a& h, std::string_view str) {
+    h.add(str.size());
+    h.add(str.data(), str.size());
+  };
+
+  ntf::fnv1a h;
+  h.add(ntf::shader_compiler::CACHE_VERSION);
+  h.add(stage);
+  add_string(h, source);
+  h.add(defines.size());
+  for (const auto& define : defines) {
+    add_string(h, define.name);
+    add_string(h, define.value);
+  }
+  return h.value();
+}
+
+std::string cache_path(uint64_t key) {
+  return fmt::format("{}/{:016x}.spv", ntf::shader_compiler::CACHE_DIR, key);
+}
+
+} // namespace
+
+namespace ntf {
+
+bool is_valid_spirv(std::string_view code) {
+  uint32_t magic{0};
+  if (code.size() >= sizeof(magic)) {
+    std::memcpy(&magic, code.data(), sizeof(magic));
+  }
+  return code.size() % sizeof(uint32_t) == 0 && magic == SPIRV_MAGIC;
+}
+
+#ifdef NTF_HAS_SHADERC
+
+shader_compiler::shader_compiler() :
+  _compiler(shaderc_compiler_initialize()) {
+  if (!_compiler) {
+    throw std::runtime_error{"Failed to initialize shaderc"};
+  }
+}
+
+shader_compiler::~shader_compiler() {
+  shaderc_compiler_release(_compiler);
+}
+
+std::optional<std::string> shader_compiler::_compile(std::string_view source,
+                                                     std::string_view name, shader_stage stage,
+                                                     std::span<const shader_define> defines) {
+  shaderc_compile_options_t options = shaderc_compile_options_initialize();
+  shaderc_compile_options_set_target_env(options, shaderc_target_env_vulkan,
+                                         shaderc_env_version_vulkan_1_0);
+  shaderc_compile_options_set_optimization_level(options,
+                                                 shaderc_optimization_level_performance);
+  for (const auto& define : defines) {
+    shaderc_compile_options_add_macro_definition(options,
+                                                 define.name.data(), define.name.size(),
+                                                 define.value.data(), define.value.size());
+  }
+
+  const auto kind = stage == shader_stage::vertex ? shaderc_glsl_vertex_shader :
+                                                    shaderc_glsl_fragment_shader;
+  const std::string input_name{name};
+  shaderc_compilation_result_t result = shaderc_compile_into_spv(
+    _compiler, source.data(), source.size(), kind, input_name.c_str(), "main", options
+  );
+  shaderc_compile_options_release(options);
+
+  std::optional<std::string> spirv;
+  if (shaderc_result_get_compilation_status(result) == shaderc_compilation_status_success) {
+    spirv.emplace(shaderc_result_get_bytes(result), shaderc_result_get_length(result));
+  } else {
+    fmt::print(stderr, "Failed to compile shader {}:\n{}", name,
+               shaderc_result_get_error_message(result));
+  }
+  shaderc_result_release(result);
+  return spirv;
+}
+
+#else
+
+shader_compiler::shader_compiler() = default;
+shader_compiler::~shader_compiler() = default;
+
+std::optional<std::string> shader_compiler::_compile(std::string_view, std::string_view,
+                                                     shader_stage,
+                                                     std::span<const shader_define>) {
+  return std::nullopt;
+}
+
+#endif
+
+std::optional<std::string> shader_compiler::compile(std::string_view source,
+                                                    std::string_view name, shader_stage stage,
+                                                    std::span<const shader_define> defines) {
+  const std::string path = cache_path(cache_key(source, stage, defines));
+  if (std::ifstream file{path, std::ios::binary}) {
+    std::string cached{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    if (is_valid_spirv(cached)) {
+      return cached;
+    }
+  }
+
+  auto spirv = _compile(source, name, stage, defines);
+  if (!spirv) {
+    return std::nullopt;
+  }
+
+  // Written aside and renamed, threads compiling the same shader each use their own file
+  const auto thread_id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  const std::string tmp_path = fmt::format("{}.{:x}.tmp", path, thread_id);
+  std::error_code err;
+  std::filesystem::create_directories(CACHE_DIR, err);
+
+  // Closed by hand, a failed flush only shows up there. Nothing half written stays behind
+  std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+  file.write(spirv->data(), static_cast<std::streamsize>(spirv->size()));
+  file.close();
+  if (file) {
+    std::filesystem::rename(tmp_path, path, err);
+  }
+  if (!file || err) {
+    fmt::print(stderr, "Failed to cache shader {}\n", name);
+    std::error_code ignored;
+    std::filesystem::remove(tmp_path, ignored);
+  }
+  return spirv;
+}
+
+} // namespace ntf
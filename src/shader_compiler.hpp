@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#ifdef NTF_HAS_SHADERC
+#include <shaderc/shaderc.h>
+#endif
+
+namespace ntf {
+
+enum class shader_stage : uint32_t {
+  vertex,
+  fragment,
+};
+
+struct shader_define {
+  std::string name;
+  std::string value; // Empty for a plain #define NAME
+};
+
+// Size and magic number, enough to tell SPIR-V apart from anything else
+bool is_valid_spirv(std::string_view code);
+
+// GLSL to SPIR-V at runtime, so shader variants using other defines don't have to be
+// compiled by hand. The results are kept on disk keyed by the source, stage and defines
+// Builds without shaderc load the prebuilt SPIR-V instead. Usable from any thread
+class shader_compiler {
+public:
+  static constexpr const char* CACHE_DIR = "shader_cache";
+
+  // Bumped when the compile options change, old cache entries just stop matching
+  static constexpr uint32_t CACHE_VERSION = 1;
+
+public:
+  shader_compiler();
+  ~shader_compiler();
+
+  shader_compiler(const shader_compiler&) = delete;
+  shader_compiler& operator=(const shader_compiler&) = delete;
+
+public:
+  // Can compile anything that isn't cached yet
+  static constexpr bool can_compile() {
+#ifdef NTF_HAS_SHADERC
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // The cached SPIR-V, compiled and cached first if needed. std::nullopt if it's not cached
+  // and can't be compiled, compile errors get printed. name only shows up in the errors
+  std::optional<std::string> compile(std::string_view source, std::string_view name,
+                                     shader_stage stage,
+                                     std::span<const shader_define> defines = {});
+
+private:
+  std::optional<std::string> _compile(std::string_view source, std::string_view name,
+                                      shader_stage stage, std::span<const shader_define> defines);
+
+private:
+#ifdef NTF_HAS_SHADERC
+  shaderc_compiler_t _compiler; // Compiles on several threads at once just fine
+#endif
+};
+
+} // namespace ntf
@@ -0,0 +1,104 @@
+#include "simulation.hpp"
+
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+#include <cmath>
+
+namespace {
+
+constexpr float MOVE_SPEED = .75f; // NDC units per second
+constexpr float SPIN_SPEED = glm::pi<float>()*.5f; // Radians per second
+
+} // namespace
+
+namespace ntf {
+
+simulation::~simulation() {
+  stop();
+}
+
+void simulation::start() {
+  _thread = std::thread{[this]() { _run(); }};
+}
+
+void simulation::stop() {
+  _should_stop.store(true, std::memory_order_release);
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+void simulation::_handle_events() {
+  while (auto event = _events.pop()) {
+    if (event->action == GLFW_REPEAT) {
+      continue;
+    }
+    const float sign = event->action == GLFW_PRESS ? 1.f : -1.f;
+
+    // Track held arrow keys as a movement direction
+    switch (event->key) {
+      case GLFW_KEY_LEFT:
+        _move_dir.x -= sign;
+        break;
+      case GLFW_KEY_RIGHT:
+        _move_dir.x += sign;
+        break;
+      case GLFW_KEY_UP:
+        _move_dir.y -= sign; // Vulkan NDC has y pointing down
+        break;
+      case GLFW_KEY_DOWN:
+        _move_dir.y += sign;
+        break;
+      case GLFW_KEY_SPACE:
+        if (event->action == GLFW_PRESS) {
+          _spinning = !_spinning;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void simulation::_tick(float dt) {
+  _prev = _curr;
+
+  _curr.position += _move_dir*(MOVE_SPEED*dt);
+  _curr.position = glm::clamp(_curr.position, glm::vec2{-1.f}, glm::vec2{1.f});
+
+  if (_spinning) {
+    _curr.rotation = std::fmod(_curr.rotation + SPIN_SPEED*dt, glm::two_pi<float>());
+  }
+}
+
+void simulation::_publish(clock::time_point tick_time) {
+  auto& snapshot = _snapshots.write_buffer();
+  snapshot.prev = _prev;
+  snapshot.curr = _curr;
+  snapshot.tick_time = tick_time;
+  snapshot.tick_step = TICK_STEP;
+  _snapshots.publish();
+}
+
+void simulation::_run() {
+  const float dt = std::chrono::duration<float>(TICK_STEP).count();
+
+  auto next_tick = clock::now();
+  _publish(next_tick);
+
+  while (!_should_stop.load(std::memory_order_acquire)) {
+    next_tick += TICK_STEP;
+    std::this_thread::sleep_until(next_tick);
+
+    _handle_events();
+    _tick(dt);
+    _publish(next_tick);
+
+    if (clock::now() - next_tick > MAX_LAG) {
+      next_tick = clock::now();
+    }
+  }
+}
+
+} // namespace ntf
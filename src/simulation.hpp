@@ -0,0 +1,62 @@
+#pragma once
+
+#include "spsc_queue.hpp"
+#include "snapshot_buffer.hpp"
+#include "render_state.hpp"
+#include "window_event.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace ntf {
+
+// Advances the application state at a fixed rate on its own thread and publishes
+// a snapshot after every step, so the render thread never waits for it (or vice versa)
+class simulation {
+private:
+  using clock = frame_snapshot::clock;
+
+  static constexpr std::size_t EVENT_QUEUE_SIZE = 256;
+
+  // Fixed timestep, independent of the frame rate
+  static constexpr clock::duration TICK_STEP = std::chrono::nanoseconds{1'000'000'000/60};
+
+  // If we fall behind more than this, drop the missed steps instead of catching up
+  static constexpr clock::duration MAX_LAG = TICK_STEP*5;
+
+public:
+  simulation() = default;
+  ~simulation();
+
+  simulation(const simulation&) = delete;
+  simulation& operator=(const simulation&) = delete;
+
+public:
+  void start();
+  void stop();
+
+  // Called from the main thread only, returns false if the event was dropped
+  bool push_event(const key_event& event) { return _events.push(event); }
+
+  snapshot_buffer<frame_snapshot>& snapshots() { return _snapshots; }
+
+private:
+  void _run();
+  void _handle_events();
+  void _tick(float dt);
+  void _publish(clock::time_point tick_time);
+
+private:
+  render_state _prev, _curr;
+  glm::vec2 _move_dir{0.f};
+  bool _spinning{true};
+
+  spsc_queue<key_event, EVENT_QUEUE_SIZE> _events;
+  snapshot_buffer<frame_snapshot> _snapshots;
+
+  std::thread _thread;
+  std::atomic<bool> _should_stop{false};
+};
+
+} // namespace ntf
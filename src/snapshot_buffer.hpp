@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+namespace ntf {
+
+// Lock-free snapshot exchange between one writer and one reader thread
+// The writer fills its back buffer and publishes it at the end of a step, the reader
+// picks up the latest published snapshot at the start of a frame. A third shared slot
+// sits between them, so neither side ever waits for the other to finish with a buffer
+template<typename T>
+class snapshot_buffer {
+private:
+  static constexpr uint8_t INDEX_MASK = 0x3;
+  static constexpr uint8_t FRESH_BIT = 0x4; // The shared slot holds an unread snapshot
+
+public:
+  snapshot_buffer() = default;
+
+  snapshot_buffer(const snapshot_buffer&) = delete;
+  snapshot_buffer& operator=(const snapshot_buffer&) = delete;
+
+public:
+  // Writer side, the returned buffer may hold an old snapshot so it has to be fully rewritten
+  T& write_buffer() { return _buffers[_back]; }
+
+  void publish() {
+    const uint8_t prev = _middle.exchange(_back | FRESH_BIT, std::memory_order_acq_rel);
+    _back = prev & INDEX_MASK;
+  }
+
+  // Reader side, returns the newest published snapshot (or the previous one if nothing new)
+  const T& read() {
+    if (_middle.load(std::memory_order_relaxed) & FRESH_BIT) {
+      const uint8_t prev = _middle.exchange(_front, std::memory_order_acq_rel);
+      _front = prev & INDEX_MASK;
+    }
+    return _buffers[_front];
+  }
+
+private:
+  std::array<T, 3> _buffers{};
+
+  // Each index is owned by one side, except for the shared one in the middle
+  alignas(64) uint8_t _back{0};
+  alignas(64) std::atomic<uint8_t> _middle{1};
+  alignas(64) uint8_t _front{2};
+};
+
+} // namespace ntf
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <type_traits>
+
+namespace ntf {
+
+// Fixed size single producer, single consumer ring buffer
+// Exactly one thread pushes and exactly one thread pops, so the head and tail
+// indices only need acquire/release ordering and no locks are involved
+template<typename T, std::size_t N>
+class spsc_queue {
+  static_assert(N > 0 && (N & (N-1)) == 0, "spsc_queue capacity has to be a power of two");
+  static_assert(std::is_trivially_copyable_v<T>, "spsc_queue only stores trivially copyable types");
+
+public:
+  spsc_queue() = default;
+
+  spsc_queue(const spsc_queue&) = delete;
+  spsc_queue& operator=(const spsc_queue&) = delete;
+
+public:
+  // Producer side, returns false if the queue is full
+  bool push(const T& value) {
+    const std::size_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+
+    _data[head & (N-1)] = value;
+    _head.store(head + 1, std::memory_order_release); // Publish the element to the consumer
+    return true;
+  }
+
+  // Consumer side, returns std::nullopt if the queue is empty
+  std::optional<T> pop() {
+    const std::size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+
+    T value = _data[tail & (N-1)];
+    _tail.store(tail + 1, std::memory_order_release); // Give the slot back to the producer
+    return value;
+  }
+
+  bool empty() const {
+    return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
+  }
+
+  static constexpr std::size_t capacity() { return N; }
+
+private:
+  // Keep both indices in separate cache lines to avoid false sharing between threads
+  alignas(64) std::atomic<std::size_t> _head{0};
+  alignas(64) std::atomic<std::size_t> _tail{0};
+  std::array<T, N> _data{};
+};
+
+} // namespace ntf
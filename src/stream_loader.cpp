@@ -0,0 +1,164 @@
+#include "stream_loader.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+class scoped_fd {
+public:
+  explicit scoped_fd(const std::string& path) :
+    _fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+    if (_fd < 0) {
+      throw std::runtime_error{fmt::format("Failed to open file {}", path)};
+    }
+  }
+  ~scoped_fd() { close(_fd); }
+
+  scoped_fd(const scoped_fd&) = delete;
+  scoped_fd& operator=(const scoped_fd&) = delete;
+
+public:
+  int get() const { return _fd; }
+
+private:
+  int _fd;
+};
+
+} // namespace
+
+namespace ntf {
+
+stream_loader::stream_loader(vk_context& context, job_system& jobs, thread_executor& render_exec) :
+  _context(context), _render_exec(render_exec), _io(jobs, SLICE_COUNT) {}
+
+stream_loader::~stream_loader() {
+  if (_staging) {
+    _context.destroy_staging_buffer(*_staging);
+  }
+}
+
+task<void> stream_loader::stream(std::string path, std::vector<range> ranges) {
+  co_await _render_exec.schedule();
+
+  // The slices are shared, so streams queue up behind each other
+  if (_busy) {
+    co_await _render_exec.wait_until([this]() { return !_busy; });
+  }
+  _busy = true;
+
+  try {
+    co_await _stream(path, ranges);
+  } catch (...) {
+    _busy = false;
+    throw;
+  }
+  _busy = false;
+}
+
+task<void> stream_loader::_stream(const std::string& path, const std::vector<range>& ranges) {
+  if (!_staging) {
+    _staging = _context.create_staging_buffer(SLICE_SIZE*SLICE_COUNT);
+    if (!_staging) {
+      throw std::runtime_error{"Not enough memory for the streaming staging buffer"};
+    }
+  }
+
+  scoped_fd file{path};
+
+  // One read and one copy per slice sized chunk
+  std::vector<chunk> chunks;
+  for (const auto& r : ranges) {
+    for (VkDeviceSize offset = 0; offset < r.size; offset += SLICE_SIZE) {
+      chunks.emplace_back(chunk{
+        r.file_offset + offset,
+        static_cast<uint32_t>(std::min(SLICE_SIZE, r.size - offset)),
+        r.dst,
+        r.dst_offset + offset,
+      });
+    }
+  }
+
+  std::size_t next{0}, done{0};
+  int error{0}; // -errno of the first failed read
+  while (done < chunks.size()) {
+    // Keep every free slice reading, unless something already failed
+    for (uint32_t i = 0; i < SLICE_COUNT && next < chunks.size() && !error; ++i) {
+      auto& s = _slices[i];
+      if (s.state != slice_state::free) {
+        continue;
+      }
+      const auto& c = chunks[next];
+      std::byte* dst = _staging->data + i*SLICE_SIZE;
+      if (!_io.submit_read(file.get(), dst, c.size, c.file_offset, i)) {
+        break;
+      }
+      s.state = slice_state::reading;
+      s.chunk = next++;
+    }
+    _io.flush();
+
+    // The reads still going write into the staging buffer, so let them land before bailing out
+    if (error && _idle()) {
+      break;
+    }
+    co_await _render_exec.wait_until([&]() { return _advance(chunks, done, error); });
+  }
+
+  if (error) {
+    throw std::runtime_error{fmt::format("Failed to read file {}: {}", path, std::strerror(-error))};
+  }
+}
+
+bool stream_loader::_advance(const std::vector<chunk>& chunks, std::size_t& done, int& error) {
+  bool progress{false};
+
+  // Read finished, copy the slice to its destination
+  _io.reap([&](const io_ring::completion& c) {
+    const auto index = static_cast<uint32_t>(c.user_data);
+    auto& s = _slices[index];
+    const auto& ch = chunks[s.chunk];
+    progress = true;
+
+    if (c.result != static_cast<int32_t>(ch.size)) {
+      // Short reads only happen past the end of the file
+      error = error ? error : (c.result < 0 ? c.result : -EIO);
+      s.state = slice_state::free;
+      return;
+    }
+
+    VkBufferCopy region{};
+    region.srcOffset = index*SLICE_SIZE;
+    region.dstOffset = ch.dst_offset;
+    region.size = ch.size;
+    s.upload = _context.submit_copy(_staging->buffer, ch.dst, region);
+    s.state = slice_state::copying;
+  });
+
+  // Copy finished, the slice can take the next read
+  for (auto& s : _slices) {
+    if (s.state == slice_state::copying && _context.is_upload_done(s.upload)) {
+      _context.finish_upload(s.upload);
+      s.state = slice_state::free;
+      ++done;
+      progress = true;
+    }
+  }
+
+  return progress;
+}
+
+bool stream_loader::_idle() const {
+  return std::all_of(_slices.begin(), _slices.end(), [](const slice& s) {
+    return s.state == slice_state::free;
+  });
+}
+
+} // namespace ntf
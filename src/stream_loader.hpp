@@ -0,0 +1,81 @@
+#pragma once
+
+#include "async_task.hpp"
+#include "io_ring.hpp"
+#include "job_system.hpp"
+#include "vulkan_context.hpp"
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ntf {
+
+// Streams file ranges into device buffers through a persistently mapped staging buffer
+// split in slices. Each slice cycles through a disk read straight into its mapped memory
+// and a copy on the transfer queue, so reads, staging and GPU copies of different slices
+// overlap. Runs on the render thread, the reads complete in the background
+class stream_loader {
+public:
+  static constexpr VkDeviceSize SLICE_SIZE = 1024*1024;
+  static constexpr uint32_t SLICE_COUNT = 8;
+
+  // Bytes [file_offset, file_offset+size) end up at dst_offset in dst
+  struct range {
+    uint64_t file_offset;
+    VkDeviceSize size;
+    VkBuffer dst;
+    VkDeviceSize dst_offset;
+  };
+
+private:
+  enum class slice_state : uint8_t {
+    free = 0,
+    reading,
+    copying,
+  };
+
+  struct chunk {
+    uint64_t file_offset;
+    uint32_t size;
+    VkBuffer dst;
+    VkDeviceSize dst_offset;
+  };
+
+  struct slice {
+    slice_state state{slice_state::free};
+    std::size_t chunk{0};
+    buffer_upload upload{};
+  };
+
+public:
+  stream_loader(vk_context& context, job_system& jobs, thread_executor& render_exec);
+  ~stream_loader(); // On the render thread, it frees the staging buffer
+
+  stream_loader(const stream_loader&) = delete;
+  stream_loader& operator=(const stream_loader&) = delete;
+
+public:
+  // Done once every range landed in its buffer. Streams run one at a time
+  task<void> stream(std::string path, std::vector<range> ranges);
+
+private:
+  task<void> _stream(const std::string& path, const std::vector<range>& ranges);
+
+  // Reaps finished reads and copies, false if nothing moved
+  bool _advance(const std::vector<chunk>& chunks, std::size_t& done, int& error);
+  bool _idle() const;
+
+private:
+  vk_context& _context;
+  thread_executor& _render_exec;
+  io_ring _io;
+
+  std::optional<mapped_buffer> _staging; // Created on the first stream
+  std::array<slice, SLICE_COUNT> _slices;
+  bool _busy{false};
+};
+
+} // namespace ntf
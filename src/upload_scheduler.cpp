@@ -0,0 +1,174 @@
+#include "upload_scheduler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <thread>
+
+namespace ntf {
+
+upload_scheduler::upload_scheduler(vk_context& context, VkDeviceSize frame_budget) :
+  _context(context), _frame_budget(frame_budget) {
+  _staging_evictor = _context.memory_budget().add_evictor(memory_category::staging,
+    [this](uint32_t heap, VkDeviceSize) { return _evict_staging(heap); }
+  );
+}
+
+upload_scheduler::~upload_scheduler() {
+  _context.memory_budget().remove_evictor(_staging_evictor);
+}
+
+auto upload_scheduler::submit(request req) -> upload_id {
+  const upload_id id = _next_id++;
+  _insert(pending{id, req});
+  return id;
+}
+
+void upload_scheduler::_insert(const pending& p) {
+  // After any equal priority, so those keep going in submission order
+  auto it = std::upper_bound(_pending.begin(), _pending.end(), p,
+    [](const pending& a, const pending& b) { return a.req.priority > b.req.priority; }
+  );
+  _pending.insert(it, p);
+}
+
+bool upload_scheduler::set_priority(upload_id id, float priority) {
+  auto it = std::find_if(_pending.begin(), _pending.end(), [id](const pending& p) {
+    return p.id == id;
+  });
+  if (it == _pending.end()) {
+    return false;
+  }
+
+  // Moves to where the new priority goes, the vector already has room for it
+  pending p = *it;
+  p.req.priority = priority;
+  _pending.erase(it);
+  _insert(p);
+  return true;
+}
+
+bool upload_scheduler::cancel(upload_id id) {
+  // Whatever was already sent still lands, the destination is left half written
+  auto it = std::find_if(_pending.begin(), _pending.end(), [id](const pending& p) {
+    return p.id == id;
+  });
+  if (it == _pending.end()) {
+    return false;
+  }
+  _pending.erase(it);
+  return true;
+}
+
+VkDeviceSize upload_scheduler::pending_bytes() const {
+  return std::accumulate(_pending.begin(), _pending.end(), VkDeviceSize{0},
+    [](VkDeviceSize total, const pending& p) { return total + (p.req.src.size() - p.sent); }
+  );
+}
+
+void upload_scheduler::tick() {
+  for (auto& s : _slots) {
+    if (s.upload && _context.is_upload_done(*s.upload)) {
+      _retire(s);
+    }
+  }
+
+  // The transfer queue is behind, sending more would only make the next frames wait
+  auto& s = _slots[_next_slot];
+  if (_pending.empty() || s.upload) {
+    return;
+  }
+
+  // Created on the first upload, if it doesn't fit yet try again next frame
+  if (!_staging) {
+    _staging = _context.create_staging_buffer(_frame_budget*SLOT_COUNT);
+    if (!_staging) {
+      return;
+    }
+  }
+
+  const VkDeviceSize slot_offset = _next_slot*_frame_budget;
+  VkDeviceSize used{0};
+  std::size_t copy_count{0};
+  std::size_t completed{0};
+  for (auto& p : _pending) {
+    if (used == _frame_budget || copy_count == MAX_COPIES_PER_TICK ||
+        s.finished_count == MAX_COPIES_PER_TICK) {
+      break;
+    }
+
+    // Big requests get split across frames
+    const VkDeviceSize size = std::min(p.req.src.size() - p.sent, _frame_budget - used);
+    if (size > 0) {
+      std::memcpy(_staging->data + slot_offset + used, p.req.src.data() + p.sent, size);
+      _copies[copy_count++] = buffer_copy{
+        p.req.dst, {slot_offset + used, p.req.dst_offset + p.sent, size}
+      };
+      used += size;
+      p.sent += size;
+    }
+
+    if (p.sent == p.req.src.size()) {
+      s.finished[s.finished_count++] = completion{p.req.on_done, p.req.user};
+      ++completed;
+    }
+  }
+
+  // Finished ones are all at the front, everything after the first unfinished one is untouched
+  _pending.erase(_pending.begin(), _pending.begin() + static_cast<std::ptrdiff_t>(completed));
+
+  if (copy_count == 0) {
+    _retire(s); // Only empty requests, nothing to wait for
+    return;
+  }
+  s.upload = _context.submit_copies(_staging->buffer, {_copies.data(), copy_count});
+  _next_slot = (_next_slot + 1) % SLOT_COUNT;
+}
+
+void upload_scheduler::destroy() {
+  for (auto& s : _slots) {
+    while (s.upload && !_context.is_upload_done(*s.upload)) {
+      std::this_thread::yield();
+    }
+    _retire(s);
+  }
+  if (_staging) {
+    _context.destroy_staging_buffer(*_staging);
+    _staging.reset();
+  }
+  _pending.clear();
+}
+
+void upload_scheduler::_retire(slot& s) {
+  if (s.upload) {
+    _context.finish_upload(*s.upload);
+    s.upload.reset();
+  }
+  for (std::size_t i = 0; i < s.finished_count; ++i) {
+    if (s.finished[i].fun) {
+      s.finished[i].fun(s.finished[i].user);
+    }
+  }
+  s.finished_count = 0;
+}
+
+VkDeviceSize upload_scheduler::_evict_staging(uint32_t heap) {
+  if (!_staging || _context.memory_budget().allocation_heap(_staging->memory) != heap) {
+    return 0;
+  }
+
+  // Copies still reading from it, retiring them here would run callbacks mid allocation
+  const bool in_flight = std::any_of(_slots.begin(), _slots.end(), [](const slot& s) {
+    return s.upload.has_value();
+  });
+  if (in_flight) {
+    return 0;
+  }
+
+  const VkDeviceSize size = _staging->size;
+  _context.destroy_staging_buffer(*_staging);
+  _staging.reset();
+  return size;
+}
+
+} // namespace ntf
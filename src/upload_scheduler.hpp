@@ -0,0 +1,112 @@
+#pragma once
+
+#include "vulkan_context.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace ntf {
+
+// Higher goes first: anything visible before anything that isn't, then the closest
+constexpr float streaming_priority(float distance, bool visible) {
+  const float closeness = 1.f/(1.f + (distance > 0.f ? distance : 0.f));
+  return visible ? 1.f + closeness : closeness;
+}
+
+// Runtime uploads into device buffers, spread over frames so they never spike a frame
+// Every tick copies at most the frame budget of pending data, highest priority first, into
+// one of a few staging slots and submits a single copy for it on the transfer queue
+// Requests can be reprioritized or cancelled until their last byte leaves for the GPU
+// Ticks don't allocate, only submitting more requests than ever before does
+// Render thread only
+class upload_scheduler {
+public:
+  using upload_id = uint64_t;
+
+  // Called from tick once the copy landed, with the user pointer of the request
+  using done_callback = void(*)(void* user);
+
+  static constexpr VkDeviceSize DEFAULT_FRAME_BUDGET = 4*1024*1024;
+
+  // Slots in flight, if the transfer queue falls this far behind ticks do nothing
+  static constexpr uint32_t SLOT_COUNT = 3;
+
+  // Requests a single tick sends (or finishes), the rest wait for the next one
+  static constexpr std::size_t MAX_COPIES_PER_TICK = 64;
+
+  struct request {
+    VkBuffer dst;
+    VkDeviceSize dst_offset;
+    std::span<const std::byte> src; // Has to stay alive until done or cancelled
+    float priority;
+    done_callback on_done{nullptr};
+    void* user{nullptr};
+  };
+
+private:
+  struct pending {
+    upload_id id;
+    request req;
+    VkDeviceSize sent{0}; // Bytes already handed to the transfer queue
+  };
+
+  struct completion {
+    done_callback fun;
+    void* user;
+  };
+
+  struct slot {
+    std::optional<buffer_upload> upload;
+    std::array<completion, MAX_COPIES_PER_TICK> finished; // Last bytes are in this slot
+    std::size_t finished_count{0};
+  };
+
+public:
+  explicit upload_scheduler(vk_context& context, VkDeviceSize frame_budget = DEFAULT_FRAME_BUDGET);
+  ~upload_scheduler();
+
+  upload_scheduler(const upload_scheduler&) = delete;
+  upload_scheduler& operator=(const upload_scheduler&) = delete;
+
+public:
+  upload_id submit(request req);
+
+  // Both return false if the request is already on its way (or unknown)
+  bool set_priority(upload_id id, float priority);
+  bool cancel(upload_id id);
+
+  // Once per frame: retires finished copies and sends the next batch
+  void tick();
+
+  std::size_t pending_count() const { return _pending.size(); }
+  VkDeviceSize pending_bytes() const;
+
+  // Waits for the copies in flight and frees the staging memory, before the context goes
+  void destroy();
+
+private:
+  void _insert(const pending& p);
+  void _retire(slot& s);
+  VkDeviceSize _evict_staging(uint32_t heap);
+
+private:
+  vk_context& _context;
+  VkDeviceSize _frame_budget;
+
+  // SLOT_COUNT slots of the frame budget. Given back to the budget when it runs out and
+  // nothing is in flight, the next tick with something to send creates it again
+  std::optional<mapped_buffer> _staging;
+  vk_memory_budget::evictor_id _staging_evictor;
+  std::array<slot, SLOT_COUNT> _slots;
+  uint32_t _next_slot{0};
+
+  std::vector<pending> _pending; // Highest priority first, kept sorted on insert
+  std::array<buffer_copy, MAX_COPIES_PER_TICK> _copies; // Reused every tick
+  upload_id _next_id{1};
+};
+
+} // namespace ntf
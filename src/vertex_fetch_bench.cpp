@@ -0,0 +1,163 @@
+#include "vertex_fetch_bench.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+
+namespace ntf {
+
+namespace {
+
+// The whole grid ends up a few pixels wide, nearly no triangle covers a sample
+constexpr float GRID_SCALE = .01f;
+
+template<typename T>
+void append_bytes(std::vector<std::byte>& out, const T& value) {
+  const auto* bytes = reinterpret_cast<const std::byte*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+} // namespace
+
+vertex_fetch_bench::vertex_fetch_bench(vk_context& context, upload_scheduler& uploads) :
+  _context(context), _uploads(uploads) {
+  constexpr uint32_t SIDE = GRID_SIZE + 1;
+  static_assert(SIDE*SIDE - 1 <= UINT16_MAX);
+  _vertex_count = SIDE*SIDE;
+
+  std::vector<vertex> vertices;
+  vertices.reserve(_vertex_count);
+  for (uint32_t y = 0; y < SIDE; ++y) {
+    for (uint32_t x = 0; x < SIDE; ++x) {
+      const float u = static_cast<float>(x)/GRID_SIZE;
+      const float v = static_cast<float>(y)/GRID_SIZE;
+      vertices.push_back({{u*2.f - 1.f, v*2.f - 1.f}, {u, v, 1.f - u}});
+    }
+  }
+
+  _interleaved.reserve(_vertex_count*sizeof(vertex));
+  _split.reserve(_vertex_count*sizeof(vertex));
+  for (const auto& vert : vertices) {
+    append_bytes(_interleaved, vert);
+    append_bytes(_split, vert.pos);
+  }
+  for (const auto& vert : vertices) {
+    append_bytes(_split, vert.color);
+  }
+
+  // Same winding as the builtin quad
+  _indices.reserve(GRID_SIZE*GRID_SIZE*6);
+  for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+    for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+      const auto a = static_cast<uint16_t>(y*SIDE + x);
+      const auto b = static_cast<uint16_t>(a + 1);
+      const auto c = static_cast<uint16_t>(b + SIDE);
+      const auto d = static_cast<uint16_t>(a + SIDE);
+      _indices.insert(_indices.end(), {a, b, c, c, d, a});
+    }
+  }
+}
+
+bool vertex_fetch_bench::upload() {
+  // Whatever got created before one didn't fit is destroyed along with the context
+  const auto interleaved = _context.create_geometry_buffer(_interleaved.size(),
+                                                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+  const auto split = _context.create_geometry_buffer(_split.size(),
+                                                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+  const auto indices = _context.create_geometry_buffer(_indices.size()*sizeof(uint16_t),
+                                                       VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+  if (!interleaved || !split || !indices) {
+    return false;
+  }
+  _interleaved_buffer = *interleaved;
+  _split_buffer = *split;
+  _index_buffer = *indices;
+
+  _upload(_interleaved_buffer, _interleaved);
+  _upload(_split_buffer, _split);
+  _upload(_index_buffer, std::as_bytes(std::span{_indices}));
+  return true;
+}
+
+void vertex_fetch_bench::_upload(buffer_handle dst, std::span<const std::byte> src) {
+  ++_uploads_left;
+  _uploads.submit({_context.buffer(dst), 0, src, 1.f, &_on_uploaded, this});
+}
+
+void vertex_fetch_bench::_on_uploaded(void* user) {
+  --static_cast<vertex_fetch_bench*>(user)->_uploads_left;
+}
+
+void vertex_fetch_bench::build_pipelines(std::string_view vert_src, std::string_view pos_vert_src,
+                                         std::string_view frag_src) {
+  // Sets up the layout every pipeline shares, nothing draws with it
+  _context.create_graphics_pipeline(vert_src, frag_src);
+
+  const auto vert = shader_hash(vert_src);
+  const auto frag = shader_hash(frag_src);
+  const auto interleaved_desc = _context.default_pipeline_desc(vert, frag);
+  const auto split_desc = _context.default_pipeline_desc(vert, frag, vertex_layout::split);
+  // Only the positions, and only the first stream bound
+  auto pos_desc = _context.default_pipeline_desc(shader_hash(pos_vert_src), frag,
+                                                 vertex_layout::split);
+  pos_desc.binding_count = 1;
+  pos_desc.attribute_count = 1;
+
+  const auto target = _context.current_target();
+  // All linked optimized, a fast link would be timed along with the layout
+  const auto build = [&](const pipeline_desc& desc, std::string_view vs) {
+    return _context.adopt_pipeline(_context.build_pipeline(desc, target, vs, frag_src,
+                                                           pipeline_link::optimized), desc);
+  };
+
+  _passes = {{
+    {"interleaved", sizeof(vertex), vertex_layout::interleaved,
+     build(interleaved_desc, vert_src), interleaved_desc},
+    {"split", sizeof(vertex), vertex_layout::split, build(split_desc, vert_src), split_desc},
+    {"positions only", sizeof(vertex::pos), vertex_layout::split,
+     build(pos_desc, pos_vert_src), pos_desc},
+  }};
+}
+
+std::vector<vertex_fetch_bench::result> vertex_fetch_bench::run(uint32_t instances) {
+  draw_push_constants push{};
+  push.transform = glm::scale(glm::mat4{1.f}, glm::vec3{GRID_SCALE, GRID_SCALE, 1.f});
+
+  const VkBuffer split = _context.buffer(_split_buffer);
+  std::vector<timed_pass> timed;
+  timed.reserve(_passes.size()*RUNS);
+  for (uint32_t run = 0; run < RUNS; ++run) {
+    for (const auto& p : _passes) {
+      timed_pass t{};
+      t.pipeline = p.pipeline;
+      t.desc = p.desc;
+      if (p.layout == vertex_layout::interleaved) {
+        t.vertex_buffers[0] = _context.buffer(_interleaved_buffer);
+      } else {
+        // Passes binding fewer streams ignore the rest
+        t.vertex_buffers = {split, split};
+        t.vertex_offsets = {0, _vertex_count*sizeof(vertex::pos)};
+      }
+      t.index_buffer = _context.buffer(_index_buffer);
+      t.index_count = static_cast<uint32_t>(_indices.size());
+      t.instances = instances;
+      t.push = push;
+      timed.push_back(t);
+    }
+  }
+  const auto times = _context.time_passes(timed);
+
+  // The first runs pay for caches and clocks warming up, the best one is the steady state
+  std::vector<result> results;
+  results.reserve(_passes.size());
+  for (std::size_t i = 0; i < _passes.size(); ++i) {
+    double best = times[i];
+    for (uint32_t run = 1; run < RUNS; ++run) {
+      best = std::min(best, times[run*_passes.size() + i]);
+    }
+    results.push_back({_passes[i].name, _passes[i].fetched_bytes, best});
+  }
+  return results;
+}
+
+} // namespace ntf
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "vulkan_context.hpp"
+#include "upload_scheduler.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace ntf {
+
+// GPU time of drawing the same grid from each vertex layout, one interleaved stream against
+// a stream per attribute, plus a pass binding only the split positions like a depth or
+// shadow pass would. The grid gets shrunk to a few pixels so the draws are bound by the
+// vertex fetch, not by the fragments
+// Render thread only
+class vertex_fetch_bench {
+public:
+  static constexpr uint32_t GRID_SIZE = 255; // Quads per side, its vertices fit uint16 indices
+  static constexpr uint32_t RUNS = 16; // Every pass is drawn this many times, the best counts
+
+  struct result {
+    std::string_view name;
+    uint32_t fetched_bytes; // Per vertex
+    double ms;
+  };
+
+private:
+  struct pass {
+    std::string_view name;
+    uint32_t fetched_bytes;
+    vertex_layout layout;
+    pipeline_handle pipeline;
+    pipeline_desc desc;
+  };
+
+public:
+  vertex_fetch_bench(vk_context& context, upload_scheduler& uploads);
+
+  vertex_fetch_bench(const vertex_fetch_bench&) = delete;
+  vertex_fetch_bench& operator=(const vertex_fetch_bench&) = delete;
+
+public:
+  // Queues both layouts and the indices on the scheduler, ready once every one landed
+  // Returns false if the buffers don't fit in the memory budget
+  bool upload();
+  bool ready() const { return _uploads_left == 0; }
+
+  // SPIR-V of res/shader.vs, res/shader_pos.vs and res/shader.fs
+  // Creates the default pipeline too, for the pipeline layout
+  void build_pipelines(std::string_view vert_src, std::string_view pos_vert_src,
+                       std::string_view frag_src);
+
+  // Draws every instance of the grid per pass, once ready and with the pipelines built
+  std::vector<result> run(uint32_t instances);
+
+private:
+  static void _on_uploaded(void* user);
+  void _upload(buffer_handle dst, std::span<const std::byte> src);
+
+private:
+  vk_context& _context;
+  upload_scheduler& _uploads;
+
+  // Upload sources, they have to outlive the requests
+  std::vector<std::byte> _interleaved, _split;
+  std::vector<uint16_t> _indices;
+  uint32_t _vertex_count{0};
+
+  buffer_handle _interleaved_buffer, _split_buffer, _index_buffer;
+  uint32_t _uploads_left{0};
+
+  std::array<pass, 3> _passes{};
+};
+
+} // namespace ntf
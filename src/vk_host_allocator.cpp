@@ -0,0 +1,268 @@
+#include "vk_host_allocator.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+constexpr uint8_t NO_POOL = 0xFF;
+
+// Stored right before every pointer handed to the driver, free doesn't tell us the size
+struct alignas(16) alloc_header {
+  std::size_t size;
+  uint32_t offset; // From the start of the block (or slot) to the pointer
+  uint8_t scope;
+  uint8_t pool;
+};
+static_assert(sizeof(alloc_header) == 16);
+
+constexpr std::size_t HEADER_SIZE = sizeof(alloc_header);
+
+alloc_header* header_of(void* mem) {
+  return reinterpret_cast<alloc_header*>(static_cast<std::byte*>(mem) - HEADER_SIZE);
+}
+
+constexpr std::size_t slot_size(std::size_t pool_index) {
+  return ntf::vk_host_allocator::MIN_POOLED_SIZE << pool_index;
+}
+
+constexpr const char* scope_names[] = {"command", "object", "cache", "device", "instance"};
+
+class callback_timer {
+public:
+  explicit callback_timer(std::atomic<uint64_t>& out) :
+    _out(out), _start(std::chrono::steady_clock::now()) {}
+
+  ~callback_timer() {
+    const auto elapsed = std::chrono::steady_clock::now() - _start;
+    _out.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                   std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t>& _out;
+  std::chrono::steady_clock::time_point _start;
+};
+
+} // namespace
+
+namespace ntf {
+
+static_assert(slot_size(vk_host_allocator::POOL_COUNT-1) == vk_host_allocator::MAX_POOLED_SIZE,
+              "Pool count doesn't match the pooled size range");
+
+vk_host_allocator::vk_host_allocator() {
+  _callbacks.pUserData = this;
+  _callbacks.pfnAllocation = &vk_host_allocator::_vk_allocate;
+  _callbacks.pfnReallocation = &vk_host_allocator::_vk_reallocate;
+  _callbacks.pfnFree = &vk_host_allocator::_vk_free;
+  _callbacks.pfnInternalAllocation = &vk_host_allocator::_vk_internal_allocate;
+  _callbacks.pfnInternalFree = &vk_host_allocator::_vk_internal_free;
+}
+
+vk_host_allocator::~vk_host_allocator() {
+  for (auto& p : _pools) {
+    for (auto* chunk : p.chunks) {
+      std::free(chunk);
+    }
+  }
+}
+
+void* vk_host_allocator::_allocate(std::size_t size, std::size_t align,
+                                   VkSystemAllocationScope scope) {
+  if (size == 0) {
+    return nullptr;
+  }
+  align = std::max(align, alignof(alloc_header));
+
+  // Command and object scoped memory comes and goes all the time, keep it in pools
+  const bool short_lived = scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND ||
+                           scope == VK_SYSTEM_ALLOCATION_SCOPE_OBJECT;
+  const std::size_t total = size + HEADER_SIZE;
+
+  std::byte* block;
+  uint8_t pool_index{NO_POOL};
+  std::size_t offset{HEADER_SIZE};
+  if (short_lived && align == alignof(alloc_header) && total <= MAX_POOLED_SIZE) {
+    const std::size_t slot = std::bit_ceil(std::max(total, MIN_POOLED_SIZE));
+    pool_index = static_cast<uint8_t>(std::countr_zero(slot/MIN_POOLED_SIZE));
+    block = static_cast<std::byte*>(_pool_allocate(pool_index));
+  } else {
+    block = static_cast<std::byte*>(std::malloc(total + align));
+    if (block) {
+      const auto base = reinterpret_cast<std::uintptr_t>(block);
+      offset = ((base + HEADER_SIZE + align - 1) & ~(align - 1)) - base;
+    }
+  }
+  if (!block) {
+    return nullptr;
+  }
+
+  std::byte* mem = block + offset;
+  auto* header = header_of(mem);
+  header->size = size;
+  header->offset = static_cast<uint32_t>(offset);
+  header->scope = static_cast<uint8_t>(scope);
+  header->pool = pool_index;
+
+  auto& stats = _stats[scope];
+  stats.allocations.fetch_add(1, std::memory_order_relaxed);
+  if (pool_index != NO_POOL) {
+    stats.pooled.fetch_add(1, std::memory_order_relaxed);
+  }
+  _track(scope, static_cast<int64_t>(size));
+
+  return mem;
+}
+
+void* vk_host_allocator::_reallocate(void* original, std::size_t size, std::size_t align,
+                                     VkSystemAllocationScope scope) {
+  if (!original) {
+    return _allocate(size, align, scope);
+  }
+  if (size == 0) {
+    _free(original);
+    return nullptr;
+  }
+
+  _stats[scope].reallocations.fetch_add(1, std::memory_order_relaxed);
+
+  // Still fits in its slot, nothing to move. Slots are only aligned like the header, asking
+  // for more moves it into a block that is
+  auto* header = header_of(original);
+  if (header->pool != NO_POOL && align <= alignof(alloc_header) &&
+      size + HEADER_SIZE <= slot_size(header->pool)) {
+    _track(static_cast<VkSystemAllocationScope>(header->scope),
+           static_cast<int64_t>(size) - static_cast<int64_t>(header->size));
+    header->size = size;
+    return original;
+  }
+
+  void* mem = _allocate(size, align, scope);
+  if (!mem) {
+    return nullptr; // The original stays valid
+  }
+  std::memcpy(mem, original, std::min(size, header->size));
+  _free(original);
+  return mem;
+}
+
+void vk_host_allocator::_free(void* mem) {
+  if (!mem) {
+    return;
+  }
+
+  auto* header = header_of(mem);
+  const auto scope = static_cast<VkSystemAllocationScope>(header->scope);
+  _stats[scope].frees.fetch_add(1, std::memory_order_relaxed);
+  _track(scope, -static_cast<int64_t>(header->size));
+
+  std::byte* block = static_cast<std::byte*>(mem) - header->offset;
+  if (header->pool != NO_POOL) {
+    _pool_free(header->pool, block);
+  } else {
+    std::free(block);
+  }
+}
+
+void* vk_host_allocator::_pool_allocate(std::size_t pool_index) {
+  auto& p = _pools[pool_index];
+  std::scoped_lock lock{p.mtx};
+
+  if (!p.free_list) {
+    // Carve a new chunk into slots and thread them into the free list
+    const std::size_t slot = slot_size(pool_index);
+    auto* chunk = static_cast<std::byte*>(std::malloc(POOL_CHUNK_SIZE));
+    if (!chunk) {
+      return nullptr;
+    }
+    p.chunks.emplace_back(chunk);
+
+    for (std::size_t i = POOL_CHUNK_SIZE/slot; i-- > 0;) {
+      std::byte* s = chunk + i*slot;
+      *reinterpret_cast<void**>(s) = p.free_list;
+      p.free_list = s;
+    }
+  }
+
+  void* slot = p.free_list;
+  p.free_list = *static_cast<void**>(slot);
+  return slot;
+}
+
+void vk_host_allocator::_pool_free(std::size_t pool_index, void* slot) {
+  auto& p = _pools[pool_index];
+  std::scoped_lock lock{p.mtx};
+
+  *static_cast<void**>(slot) = p.free_list;
+  p.free_list = slot;
+}
+
+void vk_host_allocator::_track(VkSystemAllocationScope scope, int64_t bytes) {
+  auto& stats = _stats[scope];
+  const int64_t now = stats.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+  int64_t peak = stats.peak_bytes.load(std::memory_order_relaxed);
+  while (now > peak &&
+         !stats.peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+}
+
+void vk_host_allocator::print_stats() const {
+  fmt::print("Vulkan host allocations by scope:\n");
+  for (std::size_t i = 0; i < SCOPE_COUNT; ++i) {
+    const auto& stats = _stats[i];
+    fmt::print(" - {}: {} allocations ({} pooled), {} reallocations, {} frees, "
+               "{} bytes in use, {} bytes peak, {} internal bytes, {:.3f}ms\n",
+               scope_names[i], stats.allocations.load(), stats.pooled.load(),
+               stats.reallocations.load(), stats.frees.load(), stats.bytes.load(),
+               stats.peak_bytes.load(), stats.internal_bytes.load(),
+               static_cast<double>(stats.nanoseconds.load())/1e6);
+  }
+}
+
+void* VKAPI_PTR vk_host_allocator::_vk_allocate(void* user, std::size_t size, std::size_t align,
+                                                VkSystemAllocationScope scope) {
+  auto* self = static_cast<vk_host_allocator*>(user);
+  callback_timer timer{self->_stats[scope].nanoseconds};
+  return self->_allocate(size, align, scope);
+}
+
+void* VKAPI_PTR vk_host_allocator::_vk_reallocate(void* user, void* original, std::size_t size,
+                                                  std::size_t align,
+                                                  VkSystemAllocationScope scope) {
+  auto* self = static_cast<vk_host_allocator*>(user);
+  callback_timer timer{self->_stats[scope].nanoseconds};
+  return self->_reallocate(original, size, align, scope);
+}
+
+void VKAPI_PTR vk_host_allocator::_vk_free(void* user, void* mem) {
+  if (!mem) {
+    return;
+  }
+  auto* self = static_cast<vk_host_allocator*>(user);
+  callback_timer timer{self->_stats[header_of(mem)->scope].nanoseconds};
+  self->_free(mem);
+}
+
+void VKAPI_PTR vk_host_allocator::_vk_internal_allocate(void* user, std::size_t size,
+                                                        VkInternalAllocationType,
+                                                        VkSystemAllocationScope scope) {
+  auto* self = static_cast<vk_host_allocator*>(user);
+  self->_stats[scope].internal_bytes.fetch_add(static_cast<int64_t>(size),
+                                               std::memory_order_relaxed);
+}
+
+void VKAPI_PTR vk_host_allocator::_vk_internal_free(void* user, std::size_t size,
+                                                    VkInternalAllocationType,
+                                                    VkSystemAllocationScope scope) {
+  auto* self = static_cast<vk_host_allocator*>(user);
+  self->_stats[scope].internal_bytes.fetch_sub(static_cast<int64_t>(size),
+                                               std::memory_order_relaxed);
+}
+
+} // namespace ntf
@@ -0,0 +1,91 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ntf {
+
+// Host memory the driver allocates for us, passed to every vkCreate*/vkDestroy* call
+// Small allocations with short lived scopes (command, object) come from pools carved out
+// of big chunks, the rest goes to the heap. Everything is counted per allocation scope,
+// including the time spent allocating
+class vk_host_allocator {
+public:
+  static constexpr std::size_t SCOPE_COUNT = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+  // Pooled size classes are powers of two from MIN_POOLED_SIZE to MAX_POOLED_SIZE
+  // (header included)
+  static constexpr std::size_t MIN_POOLED_SIZE = 32;
+  static constexpr std::size_t MAX_POOLED_SIZE = 4096;
+  static constexpr std::size_t POOL_COUNT = 8;
+  static constexpr std::size_t POOL_CHUNK_SIZE = 64*1024;
+
+  struct scope_stats {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> reallocations{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> pooled{0}; // Allocations served from a pool
+    std::atomic<int64_t> bytes{0};
+    std::atomic<int64_t> peak_bytes{0};
+    std::atomic<int64_t> internal_bytes{0}; // Allocated by the driver without the callbacks
+    std::atomic<uint64_t> nanoseconds{0}; // Spent inside the callbacks
+  };
+
+private:
+  // Free list of same sized slots, never given back until the allocator dies
+  struct pool {
+    std::mutex mtx;
+    void* free_list{nullptr};
+    std::vector<std::byte*> chunks;
+  };
+
+public:
+  vk_host_allocator();
+  ~vk_host_allocator();
+
+  vk_host_allocator(const vk_host_allocator&) = delete;
+  vk_host_allocator& operator=(const vk_host_allocator&) = delete;
+
+public:
+  const VkAllocationCallbacks* callbacks() const { return &_callbacks; }
+  const scope_stats& stats(VkSystemAllocationScope scope) const { return _stats[scope]; }
+
+  void print_stats() const;
+
+private:
+  void* _allocate(std::size_t size, std::size_t align, VkSystemAllocationScope scope);
+  void* _reallocate(void* original, std::size_t size, std::size_t align,
+                    VkSystemAllocationScope scope);
+  void _free(void* mem);
+
+  void* _pool_allocate(std::size_t pool_index);
+  void _pool_free(std::size_t pool_index, void* slot);
+
+  void _track(VkSystemAllocationScope scope, int64_t bytes);
+
+  static void* VKAPI_PTR _vk_allocate(void* user, std::size_t size, std::size_t align,
+                                      VkSystemAllocationScope scope);
+  static void* VKAPI_PTR _vk_reallocate(void* user, void* original, std::size_t size,
+                                        std::size_t align, VkSystemAllocationScope scope);
+  static void VKAPI_PTR _vk_free(void* user, void* mem);
+  static void VKAPI_PTR _vk_internal_allocate(void* user, std::size_t size,
+                                              VkInternalAllocationType type,
+                                              VkSystemAllocationScope scope);
+  static void VKAPI_PTR _vk_internal_free(void* user, std::size_t size,
+                                          VkInternalAllocationType type,
+                                          VkSystemAllocationScope scope);
+
+private:
+  VkAllocationCallbacks _callbacks;
+  std::array<scope_stats, SCOPE_COUNT> _stats;
+  std::array<pool, POOL_COUNT> _pools;
+};
+
+} // namespace ntf
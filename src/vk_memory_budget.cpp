@@ -0,0 +1,164 @@
+#include "vk_memory_budget.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <utility>
+
+namespace {
+
+constexpr const char* category_names[] = {"geometry", "textures", "staging", "targets"};
+static_assert(std::size(category_names) == ntf::vk_memory_budget::CATEGORY_COUNT);
+
+// Who goes first when the budget runs out. Staging memory is only a cache of data
+// that is already somewhere else, render targets are needed every frame
+constexpr ntf::memory_category eviction_order[] = {
+  ntf::memory_category::staging,
+  ntf::memory_category::textures,
+  ntf::memory_category::geometry,
+};
+
+VkDeviceSize sum(const std::array<VkDeviceSize, ntf::vk_memory_budget::CATEGORY_COUNT>& values) {
+  return std::accumulate(values.begin(), values.end(), VkDeviceSize{0});
+}
+
+} // namespace
+
+namespace ntf {
+
+void vk_memory_budget::init(VkPhysicalDevice device,
+                            PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_props2) {
+  _device = device;
+  _get_props2 = get_props2;
+
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties(_device, &props);
+
+  _memory_types.resize(props.memoryTypeCount);
+  for (uint32_t i = 0; i < props.memoryTypeCount; ++i) {
+    _memory_types[i] = props.memoryTypes[i].heapIndex;
+  }
+
+  _heaps.resize(props.memoryHeapCount);
+  for (uint32_t i = 0; i < props.memoryHeapCount; ++i) {
+    _heaps[i].size = props.memoryHeaps[i].size;
+    _heaps[i].flags = props.memoryHeaps[i].flags;
+    _heaps[i].budget = static_cast<VkDeviceSize>(
+      static_cast<double>(props.memoryHeaps[i].size)*FALLBACK_BUDGET
+    );
+  }
+
+  update();
+}
+
+void vk_memory_budget::update() {
+  for (auto& heap : _heaps) {
+    heap.tracked_at_update = sum(heap.tracked);
+  }
+
+  if (!_get_props2) {
+    for (auto& heap : _heaps) {
+      heap.usage = heap.tracked_at_update;
+    }
+    return;
+  }
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{};
+  budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+  VkPhysicalDeviceMemoryProperties2 props{};
+  props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+  props.pNext = &budget;
+
+  _get_props2(_device, &props);
+
+  for (std::size_t i = 0; i < _heaps.size(); ++i) {
+    _heaps[i].budget = budget.heapBudget[i];
+    _heaps[i].usage = budget.heapUsage[i];
+  }
+}
+
+VkDeviceSize vk_memory_budget::usage(uint32_t heap) const {
+  const auto& state = _heaps[heap];
+  const VkDeviceSize tracked = sum(state.tracked);
+
+  // Only our own changes since the driver last reported, it doesn't see them right away
+  if (tracked >= state.tracked_at_update) {
+    return state.usage + (tracked - state.tracked_at_update);
+  }
+  const VkDeviceSize freed = state.tracked_at_update - tracked;
+  return state.usage > freed ? state.usage - freed : 0;
+}
+
+bool vk_memory_budget::make_room(uint32_t heap, VkDeviceSize size) {
+  for (auto category : eviction_order) {
+    for (auto& evict : _evictors[static_cast<std::size_t>(category)]) {
+      if (fits(heap, size)) {
+        return true;
+      }
+      const VkDeviceSize over = usage(heap) + size - _heaps[heap].budget;
+      evict.fun(heap, over);
+    }
+  }
+  return fits(heap, size);
+}
+
+auto vk_memory_budget::add_evictor(memory_category category, evictor fun) -> evictor_id {
+  const evictor_id id = _next_evictor++;
+  _evictors[static_cast<std::size_t>(category)].emplace_back(registered_evictor{
+    id, std::move(fun)
+  });
+  return id;
+}
+
+void vk_memory_budget::remove_evictor(evictor_id id) {
+  for (auto& evictors : _evictors) {
+    std::erase_if(evictors, [id](const registered_evictor& e) { return e.id == id; });
+  }
+}
+
+std::optional<uint32_t> vk_memory_budget::allocation_heap(VkDeviceMemory mem) const {
+  auto it = _allocations.find(mem);
+  if (it == _allocations.end()) {
+    return std::nullopt;
+  }
+  return it->second.heap;
+}
+
+void vk_memory_budget::on_allocate(VkDeviceMemory mem, uint32_t memory_type,
+                                   memory_category category, VkDeviceSize size) {
+  const uint32_t heap = heap_of(memory_type);
+  _heaps[heap].tracked[static_cast<std::size_t>(category)] += size;
+  _allocations.emplace(mem, allocation{heap, category, size});
+}
+
+void vk_memory_budget::on_free(VkDeviceMemory mem) {
+  auto it = _allocations.find(mem);
+  if (it == _allocations.end()) {
+    return;
+  }
+
+  const auto& alloc = it->second;
+  _heaps[alloc.heap].tracked[static_cast<std::size_t>(alloc.category)] -= alloc.size;
+  _allocations.erase(it);
+}
+
+void vk_memory_budget::print() const {
+  constexpr double MIB = 1024.*1024.;
+
+  fmt::print("Device memory ({}):\n", _get_props2 ? "VK_EXT_memory_budget" : "estimated budget");
+  for (std::size_t i = 0; i < _heaps.size(); ++i) {
+    const auto& heap = _heaps[i];
+    fmt::print(" - Heap {}: {:.1f}/{:.1f} MiB used (heap size {:.1f} MiB)\n",
+               i, usage(static_cast<uint32_t>(i))/MIB, heap.budget/MIB, heap.size/MIB);
+    for (std::size_t c = 0; c < CATEGORY_COUNT; ++c) {
+      if (heap.tracked[c]) {
+        fmt::print("   - {}: {:.2f} MiB\n", category_names[c], heap.tracked[c]/MIB);
+      }
+    }
+  }
+}
+
+} // namespace ntf
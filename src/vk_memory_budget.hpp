@@ -0,0 +1,107 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace ntf {
+
+// What an allocation is for, so usage can be broken down and the right things get evicted
+enum class memory_category : uint8_t {
+  geometry = 0,
+  textures,
+  staging,
+  targets, // Render targets we allocate ourselves, the swapchain images are the driver's
+  count,
+};
+
+// Per heap device memory accounting against the budget the driver gives us
+// With VK_EXT_memory_budget the budget and usage come from the driver (refreshed by update),
+// otherwise the budget is a fraction of the heap size and the usage is whatever we track
+class vk_memory_budget {
+public:
+  static constexpr std::size_t CATEGORY_COUNT = static_cast<std::size_t>(memory_category::count);
+
+  // Budget without VK_EXT_memory_budget, the rest of the heap is left to everybody else
+  static constexpr float FALLBACK_BUDGET = .8f;
+
+  // Frees up to bytes from the given heap, returns how much it actually freed
+  using evictor = std::function<VkDeviceSize(uint32_t heap, VkDeviceSize bytes)>;
+  using evictor_id = uint32_t;
+
+  struct heap_state {
+    VkDeviceSize size{0};
+    VkMemoryHeapFlags flags{0};
+    VkDeviceSize budget{0};
+    VkDeviceSize usage{0}; // As reported on the last update, includes driver internals
+    VkDeviceSize tracked_at_update{0};
+    std::array<VkDeviceSize, CATEGORY_COUNT> tracked{}; // Allocated by us, per category
+  };
+
+private:
+  struct allocation {
+    uint32_t heap;
+    memory_category category;
+    VkDeviceSize size;
+  };
+
+  struct registered_evictor {
+    evictor_id id;
+    evictor fun;
+  };
+
+public:
+  // get_props2 is vkGetPhysicalDeviceMemoryProperties2(KHR), null without the extension
+  void init(VkPhysicalDevice device, PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_props2);
+
+  // Refresh the driver numbers, once per frame is enough
+  void update();
+
+  uint32_t heap_of(uint32_t memory_type) const { return _memory_types[memory_type]; }
+  bool is_device_local(uint32_t heap) const {
+    return _heaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+  }
+
+  // Current usage estimate: the last driver report plus what we did since then
+  VkDeviceSize usage(uint32_t heap) const;
+  bool fits(uint32_t heap, VkDeviceSize size) const { return usage(heap) + size <= _heaps[heap].budget; }
+
+  // Evicts until size fits in the heap budget, lowest priority categories first
+  // Returns false if there was nothing left to evict, the caller should defer the load
+  bool make_room(uint32_t heap, VkDeviceSize size);
+
+  // Evictors for a category, called from make_room on the thread allocating
+  // Whoever registers one has to remove it before going away
+  evictor_id add_evictor(memory_category category, evictor fun);
+  void remove_evictor(evictor_id id);
+
+  // Heap an allocation was charged to, std::nullopt if it isn't tracked
+  std::optional<uint32_t> allocation_heap(VkDeviceMemory mem) const;
+
+  void on_allocate(VkDeviceMemory mem, uint32_t memory_type, memory_category category,
+                   VkDeviceSize size);
+  void on_free(VkDeviceMemory mem);
+
+  const std::vector<heap_state>& heaps() const { return _heaps; }
+  bool has_driver_budget() const { return _get_props2 != nullptr; }
+
+  void print() const;
+
+private:
+  VkPhysicalDevice _device{VK_NULL_HANDLE};
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR _get_props2{nullptr};
+
+  std::vector<uint32_t> _memory_types; // Heap index of each memory type
+  std::vector<heap_state> _heaps;
+  std::unordered_map<VkDeviceMemory, allocation> _allocations;
+  std::array<std::vector<registered_evictor>, CATEGORY_COUNT> _evictors;
+  evictor_id _next_evictor{0};
+};
+
+} // namespace ntf
@@ -0,0 +1,68 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include "handle_pool.hpp"
+#include "vk_memory_budget.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ntf {
+
+struct buffer_tag {};
+struct image_tag {};
+struct pipeline_tag {};
+struct sampler_tag {};
+
+using buffer_handle = handle<buffer_tag>;
+using image_handle = handle<image_tag>;
+using pipeline_handle = handle<pipeline_tag>;
+using sampler_handle = handle<sampler_tag>;
+
+// Column indices, for pool.get<buffer_col::memory>(h) and friends
+struct buffer_col {
+  static constexpr std::size_t buffer = 0;
+  static constexpr std::size_t memory = 1;
+  static constexpr std::size_t size = 2;
+  static constexpr std::size_t usage = 3;
+  static constexpr std::size_t category = 4;
+  static constexpr std::size_t mapped = 5; // Null unless persistently mapped
+};
+
+struct image_col {
+  static constexpr std::size_t image = 0;
+  static constexpr std::size_t view = 1;
+  static constexpr std::size_t memory = 2;
+  static constexpr std::size_t extent = 3;
+  static constexpr std::size_t format = 4;
+  static constexpr std::size_t mip_count = 5;
+};
+
+struct pipeline_col {
+  static constexpr std::size_t pipeline = 0;
+  static constexpr std::size_t layout = 1; // Not owned, layouts get shared
+  static constexpr std::size_t vertex_pulling = 2; // Non zero if built without vertex input
+};
+
+struct sampler_col {
+  static constexpr std::size_t sampler = 0;
+};
+
+using buffer_pool = handle_pool<buffer_tag, VkBuffer, VkDeviceMemory, VkDeviceSize,
+                                VkBufferUsageFlags, memory_category, std::byte*>;
+using image_pool = handle_pool<image_tag, VkImage, VkImageView, VkDeviceMemory, VkExtent3D,
+                               VkFormat, uint32_t>;
+using pipeline_pool = handle_pool<pipeline_tag, VkPipeline, VkPipelineLayout, uint8_t>;
+using sampler_pool = handle_pool<sampler_tag, VkSampler>;
+
+// Every long lived GPU object the context owns, staging and swapchain objects aside
+struct vk_resources {
+  buffer_pool buffers;
+  image_pool images;
+  pipeline_pool pipelines;
+  sampler_pool samplers;
+};
+
+} // namespace ntf
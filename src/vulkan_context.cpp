@@ -1,8 +1,15 @@
 #include "vulkan_context.hpp"
 
 #include <fmt/format.h>
+#include <glm/gtc/matrix_transform.hpp>
 
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <set>
+#include <span>
 #include <string>
 #include <algorithm>
 
@@ -75,6 +82,15 @@ bool check_layer_support() {
   return true;
 }
 
+bool has_extension(const std::vector<VkExtensionProperties>& avail, const char* name) {
+  for (const auto& ext : avail) {
+    if (std::strcmp(ext.extensionName, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 const auto device_extensions = std::to_array<const char*>({
   VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 });
@@ -95,11 +111,122 @@ bool check_extension_support(VkPhysicalDevice device) {
   return required_extensions.empty();
 }
 
+// Memory the GPU reads at full speed and the CPU can write straight into
+constexpr VkMemoryPropertyFlags DIRECT_WRITE_MEMORY = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+// Without resizable BAR, discrete GPUs only map this much of their VRAM
+constexpr VkDeviceSize BAR_WINDOW_SIZE = 256ull*1024*1024;
+
+// Compiled pipelines from previous runs
+constexpr const char* PIPELINE_CACHE_PATH = "pipeline_cache.bin";
+
+// The cache data starts with the header version one: size, version, vendor ID, device ID
+// and the cache UUID
+constexpr std::size_t PIPELINE_CACHE_HEADER_SIZE = 4*sizeof(uint32_t) + VK_UUID_SIZE;
+
+// Shader module identifiers from previous runs: magic, version, algorithm UUID, count and
+// then each one as its shader hash, size and bytes
+constexpr const char* MODULE_IDENTIFIERS_PATH = "shader_identifiers.bin";
+constexpr uint32_t MODULE_IDENTIFIERS_MAGIC = 0x4953544E; // "NTSI"
+constexpr uint32_t MODULE_IDENTIFIERS_VERSION = 1;
+
+// The only blending pipeline_desc knows about
+constexpr VkColorBlendEquationEXT ALPHA_BLENDING{
+  VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA, VK_BLEND_OP_ADD,
+  VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO, VK_BLEND_OP_ADD,
+};
+
+// Without dynamicPrimitiveTopologyUnrestricted the dynamic topology has to stay in the
+// class of the one the pipeline was built with
+VkPrimitiveTopology topology_class(VkPrimitiveTopology topology) {
+  switch (topology) {
+    case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+      return VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+    case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+      return VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+    case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
+      return VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+    default:
+      return VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  }
+}
+
+// Only what a graphics pipeline library part gets built from, the rest left to defaults
+// Two pipelines with equal descriptions for a part can share it
+ntf::pipeline_desc library_desc(VkGraphicsPipelineLibraryFlagBitsEXT part,
+                                const ntf::pipeline_desc& desc) {
+  ntf::pipeline_desc part_desc{};
+  switch (part) {
+    case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT:
+      part_desc.binding_count = desc.binding_count;
+      part_desc.binding_strides = desc.binding_strides;
+      part_desc.attribute_count = desc.attribute_count;
+      part_desc.attribute_bindings = desc.attribute_bindings;
+      part_desc.attribute_formats = desc.attribute_formats;
+      part_desc.attribute_offsets = desc.attribute_offsets;
+      part_desc.topology = desc.topology;
+      break;
+    case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT:
+      part_desc.vert_shader = desc.vert_shader;
+      part_desc.variant = desc.variant;
+      part_desc.polygon_mode = desc.polygon_mode;
+      part_desc.cull_mode = desc.cull_mode;
+      part_desc.front_face = desc.front_face;
+      break;
+    case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT:
+      part_desc.frag_shader = desc.frag_shader;
+      part_desc.variant = desc.variant;
+      break;
+    default: // VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT
+      part_desc.color_format = desc.color_format;
+      part_desc.blend = desc.blend;
+      break;
+  }
+  return part_desc;
+}
+
+bool is_pipeline_cache_compatible(const std::vector<char>& data,
+                                  const VkPhysicalDeviceProperties& props) {
+  if (data.size() < PIPELINE_CACHE_HEADER_SIZE) {
+    return false;
+  }
+  uint32_t fields[4];
+  std::memcpy(fields, data.data(), sizeof(fields));
+  return fields[0] >= PIPELINE_CACHE_HEADER_SIZE &&
+         fields[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         fields[2] == props.vendorID && fields[3] == props.deviceID &&
+         std::memcmp(data.data() + sizeof(fields), props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+bool has_direct_write_memory(VkPhysicalDevice device, VkPhysicalDeviceType device_type) {
+  VkPhysicalDeviceMemoryProperties mem_props;
+  vkGetPhysicalDeviceMemoryProperties(device, &mem_props);
+
+  // UMA devices (integrated GPUs, lavapipe) only have one kind of memory anyway, discrete ones
+  // need resizable BAR so the mappable heap is the whole VRAM and not the small window
+  const bool uma = device_type == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+                   device_type == VK_PHYSICAL_DEVICE_TYPE_CPU;
+  for (uint32_t i = 0; i < mem_props.memoryTypeCount; ++i) {
+    const auto& type = mem_props.memoryTypes[i];
+    if ((type.propertyFlags & DIRECT_WRITE_MEMORY) != DIRECT_WRITE_MEMORY) {
+      continue;
+    }
+    if (uma || mem_props.memoryHeaps[type.heapIndex].size > BAR_WINDOW_SIZE) {
+      return true;
+    }
+  }
+  return false;
+}
+
 } // namespace
 
 namespace ntf {
 
-VkVertexInputBindingDescription vertex::bind_description() {
+std::vector<VkVertexInputBindingDescription> vertex::bind_descriptions(vertex_layout layout) {
   // Describes at which rate to load data from memory
   // through the vertices. Specifies the number of bytes between
   // data entries, and whether to move to the next data entry after
@@ -110,10 +237,20 @@ VkVertexInputBindingDescription vertex::bind_description() {
   desc.stride = sizeof(ntf::vertex);
   desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-  return desc;
+  if (layout == vertex_layout::interleaved) {
+    return {desc};
+  }
+
+  // One binding per stream, each one packed
+  VkVertexInputBindingDescription color_desc = desc;
+  desc.stride = sizeof(ntf::vertex::pos);
+  color_desc.binding = 1;
+  color_desc.stride = sizeof(ntf::vertex::color);
+  return {desc, color_desc};
 }
 
-std::array<VkVertexInputAttributeDescription, 2> vertex::attribute_descriptions() {
+std::array<VkVertexInputAttributeDescription, 2> vertex::attribute_descriptions(
+  vertex_layout layout) {
   // Specifies the format for each attribute
   std::array<VkVertexInputAttributeDescription, 2> attr;
 
@@ -135,6 +272,13 @@ std::array<VkVertexInputAttributeDescription, 2> vertex::attribute_descriptions(
   attr[1].format = VK_FORMAT_R32G32B32_SFLOAT;
   attr[1].offset = offsetof(ntf::vertex, color);
 
+  // Each attribute starts its own stream
+  if (layout == vertex_layout::split) {
+    attr[0].offset = 0;
+    attr[1].binding = 1;
+    attr[1].offset = 0;
+  }
+
   return attr;
 }
 
@@ -233,9 +377,26 @@ void vk_context::create_instance(bool enable_layers, const std::vector<const cha
     throw std::runtime_error{"Failed to find the required vulkan extensions"};
   }
 
-  // Pass the windowing system extensions
-  create_info.enabledExtensionCount = static_cast<uint32_t>(req_ext.size());
-  create_info.ppEnabledExtensionNames = req_ext.data();
+  // Pass the windowing system extensions, plus the optional ones we can use
+  std::vector<const char*> enabled_ext = req_ext;
+  _has_properties2 = has_extension(exts, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+  if (_has_properties2) {
+    enabled_ext.emplace_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+  }
+  // Instance side of the external memory extensions, for importing host memory
+  _has_external_memory = _has_properties2 &&
+    has_extension(exts, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+  if (_has_external_memory) {
+    enabled_ext.emplace_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+  }
+  // Instance side of the device group extensions, buffer device addresses need them
+  _has_device_group = has_extension(exts, VK_KHR_DEVICE_GROUP_CREATION_EXTENSION_NAME);
+  if (_has_device_group) {
+    enabled_ext.emplace_back(VK_KHR_DEVICE_GROUP_CREATION_EXTENSION_NAME);
+  }
+
+  create_info.enabledExtensionCount = static_cast<uint32_t>(enabled_ext.size());
+  create_info.ppEnabledExtensionNames = enabled_ext.data();
 
   // Setup the debug messenger
   VkDebugUtilsMessengerCreateInfoEXT messenger_info{};
@@ -264,8 +425,9 @@ void vk_context::create_instance(bool enable_layers, const std::vector<const cha
     create_info.pNext = nullptr;
   }
 
-  // Second param is a custom allocator callback, null for now
-  if (vkCreateInstance(&create_info, nullptr, &_instance) != VK_SUCCESS) {
+  // Second param is the allocator callbacks, the driver host allocations get tracked
+  // through _host_allocator
+  if (vkCreateInstance(&create_info, _allocator, &_instance) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create vulkan instance"};
   }
   fmt::print("Vulkan instance initialized\n");
@@ -275,7 +437,7 @@ void vk_context::create_instance(bool enable_layers, const std::vector<const cha
   }
 
   // Create the debug messenger
-  if (CreateDebugUtilsMessengerEXT(_instance, &messenger_info, nullptr, &_messenger) 
+  if (CreateDebugUtilsMessengerEXT(_instance, &messenger_info, _allocator, &_messenger) 
       != VK_SUCCESS) {
     throw std::runtime_error{"Failed to setup debug menssenger"};
   }
@@ -385,20 +547,197 @@ void vk_context::pick_physical_device() {
     throw std::runtime_error{"Failed to find a suitable GPU"};
   }
 
+  // Neither of these change for the lifetime of the device, so query them once
+  // (only the surface capabilities change, on resizes)
+  _queue_families = _find_queue_families(_physical_device);
+  _swapchain_support = _query_swapchain_support(_physical_device);
+
+  // Optional device extensions, used when available
+  uint32_t ext_count{0};
+  vkEnumerateDeviceExtensionProperties(_physical_device, nullptr, &ext_count, nullptr);
+  std::vector<VkExtensionProperties> avail_ext(ext_count);
+  vkEnumerateDeviceExtensionProperties(_physical_device, nullptr, &ext_count, avail_ext.data());
+
+  _device_extensions.assign(device_extensions.begin(), device_extensions.end());
+
+  // The budget is queried with vkGetPhysicalDeviceMemoryProperties2, which needs properties2
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_memory_props2{nullptr};
+  if (_has_properties2 && has_extension(avail_ext, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+    _device_extensions.emplace_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    get_memory_props2 = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(
+      vkGetInstanceProcAddr(_instance, "vkGetPhysicalDeviceMemoryProperties2KHR")
+    );
+  }
+  _budget.init(_physical_device, get_memory_props2);
+
+  // Host memory import, lets the transfer queue copy straight out of mmapped files
+  _host_import_alignment = 0;
+  if (_has_external_memory && has_extension(avail_ext, VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME) &&
+      has_extension(avail_ext, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+    auto get_props2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+      vkGetInstanceProcAddr(_instance, "vkGetPhysicalDeviceProperties2KHR")
+    );
+
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props{};
+    host_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+
+    VkPhysicalDeviceProperties2 props2{};
+    props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props2.pNext = &host_props;
+
+    if (get_props2) {
+      get_props2(_physical_device, &props2);
+      _host_import_alignment = host_props.minImportedHostPointerAlignment;
+      _device_extensions.emplace_back(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+      _device_extensions.emplace_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    }
+  }
+
+  // Features of the optional extensions, all queried in one go
+  // Graphics pipeline libraries: new pipeline variants only cost a link of parts built before
+  // Extended dynamic state: less state baked into pipelines, so fewer pipelines
+  VkPhysicalDeviceFeatures2 features2{};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  auto chain_if = [&](bool available, auto& features, VkStructureType type) {
+    features.sType = type;
+    if (available) {
+      features.pNext = features2.pNext;
+      features2.pNext = &features;
+    }
+  };
+
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT gpl_features{};
+  chain_if(has_extension(avail_ext, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+           has_extension(avail_ext, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME),
+           gpl_features, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT);
+
+  VkPhysicalDeviceExtendedDynamicStateFeaturesEXT eds_features{};
+  chain_if(has_extension(avail_ext, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME),
+           eds_features, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT);
+
+  VkPhysicalDeviceExtendedDynamicState3FeaturesEXT eds3_features{};
+  chain_if(has_extension(avail_ext, VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME),
+           eds3_features, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT);
+
+  // Buffer device addresses: shaders can pull vertices without vertex input state
+  // The allocation flags for them come from the device group extension
+  VkPhysicalDeviceBufferDeviceAddressFeatures address_features{};
+  chain_if(_has_device_group && has_extension(avail_ext, VK_KHR_DEVICE_GROUP_EXTENSION_NAME) &&
+           has_extension(avail_ext, VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME),
+           address_features, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES);
+
+  // Module identifiers need the cache control flags, both or none
+  const bool has_identifier_ext =
+    has_extension(avail_ext, VK_EXT_SHADER_MODULE_IDENTIFIER_EXTENSION_NAME) &&
+    has_extension(avail_ext, VK_EXT_PIPELINE_CREATION_CACHE_CONTROL_EXTENSION_NAME);
+  VkPhysicalDevicePipelineCreationCacheControlFeaturesEXT cache_control_features{};
+  chain_if(has_identifier_ext, cache_control_features,
+           VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_CREATION_CACHE_CONTROL_FEATURES_EXT);
+
+  VkPhysicalDeviceShaderModuleIdentifierFeaturesEXT identifier_features{};
+  chain_if(has_identifier_ext, identifier_features,
+           VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_FEATURES_EXT);
+
+  auto get_features2 = _has_properties2 ? reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(
+    vkGetInstanceProcAddr(_instance, "vkGetPhysicalDeviceFeatures2KHR")
+  ) : nullptr;
+  if (get_features2 && features2.pNext) {
+    get_features2(_physical_device, &features2);
+  }
+
+  // Without fast linking a link can cost as much as building the whole pipeline, libraries
+  // wouldn't save anything
+  VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT gpl_props{};
+  gpl_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT;
+  if (gpl_features.graphicsPipelineLibrary) {
+    auto get_props2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+      vkGetInstanceProcAddr(_instance, "vkGetPhysicalDeviceProperties2KHR")
+    );
+
+    VkPhysicalDeviceProperties2 props2{};
+    props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props2.pNext = &gpl_props;
+    if (get_props2) {
+      get_props2(_physical_device, &props2);
+    }
+  }
+
+  _has_pipeline_library = gpl_features.graphicsPipelineLibrary &&
+                          gpl_props.graphicsPipelineLibraryFastLinking;
+  if (_has_pipeline_library) {
+    _device_extensions.emplace_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+    _device_extensions.emplace_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+  }
+
+  _dynamic_state = {};
+  _dynamic_state.raster = eds_features.extendedDynamicState;
+  _dynamic_state.polygon_mode = eds3_features.extendedDynamicState3PolygonMode;
+  _dynamic_state.blend = eds3_features.extendedDynamicState3ColorBlendEnable &&
+                         eds3_features.extendedDynamicState3ColorBlendEquation;
+  if (_dynamic_state.raster) {
+    _device_extensions.emplace_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+  }
+  if (_dynamic_state.polygon_mode || _dynamic_state.blend) {
+    _device_extensions.emplace_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+  }
+
+  _has_device_address = address_features.bufferDeviceAddress;
+  if (_has_device_address) {
+    _device_extensions.emplace_back(VK_KHR_DEVICE_GROUP_EXTENSION_NAME);
+    _device_extensions.emplace_back(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+  }
+
+  // Identifiers are only comparable between devices using the same algorithm
+  _has_module_identifier = identifier_features.shaderModuleIdentifier &&
+                           cache_control_features.pipelineCreationCacheControl;
+  if (_has_module_identifier) {
+    auto get_props2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+      vkGetInstanceProcAddr(_instance, "vkGetPhysicalDeviceProperties2KHR")
+    );
+
+    VkPhysicalDeviceShaderModuleIdentifierPropertiesEXT identifier_props{};
+    identifier_props.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_PROPERTIES_EXT;
+
+    VkPhysicalDeviceProperties2 props2{};
+    props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props2.pNext = &identifier_props;
+
+    _has_module_identifier = get_props2 != nullptr;
+    if (get_props2) {
+      get_props2(_physical_device, &props2);
+      std::memcpy(_identifier_algorithm.data(),
+                  identifier_props.shaderModuleIdentifierAlgorithmUUID, VK_UUID_SIZE);
+      _device_extensions.emplace_back(VK_EXT_PIPELINE_CREATION_CACHE_CONTROL_EXTENSION_NAME);
+      _device_extensions.emplace_back(VK_EXT_SHADER_MODULE_IDENTIFIER_EXTENSION_NAME);
+    }
+  }
+
   VkPhysicalDeviceProperties props;
   vkGetPhysicalDeviceProperties(_physical_device, &props);
 
+  _direct_write = has_direct_write_memory(_physical_device, props.deviceType);
+
   fmt::print("Vulkan device information:\n");
   fmt::print(" - Name: {}\n", props.deviceName);
   fmt::print(" - Device ID: {}\n", props.deviceID);
   fmt::print(" - Vendor ID: {}\n", props.vendorID);
   fmt::print(" - API version: {}\n", props.apiVersion);
   fmt::print(" - Driver version: {}\n", props.driverVersion);
+  fmt::print(" - Direct write to device memory: {}\n", _direct_write ? "yes" : "no");
+  fmt::print(" - Host memory import: {}\n", _host_import_alignment ? "yes" : "no");
+  fmt::print(" - Graphics pipeline libraries: {}\n", _has_pipeline_library ? "yes" : "no");
+  fmt::print(" - Dynamic cull mode, front face and topology: {}\n",
+             _dynamic_state.raster ? "yes" : "no");
+  fmt::print(" - Dynamic polygon mode: {}\n", _dynamic_state.polygon_mode ? "yes" : "no");
+  fmt::print(" - Dynamic blending: {}\n", _dynamic_state.blend ? "yes" : "no");
+  fmt::print(" - Shader module identifiers: {}\n", _has_module_identifier ? "yes" : "no");
+  fmt::print(" - Vertex pulling: {}\n", _has_device_address ? "yes" : "no");
 }
 
 void vk_context::create_logical_device() {
   // Create a device to interface with the physical device
-  auto indices = _find_queue_families(_physical_device);
+  const auto& indices = _queue_families;
 
   std::vector<VkDeviceQueueCreateInfo> queue_infos;
   std::set<uint32_t> unique_queue_families = { 
@@ -428,9 +767,61 @@ void vk_context::create_logical_device() {
   create_info.queueCreateInfoCount = static_cast<uint32_t>(queue_infos.size());
   create_info.pEnabledFeatures = &features;
 
+  // Features of the optional extensions, chained to the create info
+  void* feature_chain{nullptr};
+
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT gpl_features{};
+  if (_has_pipeline_library) {
+    gpl_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+    gpl_features.pNext = feature_chain;
+    gpl_features.graphicsPipelineLibrary = VK_TRUE;
+    feature_chain = &gpl_features;
+  }
+
+  VkPhysicalDeviceExtendedDynamicStateFeaturesEXT eds_features{};
+  if (_dynamic_state.raster) {
+    eds_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+    eds_features.pNext = feature_chain;
+    eds_features.extendedDynamicState = VK_TRUE;
+    feature_chain = &eds_features;
+  }
+
+  VkPhysicalDeviceExtendedDynamicState3FeaturesEXT eds3_features{};
+  if (_dynamic_state.polygon_mode || _dynamic_state.blend) {
+    eds3_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+    eds3_features.pNext = feature_chain;
+    eds3_features.extendedDynamicState3PolygonMode = _dynamic_state.polygon_mode;
+    eds3_features.extendedDynamicState3ColorBlendEnable = _dynamic_state.blend;
+    eds3_features.extendedDynamicState3ColorBlendEquation = _dynamic_state.blend;
+    feature_chain = &eds3_features;
+  }
+
+  VkPhysicalDeviceBufferDeviceAddressFeatures address_features{};
+  if (_has_device_address) {
+    address_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    address_features.pNext = feature_chain;
+    address_features.bufferDeviceAddress = VK_TRUE;
+    feature_chain = &address_features;
+  }
+
+  VkPhysicalDevicePipelineCreationCacheControlFeaturesEXT cache_control_features{};
+  VkPhysicalDeviceShaderModuleIdentifierFeaturesEXT identifier_features{};
+  if (_has_module_identifier) {
+    cache_control_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_CREATION_CACHE_CONTROL_FEATURES_EXT;
+    cache_control_features.pNext = feature_chain;
+    cache_control_features.pipelineCreationCacheControl = VK_TRUE;
+    identifier_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_MODULE_IDENTIFIER_FEATURES_EXT;
+    identifier_features.pNext = &cache_control_features;
+    identifier_features.shaderModuleIdentifier = VK_TRUE;
+    feature_chain = &identifier_features;
+  }
+  create_info.pNext = feature_chain;
+
   // Specify extensions and validation layers (device specific this time)
-  create_info.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
-  create_info.ppEnabledExtensionNames = device_extensions.data();
+  create_info.enabledExtensionCount = static_cast<uint32_t>(_device_extensions.size());
+  create_info.ppEnabledExtensionNames = _device_extensions.data();
 
   if (_enable_layers) {
     create_info.enabledLayerCount = static_cast<uint32_t>(validation_layers.size());
@@ -439,7 +830,7 @@ void vk_context::create_logical_device() {
     create_info.enabledLayerCount = 0;
   }
 
-  if (vkCreateDevice(_physical_device, &create_info, nullptr, &_device) != VK_SUCCESS) {
+  if (vkCreateDevice(_physical_device, &create_info, _allocator, &_device) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create logical device"};
   }
 
@@ -448,13 +839,170 @@ void vk_context::create_logical_device() {
   vkGetDeviceQueue(_device, indices.graphics_family.value(), 0, &_graphics_queue); 
   vkGetDeviceQueue(_device, indices.present_family.value(), 0, &_present_queue);
   vkGetDeviceQueue(_device, indices.transfer_family.value(), 0, &_transfer_queue);
+
+  if (_host_import_alignment) {
+    _get_host_pointer_props = reinterpret_cast<PFN_vkGetMemoryHostPointerPropertiesEXT>(
+      vkGetDeviceProcAddr(_device, "vkGetMemoryHostPointerPropertiesEXT")
+    );
+    if (!_get_host_pointer_props) {
+      _host_import_alignment = 0;
+    }
+  }
+
+  if (_has_device_address) {
+    _get_buffer_address = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(
+      vkGetDeviceProcAddr(_device, "vkGetBufferDeviceAddressKHR")
+    );
+    _has_device_address = _get_buffer_address != nullptr;
+  }
+
+  if (_has_module_identifier) {
+    _get_module_identifier = reinterpret_cast<PFN_vkGetShaderModuleIdentifierEXT>(
+      vkGetDeviceProcAddr(_device, "vkGetShaderModuleIdentifierEXT")
+    );
+    _has_module_identifier = _get_module_identifier != nullptr;
+  }
+
+  _load_dynamic_state_commands();
+  _create_pipeline_cache();
+  _load_module_identifiers();
+}
+
+void vk_context::_load_dynamic_state_commands() {
+  auto load = [this]<typename PFN>(PFN& fn, const char* name) {
+    fn = reinterpret_cast<PFN>(vkGetDeviceProcAddr(_device, name));
+    return fn != nullptr;
+  };
+
+  // Anything missing goes back to being baked into the pipelines
+  auto& cmd = _dynamic_state_cmds;
+  _dynamic_state.raster = _dynamic_state.raster &&
+    load(cmd.set_cull_mode, "vkCmdSetCullModeEXT") &&
+    load(cmd.set_front_face, "vkCmdSetFrontFaceEXT") &&
+    load(cmd.set_primitive_topology, "vkCmdSetPrimitiveTopologyEXT");
+  _dynamic_state.polygon_mode = _dynamic_state.polygon_mode &&
+    load(cmd.set_polygon_mode, "vkCmdSetPolygonModeEXT");
+  _dynamic_state.blend = _dynamic_state.blend &&
+    load(cmd.set_color_blend_enable, "vkCmdSetColorBlendEnableEXT") &&
+    load(cmd.set_color_blend_equation, "vkCmdSetColorBlendEquationEXT");
+}
+
+void vk_context::_create_pipeline_cache() {
+  std::vector<char> data;
+  if (std::ifstream file{PIPELINE_CACHE_PATH, std::ios::binary}) {
+    data.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  }
+
+  // Drivers are supposed to reject data from other devices, not all of them do
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(_physical_device, &props);
+
+  if (!is_pipeline_cache_compatible(data, props)) {
+    data.clear();
+  }
+
+  VkPipelineCacheCreateInfo cache_info{};
+  cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cache_info.initialDataSize = data.size();
+  cache_info.pInitialData = data.data();
+
+  if (vkCreatePipelineCache(_device, &cache_info, _allocator, &_pipeline_cache) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create pipeline cache"};
+  }
+}
+
+void vk_context::_save_pipeline_cache() {
+  std::size_t size{0};
+  if (vkGetPipelineCacheData(_device, _pipeline_cache, &size, nullptr) != VK_SUCCESS) {
+    return;
+  }
+  std::vector<char> data(size);
+  if (vkGetPipelineCacheData(_device, _pipeline_cache, &size, data.data()) != VK_SUCCESS) {
+    return;
+  }
+
+  if (!replace_file(PIPELINE_CACHE_PATH, std::span{data.data(), size})) {
+    fmt::print(stderr, "Failed to write the pipeline cache\n");
+  }
+}
+
+void vk_context::_load_module_identifiers() {
+  if (!_has_module_identifier) {
+    return;
+  }
+
+  std::vector<char> data;
+  if (std::ifstream file{MODULE_IDENTIFIERS_PATH, std::ios::binary}) {
+    data.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  }
+
+  std::span<const char> in{data};
+  auto get = [&in](void* value, std::size_t size) {
+    if (in.size() < size) {
+      return false;
+    }
+    std::memcpy(value, in.data(), size);
+    in = in.subspan(size);
+    return true;
+  };
+
+  // Identifiers from another algorithm would never match, don't even try them
+  uint32_t magic{0}, version{0}, count{0};
+  std::array<uint8_t, VK_UUID_SIZE> algorithm{};
+  if (!get(&magic, sizeof(magic)) || !get(&version, sizeof(version)) ||
+      !get(algorithm.data(), algorithm.size()) || !get(&count, sizeof(count)) ||
+      magic != MODULE_IDENTIFIERS_MAGIC || version != MODULE_IDENTIFIERS_VERSION ||
+      algorithm != _identifier_algorithm) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t hash{0};
+    module_identifier id{};
+    if (!get(&hash, sizeof(hash)) || !get(&id.size, sizeof(id.size)) ||
+        id.size > id.data.size() || !get(id.data.data(), id.size)) {
+      fmt::print(stderr, "Truncated shader identifiers {}\n", MODULE_IDENTIFIERS_PATH);
+      break;
+    }
+    _module_identifiers.insert_or_assign(hash, id);
+  }
+}
+
+void vk_context::_save_module_identifiers() {
+  if (!_has_module_identifier || _module_identifiers.empty()) {
+    return;
+  }
+
+  std::vector<char> out;
+  auto put = [&out](const void* value, std::size_t size) {
+    const auto* bytes = static_cast<const char*>(value);
+    out.insert(out.end(), bytes, bytes + size);
+  };
+
+  const auto count = static_cast<uint32_t>(_module_identifiers.size());
+  put(&MODULE_IDENTIFIERS_MAGIC, sizeof(MODULE_IDENTIFIERS_MAGIC));
+  put(&MODULE_IDENTIFIERS_VERSION, sizeof(MODULE_IDENTIFIERS_VERSION));
+  put(_identifier_algorithm.data(), _identifier_algorithm.size());
+  put(&count, sizeof(count));
+  for (const auto& [hash, id] : _module_identifiers) {
+    put(&hash, sizeof(hash));
+    put(&id.size, sizeof(id.size));
+    put(id.data.data(), id.size);
+  }
+
+  if (!replace_file(MODULE_IDENTIFIERS_PATH, out)) {
+    fmt::print(stderr, "Failed to write the shader identifiers\n");
+  }
 }
 
 void vk_context::create_swapchain(std::function<void(std::size_t&, std::size_t&)> size_callback) {
   if (size_callback) {
     _framebuffer_size_callback = size_callback;
   }
-  auto swapchain_support = _query_swapchain_support(_physical_device);
+  // Formats and present modes are cached, but the current extent changes with the window
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_physical_device, _surface,
+                                            &_swapchain_support.capabilities);
+  const auto& swapchain_support = _swapchain_support;
 
   std::size_t fb_width{0}, fb_height{0};
   _framebuffer_size_callback(fb_width, fb_height);
@@ -535,7 +1083,7 @@ void vk_context::create_swapchain(std::function<void(std::size_t&, std::size_t&)
   create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
   // create_info.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT; // For postprocessing
 
-  auto indices = _find_queue_families(_physical_device);
+  const auto& indices = _queue_families;
   uint32_t queue_indices[] = {
     indices.graphics_family.value(), indices.present_family.value()
   };
@@ -562,7 +1110,7 @@ void vk_context::create_swapchain(std::function<void(std::size_t&, std::size_t&)
   // Used when the swap chain has to be reconstructed
   create_info.oldSwapchain = VK_NULL_HANDLE;
 
-  if (vkCreateSwapchainKHR(_device, &create_info, nullptr, &_swapchain) != VK_SUCCESS) {
+  if (vkCreateSwapchainKHR(_device, &create_info, _allocator, &_swapchain) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create swap chain"};
   }
 
@@ -600,7 +1148,7 @@ void vk_context::create_imageviews() {
       .layerCount = 1,
     };
 
-    if (vkCreateImageView(_device, &create_info, nullptr, &_swapchain_image_views[i]) 
+    if (vkCreateImageView(_device, &create_info, _allocator, &_swapchain_image_views[i]) 
         != VK_SUCCESS) {
       throw std::runtime_error{"Failed to create image views"};
     }
@@ -608,6 +1156,10 @@ void vk_context::create_imageviews() {
 }
 
 void vk_context::create_renderpass() {
+  _render_pass = _create_color_pass(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+}
+
+VkRenderPass vk_context::_create_color_pass(VkImageLayout final_layout) {
   // Specify all the framebuffer attachments that will be used while rendering
 
   // A single color buffer attachment, represented by one of the images from the swap chain
@@ -625,7 +1177,7 @@ void vk_context::create_renderpass() {
 
   // Layout for the framebuffer image (?) before and after the render pass
   color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  color_attachment.finalLayout = final_layout;
 
 
   // Things for subpasses, each one references one or more of the previous attachments
@@ -659,42 +1211,163 @@ void vk_context::create_renderpass() {
   render_pass.dependencyCount = 1;
   render_pass.pDependencies = &dep;
 
-  if (vkCreateRenderPass(_device, &render_pass, nullptr, &_render_pass) != VK_SUCCESS) {
+  VkRenderPass pass;
+  if (vkCreateRenderPass(_device, &render_pass, _allocator, &pass) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create render pass"};
   }
+  return pass;
 }
 
 void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string_view frag_src) {
-  // Load shader modules from bytecode
-  auto create_shader_module = [this](std::string_view src) -> VkShaderModule {
-    VkShaderModuleCreateInfo create_info{};
-    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = src.size();
-    create_info.pCode = reinterpret_cast<const uint32_t*>(src.data());
-
-    VkShaderModule shader;
-    if (vkCreateShaderModule(_device, &create_info, nullptr, &shader) != VK_SUCCESS) {
-      throw std::runtime_error{"Failed to create shader module"};
+  if (!_pipeline_layout) {
+    _create_pipeline_layout();
+  }
+
+  const auto desc = default_pipeline_desc(shader_hash(vert_src), shader_hash(frag_src));
+  _graphics_pipeline = adopt_pipeline(build_pipeline(desc, current_target(), vert_src, frag_src),
+                                      desc);
+  _draw_pipeline = _graphics_pipeline;
+  _draw_state = desc;
+}
+
+pipeline_desc vk_context::default_pipeline_desc(uint64_t vert_shader, uint64_t frag_shader,
+                                                vertex_layout layout) const {
+  pipeline_desc desc = pulling_pipeline_desc(vert_shader, frag_shader);
+
+  const auto bind_desc = vertex::bind_descriptions(layout);
+  const auto attr_desc = vertex::attribute_descriptions(layout);
+  desc.binding_count = static_cast<uint32_t>(bind_desc.size());
+  for (std::size_t i = 0; i < bind_desc.size(); ++i) {
+    desc.binding_strides[i] = bind_desc[i].stride;
+  }
+  desc.attribute_count = static_cast<uint32_t>(attr_desc.size());
+  for (std::size_t i = 0; i < attr_desc.size(); ++i) {
+    desc.attribute_bindings[i] = attr_desc[i].binding;
+    desc.attribute_formats[i] = attr_desc[i].format;
+    desc.attribute_offsets[i] = attr_desc[i].offset;
+  }
+  return desc;
+}
+
+pipeline_desc vk_context::pulling_pipeline_desc(uint64_t vert_shader, uint64_t frag_shader) const {
+  pipeline_desc desc{};
+  desc.vert_shader = vert_shader;
+  desc.frag_shader = frag_shader;
+  desc.color_format = _swapchain_format;
+  return desc;
+}
+
+pipeline_desc vk_context::canonical_pipeline_desc(const pipeline_desc& desc) const {
+  // Dynamic state gets set when drawing, so it doesn't make pipelines any different
+  pipeline_desc canonical = desc;
+  const pipeline_desc defaults{};
+  if (_dynamic_state.raster) {
+    canonical.cull_mode = defaults.cull_mode;
+    canonical.front_face = defaults.front_face;
+    canonical.topology = topology_class(desc.topology); // Only switchable within a class
+  }
+  if (_dynamic_state.polygon_mode) {
+    canonical.polygon_mode = defaults.polygon_mode;
+  }
+  if (_dynamic_state.blend) {
+    canonical.blend = defaults.blend;
+  }
+  return canonical;
+}
+
+pipeline_handle vk_context::adopt_pipeline(VkPipeline pipeline, const pipeline_desc& desc) {
+  return _resources.pipelines.allocate(pipeline, _pipeline_layout,
+                                       desc.attribute_count == 0 ? 1 : 0);
+}
+
+void vk_context::replace_pipeline(pipeline_handle handle, VkPipeline pipeline) {
+  // Every frame submitted up to now can still be drawing with the old one
+  auto& current = _resources.pipelines.get<pipeline_col::pipeline>(handle);
+  _retired_pipelines.push_back({std::exchange(current, pipeline),
+                                _submitted_frames + MAX_FRAMES_IN_FLIGHT - 1});
+}
+
+void vk_context::destroy_pipeline(VkPipeline pipeline) {
+  vkDestroyPipeline(_device, pipeline, _allocator);
+}
+
+void vk_context::_destroy_retired_pipelines() {
+  // Called after waiting for the current frame's fence, every frame submitted before the
+  // last MAX_FRAMES_IN_FLIGHT - 1 is done
+  std::erase_if(_retired_pipelines, [this](const retired_pipeline& retired) {
+    if (_submitted_frames < retired.last_frame) {
+      return false;
     }
+    vkDestroyPipeline(_device, retired.pipeline, _allocator);
+    return true;
+  });
+}
 
-    return shader;
-  };
+void vk_context::_create_pipeline_layout() {
+  // Small per draw values (the transform) go through push constants
+  VkPushConstantRange push_constant{};
+  push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant.offset = 0;
+  push_constant.size = sizeof(draw_push_constants);
+
+  // Layout for shader uniforms, shared by every pipeline
+  VkPipelineLayoutCreateInfo pipeline_layout{};
+  pipeline_layout.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  // pipeline_layout.setLayoutCount = 0;
+  // pipeline_layout.pSetLayouts = nullptr;
+  pipeline_layout.pushConstantRangeCount = 1;
+  pipeline_layout.pPushConstantRanges = &push_constant;
 
-  auto vert_module = create_shader_module(vert_src);
-  auto frag_module = create_shader_module(frag_src);
+  if (vkCreatePipelineLayout(_device, &pipeline_layout, _allocator,
+                             &_pipeline_layout) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create pipeline layout"};
+  }
+}
 
+VkPipeline vk_context::build_pipeline(const pipeline_desc& desc, const pipeline_target& target,
+                                      std::string_view vert_src, std::string_view frag_src,
+                                      pipeline_link link) {
+  // Pipelines are only compatible with render passes using the same formats
+  if (desc.color_format != target.color_format) {
+    throw std::runtime_error{"Pipeline target format doesn't match the render pass"};
+  }
+
+  // The modules only get looked up (or created) once the identifiers turn out not to be
+  // enough. Libraries always get built from modules
+  std::optional<module_identifier> vert_id, frag_id;
+  if (!_has_pipeline_library) {
+    vert_id = _find_module_identifier(desc.vert_shader);
+    frag_id = _find_module_identifier(desc.frag_shader);
+  }
+
+  // One bool constant per shader feature, constant_id is the feature. Both stages get all
+  // of them, the ones a stage doesn't declare are ignored
+  std::array<VkBool32, SHADER_FEATURE_COUNT> spec_values{};
+  std::array<VkSpecializationMapEntry, SHADER_FEATURE_COUNT> spec_entries{};
+  for (uint32_t i = 0; i < SHADER_FEATURE_COUNT; ++i) {
+    spec_values[i] = desc.variant.has(static_cast<shader_feature>(i)) ? VK_TRUE : VK_FALSE;
+    spec_entries[i].constantID = i;
+    spec_entries[i].offset = i*sizeof(VkBool32);
+    spec_entries[i].size = sizeof(VkBool32);
+  }
+
+  VkSpecializationInfo spec_info{};
+  spec_info.mapEntryCount = static_cast<uint32_t>(spec_entries.size());
+  spec_info.pMapEntries = spec_entries.data();
+  spec_info.dataSize = sizeof(spec_values);
+  spec_info.pData = spec_values.data();
 
   VkPipelineShaderStageCreateInfo vert_stage_info{};
   vert_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   vert_stage_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vert_stage_info.module = vert_module;
   vert_stage_info.pName = "main";
+  vert_stage_info.pSpecializationInfo = &spec_info;
 
   VkPipelineShaderStageCreateInfo frag_stage_info{};
   frag_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   frag_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  frag_stage_info.module = frag_module;
   frag_stage_info.pName = "main";
+  frag_stage_info.pSpecializationInfo = &spec_info;
 
   VkPipelineShaderStageCreateInfo shader_stages[] = {vert_stage_info, frag_stage_info};
 
@@ -704,6 +1377,22 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
     VK_DYNAMIC_STATE_VIEWPORT,
     VK_DYNAMIC_STATE_SCISSOR,
   };
+  if (_dynamic_state.raster) {
+    dynamic_states.insert(dynamic_states.end(), {
+      VK_DYNAMIC_STATE_CULL_MODE_EXT,
+      VK_DYNAMIC_STATE_FRONT_FACE_EXT,
+      VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT,
+    });
+  }
+  if (_dynamic_state.polygon_mode) {
+    dynamic_states.emplace_back(VK_DYNAMIC_STATE_POLYGON_MODE_EXT);
+  }
+  if (_dynamic_state.blend) {
+    dynamic_states.insert(dynamic_states.end(), {
+      VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT,
+      VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT,
+    });
+  }
   VkPipelineDynamicStateCreateInfo dynamic_state{};
   dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
   dynamic_state.dynamicStateCount = static_cast<uint32_t>(dynamic_states.size());
@@ -714,18 +1403,30 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
   VkPipelineVertexInputStateCreateInfo vertex_input{};
   vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-  auto bind_desc = vertex::bind_description();
-  auto attr_desc = vertex::attribute_descriptions();
+  std::array<VkVertexInputBindingDescription, pipeline_desc::MAX_BINDINGS> bind_desc{};
+  for (uint32_t i = 0; i < desc.binding_count; ++i) {
+    bind_desc[i].binding = i;
+    bind_desc[i].stride = desc.binding_strides[i];
+    bind_desc[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+  }
+
+  std::array<VkVertexInputAttributeDescription, pipeline_desc::MAX_ATTRIBUTES> attr_desc{};
+  for (uint32_t i = 0; i < desc.attribute_count; ++i) {
+    attr_desc[i].binding = desc.attribute_bindings[i];
+    attr_desc[i].location = i;
+    attr_desc[i].format = desc.attribute_formats[i];
+    attr_desc[i].offset = desc.attribute_offsets[i];
+  }
 
-  vertex_input.vertexBindingDescriptionCount = 1;
-  vertex_input.pVertexBindingDescriptions = &bind_desc;
-  vertex_input.vertexAttributeDescriptionCount = static_cast<uint32_t>(attr_desc.size());
+  vertex_input.vertexBindingDescriptionCount = desc.binding_count;
+  vertex_input.pVertexBindingDescriptions = bind_desc.data();
+  vertex_input.vertexAttributeDescriptionCount = desc.attribute_count;
   vertex_input.pVertexAttributeDescriptions = attr_desc.data();
 
   // Describe the primitive that will be used for drawing
   VkPipelineInputAssemblyStateCreateInfo input_assembly{};
   input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  input_assembly.topology = desc.topology;
   input_assembly.primitiveRestartEnable = VK_FALSE; // Breakup _STRIP primitives for reuse
 
   // // Equivalent to glViewport
@@ -758,10 +1459,10 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
   rasterizer.depthClampEnable = VK_FALSE;
 
   rasterizer.rasterizerDiscardEnable = VK_FALSE; // VK_TRUE disables any output to the fb
-  rasterizer.polygonMode = VK_POLYGON_MODE_FILL; // How fragments are generated for geometry
+  rasterizer.polygonMode = desc.polygon_mode; // How fragments are generated for geometry
   rasterizer.lineWidth = 1.f; // Thickness of lines (number of fragments)
-  rasterizer.cullMode = VK_CULL_MODE_BACK_BIT; // Type of culling to be used
-  rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE; // Vertex order for faces
+  rasterizer.cullMode = desc.cull_mode; // Type of culling to be used
+  rasterizer.frontFace = desc.front_face; // Vertex order for faces
 
   // Which cosntants to use for altering depth values
   rasterizer.depthBiasEnable = VK_FALSE;
@@ -789,7 +1490,7 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
     VK_COLOR_COMPONENT_G_BIT |
     VK_COLOR_COMPONENT_B_BIT |
     VK_COLOR_COMPONENT_A_BIT;
-  color_blend_attachment.blendEnable = VK_FALSE;
+  color_blend_attachment.blendEnable = desc.blend ? VK_TRUE : VK_FALSE;
   // color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
   // color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
   // color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
@@ -798,13 +1499,14 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
   // color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
   
   // For alpha blending:
-  // color_blend_attachment.blendEnable = VK_TRUE;
-  // color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-  // color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-  // color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
-  // color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-  // color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-  // color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+  if (desc.blend) {
+    color_blend_attachment.srcColorBlendFactor = ALPHA_BLENDING.srcColorBlendFactor;
+    color_blend_attachment.dstColorBlendFactor = ALPHA_BLENDING.dstColorBlendFactor;
+    color_blend_attachment.colorBlendOp = ALPHA_BLENDING.colorBlendOp;
+    color_blend_attachment.srcAlphaBlendFactor = ALPHA_BLENDING.srcAlphaBlendFactor;
+    color_blend_attachment.dstAlphaBlendFactor = ALPHA_BLENDING.dstAlphaBlendFactor;
+    color_blend_attachment.alphaBlendOp = ALPHA_BLENDING.alphaBlendOp;
+  }
 
   // Global color blending settings
   VkPipelineColorBlendStateCreateInfo color_blending{};
@@ -818,19 +1520,6 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
   // color_blending.blendConstants[2] = 0.f;
   // color_blending.blendConstants[3] = 0.f;
 
-  // Layout for shader uniforms
-  VkPipelineLayoutCreateInfo pipeline_layout{};
-  pipeline_layout.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  // pipeline_layout.setLayoutCount = 0;
-  // pipeline_layout.pSetLayouts = nullptr;
-  // pipeline_layout.pushConstantRangeCount = 0;
-  // pipeline_layout.pPushConstantRanges= nullptr;
-
-  if (vkCreatePipelineLayout(_device, &pipeline_layout, nullptr, 
-                             &_graphics_pipeline_layout) != VK_SUCCESS) {
-    throw std::runtime_error{"Failed to create pipeline layout"};
-  }
-
   VkGraphicsPipelineCreateInfo pipeline{};
   pipeline.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   pipeline.stageCount = 2;
@@ -843,8 +1532,8 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
   // pipeline.pDepthStencilState = nullptr;
   pipeline.pColorBlendState = &color_blending;
   pipeline.pDynamicState = &dynamic_state;
-  pipeline.layout = _graphics_pipeline_layout;
-  pipeline.renderPass = _render_pass;
+  pipeline.layout = _pipeline_layout;
+  pipeline.renderPass = target.render_pass;
   pipeline.subpass = 0; // Index of the subpass where this pipeline will be used
 
   // For deriving from another pipeline
@@ -853,13 +1542,208 @@ void vk_context::create_graphics_pipeline(std::string_view vert_src, std::string
 
   // Can take multiple VkGraphicsPipelineCreateInfo objects
   // and create multiple VkPipeline objects in a single call
-  if (vkCreateGraphicsPipelines(_device, VK_NULL_HANDLE, 1, &pipeline, nullptr, 
-                                &_graphics_pipeline) != VK_SUCCESS) {
+  // The cache is internally synchronized, compiles on several threads can share it
+  VkPipeline graphics_pipeline{VK_NULL_HANDLE};
+  VkResult result{VK_PIPELINE_COMPILE_REQUIRED};
+  if (vert_id && frag_id) {
+    // Only works if the pipeline is cached, the driver fails instead of compiling anything
+    VkPipelineShaderStageModuleIdentifierCreateInfoEXT stage_ids[2]{};
+    const module_identifier* ids[] = {&*vert_id, &*frag_id};
+    for (std::size_t i = 0; i < std::size(stage_ids); ++i) {
+      stage_ids[i].sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_MODULE_IDENTIFIER_CREATE_INFO_EXT;
+      stage_ids[i].identifierSize = ids[i]->size;
+      stage_ids[i].pIdentifier = ids[i]->data.data();
+      shader_stages[i].pNext = &stage_ids[i];
+    }
+    pipeline.flags = VK_PIPELINE_CREATE_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT;
+    result = vkCreateGraphicsPipelines(_device, _pipeline_cache, 1, &pipeline, _allocator,
+                                       &graphics_pipeline);
+    for (auto& stage : shader_stages) {
+      stage.pNext = nullptr;
+    }
+    pipeline.flags = 0;
+  }
+
+  if (result == VK_PIPELINE_COMPILE_REQUIRED) {
+    shader_stages[0].module = _get_shader_module(desc.vert_shader, vert_src);
+    shader_stages[1].module = _get_shader_module(desc.frag_shader, frag_src);
+    result = _has_pipeline_library ?
+      _link_pipeline(desc, pipeline, link, graphics_pipeline) :
+      vkCreateGraphicsPipelines(_device, _pipeline_cache, 1, &pipeline, _allocator,
+                                &graphics_pipeline);
+  }
+
+  if (result != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create graphics pipeline"};
   }
+  return graphics_pipeline;
+}
+
+VkResult vk_context::_link_pipeline(const pipeline_desc& desc,
+                                    const VkGraphicsPipelineCreateInfo& full,
+                                    pipeline_link link, VkPipeline& pipeline) {
+  // Each part only gets the state it owns, the rest stays out of its key and create info
+  VkGraphicsPipelineCreateInfo vertex_input{};
+  vertex_input.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  vertex_input.pVertexInputState = full.pVertexInputState;
+  vertex_input.pInputAssemblyState = full.pInputAssemblyState;
+  vertex_input.pDynamicState = full.pDynamicState;
+
+  VkGraphicsPipelineCreateInfo pre_raster{};
+  pre_raster.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pre_raster.stageCount = 1;
+  pre_raster.pStages = &full.pStages[0];
+  pre_raster.pViewportState = full.pViewportState;
+  pre_raster.pRasterizationState = full.pRasterizationState;
+  pre_raster.pDynamicState = full.pDynamicState;
+  pre_raster.layout = full.layout;
+  pre_raster.renderPass = full.renderPass;
+  pre_raster.subpass = full.subpass;
+
+  VkGraphicsPipelineCreateInfo fragment{};
+  fragment.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  fragment.stageCount = 1;
+  fragment.pStages = &full.pStages[1];
+  fragment.pMultisampleState = full.pMultisampleState;
+  fragment.pDepthStencilState = full.pDepthStencilState;
+  fragment.pDynamicState = full.pDynamicState;
+  fragment.layout = full.layout;
+  fragment.renderPass = full.renderPass;
+  fragment.subpass = full.subpass;
+
+  VkGraphicsPipelineCreateInfo output{};
+  output.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  output.pMultisampleState = full.pMultisampleState;
+  output.pColorBlendState = full.pColorBlendState;
+  output.pDynamicState = full.pDynamicState;
+  output.renderPass = full.renderPass;
+  output.subpass = full.subpass;
+
+  const VkPipeline libraries[] = {
+    _get_library(desc, vertex_input, VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT),
+    _get_library(desc, pre_raster, VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT),
+    _get_library(desc, fragment, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT),
+    _get_library(desc, output, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT),
+  };
+  if (std::ranges::find(libraries, VK_NULL_HANDLE) != std::end(libraries)) {
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  // The libraries keep what link time optimization needs, the fast link just skips it
+  VkPipelineLibraryCreateInfoKHR link_info{};
+  link_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+  link_info.libraryCount = static_cast<uint32_t>(std::size(libraries));
+  link_info.pLibraries = libraries;
+
+  VkGraphicsPipelineCreateInfo linked{};
+  linked.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  linked.pNext = &link_info;
+  linked.layout = full.layout;
+  if (link == pipeline_link::optimized) {
+    linked.flags = VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT;
+  }
+
+  return vkCreateGraphicsPipelines(_device, _pipeline_cache, 1, &linked, _allocator, &pipeline);
+}
+
+VkShaderModule vk_context::_get_shader_module(uint64_t hash, std::string_view spirv) {
+  {
+    std::scoped_lock lock{_shader_modules_mtx};
+    if (auto it = _shader_modules.find(hash); it != _shader_modules.end()) {
+      return it->second;
+    }
+  }
+
+  VkShaderModuleCreateInfo create_info{};
+  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  create_info.codeSize = spirv.size();
+  create_info.pCode = reinterpret_cast<const uint32_t*>(spirv.data());
+
+  VkShaderModule module;
+  if (vkCreateShaderModule(_device, &create_info, _allocator, &module) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create shader module"};
+  }
+
+  // Saved at shutdown, so the next run can skip creating this module
+  module_identifier id{};
+  if (_has_module_identifier) {
+    VkShaderModuleIdentifierEXT identifier{};
+    identifier.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_IDENTIFIER_EXT;
+    _get_module_identifier(_device, module, &identifier);
+    id.size = std::min<uint32_t>(identifier.identifierSize, id.data.size());
+    std::memcpy(id.data.data(), identifier.identifier, id.size);
+  }
 
-  vkDestroyShaderModule(_device, vert_module, nullptr);
-  vkDestroyShaderModule(_device, frag_module, nullptr);
+  // Another compile might have created the same module meanwhile, keep only one
+  std::scoped_lock lock{_shader_modules_mtx};
+  auto [it, inserted] = _shader_modules.try_emplace(hash, module);
+  if (!inserted) {
+    vkDestroyShaderModule(_device, module, _allocator);
+  } else if (id.size) {
+    _module_identifiers.insert_or_assign(hash, id);
+  }
+  return it->second;
+}
+
+auto vk_context::_find_module_identifier(uint64_t hash) -> std::optional<module_identifier> {
+  if (!_has_module_identifier) {
+    return std::nullopt;
+  }
+  std::scoped_lock lock{_shader_modules_mtx};
+  if (auto it = _module_identifiers.find(hash); it != _module_identifiers.end()) {
+    return it->second;
+  }
+  return std::nullopt;
+}
+
+VkPipeline vk_context::_get_library(const pipeline_desc& desc, VkGraphicsPipelineCreateInfo info,
+                                    VkGraphicsPipelineLibraryFlagBitsEXT part) {
+  const pipeline_desc part_desc = library_desc(part, desc);
+  fnv1a h;
+  h.add(part);
+  h.add(hash_value(part_desc));
+  const uint64_t hash = h.value();
+
+  auto find = [&]() -> VkPipeline {
+    auto [first, last] = _libraries.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+      if (it->second.part == part && it->second.desc == part_desc) {
+        return it->second.pipeline;
+      }
+    }
+    return VK_NULL_HANDLE;
+  };
+
+  {
+    std::scoped_lock lock{_libraries_mtx};
+    if (VkPipeline library = find()) {
+      return library;
+    }
+  }
+
+  // Built outside the lock, compiling a part can take as long as a whole pipeline
+  VkGraphicsPipelineLibraryCreateInfoEXT library_info{};
+  library_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+  library_info.flags = part;
+  info.pNext = &library_info;
+  info.flags |= VK_PIPELINE_CREATE_LIBRARY_BIT_KHR |
+                VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+
+  VkPipeline library;
+  if (vkCreateGraphicsPipelines(_device, _pipeline_cache, 1, &info, _allocator,
+                                &library) != VK_SUCCESS) {
+    return VK_NULL_HANDLE;
+  }
+
+  // Another compile might have built the same part meanwhile, keep only one
+  std::scoped_lock lock{_libraries_mtx};
+  if (VkPipeline existing = find()) {
+    vkDestroyPipeline(_device, library, _allocator);
+    return existing;
+  }
+  _libraries.emplace(hash, pipeline_library{part, part_desc, library});
+  return library;
 }
 
 void vk_context::create_framebuffers() {
@@ -881,7 +1765,7 @@ void vk_context::create_framebuffers() {
     framebuffer.height = _swapchain_extent.height;
     framebuffer.layers = 1; // Layers in the image arrays
 
-    if (vkCreateFramebuffer(_device, &framebuffer, nullptr, &_swapchain_framebuffers[i])
+    if (vkCreateFramebuffer(_device, &framebuffer, _allocator, &_swapchain_framebuffers[i])
         != VK_SUCCESS) {
       throw std::runtime_error{"Failed to create framebuffer"};
     }
@@ -891,7 +1775,7 @@ void vk_context::create_framebuffers() {
 void vk_context::create_commandpool() {
   // Commands in vulkan are recorded in a command buffer
   // instead of being executed directly using function calls
-  auto indices = _find_queue_families(_physical_device);
+  const auto& indices = _queue_families;
 
   VkCommandPoolCreateInfo pool{};
   pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -902,35 +1786,20 @@ void vk_context::create_commandpool() {
   // All command buffers can be rerecorded individually
   pool.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
-  if (vkCreateCommandPool(_device, &pool, nullptr, &_graphics_command_pool) != VK_SUCCESS) {
+  if (vkCreateCommandPool(_device, &pool, _allocator, &_graphics_command_pool) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create graphics command pool"};
   }
 
   pool.queueFamilyIndex = indices.transfer_family.value();
-  if (vkCreateCommandPool(_device, &pool, nullptr, &_transfer_command_pool) != VK_SUCCESS) {
+  if (vkCreateCommandPool(_device, &pool, _allocator, &_transfer_command_pool) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create transfer command pool"};
   }
 }
 
-void vk_context::_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, 
-                                VkMemoryPropertyFlags props, VkBuffer& buffer,
-                                VkDeviceMemory& buffer_mem) {
+bool vk_context::_try_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                    VkMemoryPropertyFlags props, memory_category category,
+                                    VkBuffer& buffer, VkDeviceMemory& buffer_mem, void** mapped) {
   // TODO: Use a proper allocator
-  
-  // Find an appropiate type of memory to use with some properties
-  // The type of memory varies on its allowed operations and performance when using
-  auto find_memory_type = [this](uint32_t type_filter, VkMemoryPropertyFlags props) -> uint32_t {
-    VkPhysicalDeviceMemoryProperties mem_props;
-    vkGetPhysicalDeviceMemoryProperties(_physical_device, &mem_props);
-
-    for (uint32_t i = 0; i < mem_props.memoryTypeCount; ++i) {
-      if (type_filter & (1 << i) && ((mem_props.memoryTypes[i].propertyFlags & props) == props)) {
-        return i;
-      }
-    }
-
-    throw std::runtime_error{"Failed to find suitable memory type"};
-  };
 
   // Configure the buffer
   VkBufferCreateInfo buff_info{};
@@ -938,7 +1807,7 @@ void vk_context::_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
   buff_info.size = size;
   buff_info.usage = usage;
 
-  auto indices = _find_queue_families(_physical_device);
+  const auto& indices = _queue_families;
   uint32_t queue_indices[] = {indices.graphics_family.value(), indices.transfer_family.value()};
   if (indices.graphics_family != indices.transfer_family) {
     buff_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
@@ -949,7 +1818,7 @@ void vk_context::_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
     buff_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE; 
   }
 
-  if (vkCreateBuffer(_device, &buff_info, nullptr, &buffer) != VK_SUCCESS) {
+  if (vkCreateBuffer(_device, &buff_info, _allocator, &buffer) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to create buffer"};
   }
 
@@ -960,112 +1829,472 @@ void vk_context::_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
   VkMemoryAllocateInfo alloc_info{};
   alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
   alloc_info.allocationSize = mem_req.size;
-  alloc_info.memoryTypeIndex = find_memory_type(mem_req.memoryTypeBits, props);
+  alloc_info.memoryTypeIndex = _find_memory_type(mem_req.memoryTypeBits, props);
+
+  // Buffers with a device address need memory allocated for it
+  VkMemoryAllocateFlagsInfo alloc_flags{};
+  alloc_flags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+  alloc_flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+  if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+    alloc_info.pNext = &alloc_flags;
+  }
 
-  if (vkAllocateMemory(_device, &alloc_info, nullptr, &buffer_mem) != VK_SUCCESS) {
+  // Going over the budget makes the driver page memory in and out (or fail), so evict
+  // something first, or give up and let the caller try again later
+  const uint32_t heap = _budget.heap_of(alloc_info.memoryTypeIndex);
+  if (!_budget.fits(heap, mem_req.size) && !_budget.make_room(heap, mem_req.size)) {
+    vkDestroyBuffer(_device, buffer, _allocator);
+    return false;
+  }
+
+  VkResult result = vkAllocateMemory(_device, &alloc_info, _allocator, &buffer_mem);
+  if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY || result == VK_ERROR_OUT_OF_HOST_MEMORY) {
+    vkDestroyBuffer(_device, buffer, _allocator);
+    return false;
+  } else if (result != VK_SUCCESS) {
     throw std::runtime_error{"Failed to allocate buffer memory"};
   }
+  _budget.on_allocate(buffer_mem, alloc_info.memoryTypeIndex, category, mem_req.size);
+
+  if (vkBindBufferMemory(_device, buffer, buffer_mem, 0) != VK_SUCCESS) {
+    _destroy_buffer(buffer, buffer_mem);
+    throw std::runtime_error{"Failed to bind buffer memory"};
+  }
+
+  // Stays mapped until the memory is freed, mapping isn't free on every driver
+  // It can only fail running out of memory (or address space), same as the allocation
+  if (mapped && vkMapMemory(_device, buffer_mem, 0, VK_WHOLE_SIZE, 0, mapped) != VK_SUCCESS) {
+    _destroy_buffer(buffer, buffer_mem);
+    *mapped = nullptr;
+    return false;
+  }
+  return true;
+}
+
+uint32_t vk_context::_find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags props) const {
+  // Find an appropiate type of memory to use with some properties
+  // The type of memory varies on its allowed operations and performance when using
+  VkPhysicalDeviceMemoryProperties mem_props;
+  vkGetPhysicalDeviceMemoryProperties(_physical_device, &mem_props);
+
+  for (uint32_t i = 0; i < mem_props.memoryTypeCount; ++i) {
+    if (type_filter & (1 << i) && ((mem_props.memoryTypes[i].propertyFlags & props) == props)) {
+      return i;
+    }
+  }
+
+  throw std::runtime_error{"Failed to find suitable memory type"};
+}
+
+void vk_context::_destroy_buffer(VkBuffer buffer, VkDeviceMemory buffer_mem) {
+  vkDestroyBuffer(_device, buffer, _allocator);
 
-  vkBindBufferMemory(_device, buffer, buffer_mem, 0);
+  _budget.on_free(buffer_mem);
+  vkFreeMemory(_device, buffer_mem, _allocator);
+}
+
+std::optional<buffer_handle> vk_context::_try_create_pooled_buffer(VkDeviceSize size,
+                                                                   VkBufferUsageFlags usage,
+                                                                   VkMemoryPropertyFlags props,
+                                                                   memory_category category,
+                                                                   bool map) {
+  VkBuffer buffer;
+  VkDeviceMemory buffer_mem;
+  void* mapped{nullptr};
+  if (!_try_create_buffer(size, usage, props, category, buffer, buffer_mem,
+                          map ? &mapped : nullptr)) {
+    return std::nullopt;
+  }
+  return _resources.buffers.allocate(buffer, buffer_mem, size, usage, category,
+                                     static_cast<std::byte*>(mapped));
+}
+
+void vk_context::_destroy_buffer(buffer_handle handle) {
+  auto& buffers = _resources.buffers;
+  _destroy_buffer(buffers.get<buffer_col::buffer>(handle), buffers.get<buffer_col::memory>(handle));
+  buffers.release(handle);
+}
+
+VkBufferUsageFlags vk_context::_geometry_usage(VkBufferUsageFlags usage) const {
+  // Vertices can get pulled from the shaders, by address
+  if (_has_device_address && (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)) {
+    usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+  }
+  return usage;
+}
+
+void vk_context::_set_geometry(buffer_handle vert, buffer_handle indx, VkDeviceSize vert_sz,
+                               uint32_t index_count, vertex_layout layout) {
+  _vertex_buffer = vert;
+  _index_buffer = indx;
+  _vertex_count = static_cast<uint32_t>(vert_sz/sizeof(vertex));
+  _index_count = index_count;
+  _vertex_layout = layout;
+
+  _vertex_address = 0;
+  if (_has_device_address) {
+    VkBufferDeviceAddressInfo address_info{};
+    address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+    address_info.buffer = vertex_buffer();
+    _vertex_address = _get_buffer_address(_device, &address_info);
+  }
 }
 
-void vk_context::_copy_buffer(VkBuffer src, VkBuffer dst, VkDeviceSize sz) {
+void vk_context::_destroy_resources() {
+  // Nothing is in flight anymore, so the order doesn't matter
+  _resources.buffers.for_each([this](buffer_handle h) { _destroy_buffer(h); });
+
+  auto& images = _resources.images;
+  images.for_each([&](image_handle h) {
+    vkDestroyImageView(_device, images.get<image_col::view>(h), _allocator);
+    vkDestroyImage(_device, images.get<image_col::image>(h), _allocator);
+    _budget.on_free(images.get<image_col::memory>(h));
+    vkFreeMemory(_device, images.get<image_col::memory>(h), _allocator);
+    images.release(h);
+  });
+
+  auto& pipelines = _resources.pipelines;
+  pipelines.for_each([&](pipeline_handle h) {
+    vkDestroyPipeline(_device, pipelines.get<pipeline_col::pipeline>(h), _allocator);
+    pipelines.release(h);
+  });
+  for (const auto& retired : _retired_pipelines) {
+    vkDestroyPipeline(_device, retired.pipeline, _allocator);
+  }
+  _retired_pipelines.clear();
+
+  auto& samplers = _resources.samplers;
+  samplers.for_each([&](sampler_handle h) {
+    vkDestroySampler(_device, samplers.get<sampler_col::sampler>(h), _allocator);
+    samplers.release(h);
+  });
+}
+
+std::optional<buffer_upload> vk_context::_try_create_staging(const void* data, VkDeviceSize sz) {
+  buffer_upload upload{};
+
+  if (!_try_create_buffer(
+    sz,
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    memory_category::staging,
+    upload.staging_buffer,
+    upload.staging_buffer_mem
+  )) {
+    return std::nullopt;
+  }
+
+  void* mapped;
+  vkMapMemory(_device, upload.staging_buffer_mem, 0, sz, 0, &mapped);
+  std::memcpy(mapped, data, static_cast<std::size_t>(sz));
+  vkUnmapMemory(_device, upload.staging_buffer_mem);
+
+  return upload;
+}
+
+bool vk_context::_try_import_host(const mapped_file& file, buffer_upload& upload) {
+  // Wrap the file pages in a buffer, the copy reads them without going through staging
+  // Drivers can refuse some mappings (file backed, read only), the caller falls back then
+  VkExternalMemoryBufferCreateInfo external_info{};
+  external_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+  external_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+  VkBufferCreateInfo buff_info{};
+  buff_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buff_info.pNext = &external_info;
+  buff_info.size = file.mapped_size();
+  buff_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  buff_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // Only the transfer queue reads it
+
+  if (vkCreateBuffer(_device, &buff_info, _allocator, &upload.staging_buffer) != VK_SUCCESS) {
+    return false;
+  }
+
+  void* host_ptr = const_cast<std::byte*>(file.data());
+  VkMemoryHostPointerPropertiesEXT host_props{};
+  host_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+  VkMemoryRequirements mem_req;
+  vkGetBufferMemoryRequirements(_device, upload.staging_buffer, &mem_req);
+
+  const bool importable = _get_host_pointer_props(
+    _device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, host_ptr, &host_props
+  ) == VK_SUCCESS;
+  const uint32_t type_bits = importable ? host_props.memoryTypeBits & mem_req.memoryTypeBits : 0;
+  if (!type_bits || mem_req.size > file.mapped_size()) {
+    vkDestroyBuffer(_device, upload.staging_buffer, _allocator);
+    return false;
+  }
+
+  VkImportMemoryHostPointerInfoEXT import_info{};
+  import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+  import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+  import_info.pHostPointer = host_ptr;
+
+  VkMemoryAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.pNext = &import_info;
+  alloc_info.allocationSize = file.mapped_size();
+  alloc_info.memoryTypeIndex = static_cast<uint32_t>(std::countr_zero(type_bits));
+
+  // Not counted against the budget, the pages belong to the page cache and not to us
+  if (vkAllocateMemory(_device, &alloc_info, _allocator, &upload.staging_buffer_mem)
+      != VK_SUCCESS) {
+    vkDestroyBuffer(_device, upload.staging_buffer, _allocator);
+    return false;
+  }
+
+  if (vkBindBufferMemory(_device, upload.staging_buffer, upload.staging_buffer_mem, 0)
+      != VK_SUCCESS) {
+    vkFreeMemory(_device, upload.staging_buffer_mem, _allocator);
+    vkDestroyBuffer(_device, upload.staging_buffer, _allocator);
+    return false;
+  }
+  return true;
+}
+
+void vk_context::_submit_upload(buffer_upload& upload, std::span<const buffer_copy> copies) {
+  // Each upload gets its own command buffer, so several of them can be in flight
+  VkCommandBufferAllocateInfo alloc{};
+  alloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc.commandPool = _transfer_command_pool;
+  alloc.commandBufferCount = 1;
+  alloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+
+  if (vkAllocateCommandBuffers(_device, &alloc, &upload.command_buffer) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to allocate transfer command buffer"};
+  }
+
   VkCommandBufferBeginInfo begin_info{};
   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  vkBeginCommandBuffer(_transfer_command_buffer, &begin_info);
+  vkBeginCommandBuffer(upload.command_buffer, &begin_info);
 
-  VkBufferCopy copy_region{};
-  copy_region.srcOffset = 0;
-  copy_region.dstOffset = 0;
-  copy_region.size = sz;
-  vkCmdCopyBuffer(_transfer_command_buffer, src, dst, 1, &copy_region);
+  for (const auto& copy : copies) {
+    vkCmdCopyBuffer(upload.command_buffer, upload.staging_buffer, copy.dst, 1, &copy.region);
+  }
 
-  vkEndCommandBuffer(_transfer_command_buffer);
+  vkEndCommandBuffer(upload.command_buffer);
+
+  // Instead of waiting for the queue to go idle, signal a fence that can be polled
+  VkFenceCreateInfo fence{};
+  fence.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  // On failure only what got made here goes, the staging buffer is still the caller's
+  if (vkCreateFence(_device, &fence, _allocator, &upload.fence) != VK_SUCCESS) {
+    vkFreeCommandBuffers(_device, _transfer_command_pool, 1, &upload.command_buffer);
+    throw std::runtime_error{"Failed to create upload fence"};
+  }
 
   VkSubmitInfo submit{};
   submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
   submit.commandBufferCount = 1;
-  submit.pCommandBuffers = &_transfer_command_buffer;
+  submit.pCommandBuffers = &upload.command_buffer;
 
-  vkQueueSubmit(_transfer_queue, 1, &submit, VK_NULL_HANDLE);
-  vkQueueWaitIdle(_transfer_queue);
+  if (vkQueueSubmit(_transfer_queue, 1, &submit, upload.fence) != VK_SUCCESS) {
+    vkDestroyFence(_device, upload.fence, _allocator);
+    vkFreeCommandBuffers(_device, _transfer_command_pool, 1, &upload.command_buffer);
+    throw std::runtime_error{"Failed to submit buffer upload"};
+  }
 }
 
-void vk_context::create_buffers() {
-  VkDeviceSize vert_sz = sizeof(vertices[0])*vertices.size();
-  VkDeviceSize indx_sz = sizeof(indices[0])*indices.size();
+void vk_context::_discard_geometry_uploads(std::span<buffer_upload> uploads,
+                                           std::size_t submitted) {
+  // The submitted copies still read their staging memory and write the geometry buffers
+  for (std::size_t i = 0; i < uploads.size(); ++i) {
+    if (i < submitted) {
+      vkWaitForFences(_device, 1, &uploads[i].fence, VK_TRUE, UINT64_MAX);
+      finish_upload(uploads[i]);
+    } else if (uploads[i].owns_staging) {
+      _destroy_buffer(uploads[i].staging_buffer, uploads[i].staging_buffer_mem);
+    }
+  }
+  _destroy_buffer(_index_buffer);
+  _destroy_buffer(_vertex_buffer);
+}
 
-  // Without staging buffer
-  // _create_buffer(
-  //   buffer_sz,
-  //   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-  //   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-  //   _vertex_buffer,
-  //   _vertex_buffer_mem
-  // );
-  //
-  // // Copy the vertex data
-  // void* data;
-  // vkMapMemory(_device, _vertex_buffer_mem, 0, buffer_sz, 0, &data);
-  // std::memcpy(data, vertices.data(), static_cast<std::size_t>(buffer_sz));
-  // vkUnmapMemory(_device, _vertex_buffer_mem);
-
-  // With staging buffer
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_mem;
-  _create_buffer(
-    vert_sz,
-    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-    staging_buffer,
-    staging_buffer_mem
-  );
+bool vk_context::is_upload_done(const buffer_upload& upload) {
+  // Errors (device lost) count as done too, they show up again on the next submit
+  return vkGetFenceStatus(_device, upload.fence) != VK_NOT_READY;
+}
+
+void vk_context::finish_upload(buffer_upload& upload) {
+  vkDestroyFence(_device, upload.fence, _allocator);
+  vkFreeCommandBuffers(_device, _transfer_command_pool, 1, &upload.command_buffer);
 
-  // Copy the vertex data
-  void* data;
-  vkMapMemory(_device, staging_buffer_mem, 0, vert_sz, 0, &data);
-  std::memcpy(data, vertices.data(), static_cast<std::size_t>(vert_sz));
-  vkUnmapMemory(_device, staging_buffer_mem);
+  if (upload.owns_staging) {
+    _destroy_buffer(upload.staging_buffer, upload.staging_buffer_mem);
+  }
+}
 
-  _create_buffer(
+bool vk_context::create_geometry_buffers(VkDeviceSize vert_sz, VkDeviceSize indx_sz,
+                                         vertex_layout layout) {
+  auto vert = _try_create_pooled_buffer(
     vert_sz,
-    VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+    _geometry_usage(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT),
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    _vertex_buffer,
-    _vertex_buffer_mem
+    memory_category::geometry
   );
+  if (!vert) {
+    return false;
+  }
 
-  _copy_buffer(staging_buffer, _vertex_buffer, vert_sz);
+  auto indx = _try_create_pooled_buffer(
+    indx_sz,
+    VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    memory_category::geometry
+  );
+  if (!indx) {
+    _destroy_buffer(*vert);
+    return false;
+  }
 
-  vkDestroyBuffer(_device, staging_buffer, nullptr);
-  vkFreeMemory(_device, staging_buffer_mem, nullptr);
+  _set_geometry(*vert, *indx, vert_sz, static_cast<uint32_t>(indx_sz/sizeof(uint16_t)), layout);
+  return true;
+}
 
-  _create_buffer(
-    indx_sz,
+std::optional<buffer_handle> vk_context::create_geometry_buffer(VkDeviceSize size,
+                                                                VkBufferUsageFlags usage) {
+  return _try_create_pooled_buffer(size, _geometry_usage(usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_category::geometry);
+}
+
+std::optional<mapped_buffer> vk_context::create_staging_buffer(VkDeviceSize size) {
+  mapped_buffer staging{};
+  void* mapped{nullptr};
+  if (!_try_create_buffer(
+    size,
     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-    staging_buffer,
-    staging_buffer_mem
-  );
+    memory_category::staging,
+    staging.buffer,
+    staging.memory,
+    &mapped
+  )) {
+    return std::nullopt;
+  }
+  staging.data = static_cast<std::byte*>(mapped);
+  staging.size = size;
+  return staging;
+}
 
-  vkMapMemory(_device, staging_buffer_mem, 0, indx_sz, 0, &data);
-  std::memcpy(data, indices.data(), static_cast<std::size_t>(indx_sz));
-  vkUnmapMemory(_device, staging_buffer_mem);
+void vk_context::destroy_staging_buffer(mapped_buffer& staging) {
+  _destroy_buffer(staging.buffer, staging.memory);
+  staging = {};
+}
 
-  _create_buffer(
-    indx_sz,
-    VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    _index_buffer,
-    _index_buffer_mem
-  );
+buffer_upload vk_context::submit_copy(VkBuffer src, VkBuffer dst, const VkBufferCopy& region) {
+  const buffer_copy copy{dst, region};
+  return submit_copies(src, {&copy, 1});
+}
+
+buffer_upload vk_context::submit_copies(VkBuffer src, std::span<const buffer_copy> copies) {
+  buffer_upload upload{};
+  upload.staging_buffer = src;
+  upload.owns_staging = false;
+
+  _submit_upload(upload, copies);
+  return upload;
+}
+
+std::optional<std::vector<buffer_upload>> vk_context::create_buffers() {
+  return create_buffers(geometry_source{std::as_bytes(std::span{vertices}), indices});
+}
+
+std::optional<std::vector<buffer_upload>> vk_context::create_buffers(const geometry_source& src) {
+  VkDeviceSize vert_sz = src.vertices.size_bytes();
+  VkDeviceSize indx_sz = src.indices.size_bytes();
+
+  // Without staging buffer, when device local memory is host visible too (UMA, resizable BAR)
+  // The data is there as soon as the memcpy returns, no transfers to wait for
+  if (_direct_write) {
+    auto vert = _try_create_pooled_buffer(
+      vert_sz,
+      _geometry_usage(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT),
+      DIRECT_WRITE_MEMORY,
+      memory_category::geometry,
+      true
+    );
+    if (!vert) {
+      return std::nullopt;
+    }
+
+    auto indx = _try_create_pooled_buffer(
+      indx_sz,
+      VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      DIRECT_WRITE_MEMORY,
+      memory_category::geometry,
+      true
+    );
+    if (!indx) {
+      _destroy_buffer(*vert);
+      return std::nullopt;
+    }
+
+    const auto& buffers = _resources.buffers;
+    std::memcpy(buffers.get<buffer_col::mapped>(*vert), src.vertices.data(),
+                static_cast<std::size_t>(vert_sz));
+    std::memcpy(buffers.get<buffer_col::mapped>(*indx), src.indices.data(),
+                static_cast<std::size_t>(indx_sz));
+    _set_geometry(*vert, *indx, vert_sz, static_cast<uint32_t>(src.indices.size()), src.layout);
+    return std::vector<buffer_upload>{};
+  }
+
+  // With staging buffer, both copies run at the same time
+  // Everything gets allocated before submitting anything, so backing out is easy
+  if (!create_geometry_buffers(vert_sz, indx_sz, src.layout)) {
+    return std::nullopt;
+  }
+
+  // Straight from the file pages when the driver can import them, a single copy for both
+  if (src.file && _host_import_alignment) {
+    buffer_upload upload{};
+    if (_try_import_host(*src.file, upload)) {
+      auto offset_of = [&src](const void* ptr) -> VkDeviceSize {
+        return static_cast<VkDeviceSize>(static_cast<const std::byte*>(ptr) - src.file->data());
+      };
+      const buffer_copy copies[] = {
+        {vertex_buffer(), {offset_of(src.vertices.data()), 0, vert_sz}},
+        {index_buffer(), {offset_of(src.indices.data()), 0, indx_sz}},
+      };
+      try {
+        _submit_upload(upload, copies);
+      } catch (...) {
+        _discard_geometry_uploads({&upload, 1}, 0);
+        throw;
+      }
+      return std::vector{upload};
+    }
+  }
+
+  auto vert_upload = _try_create_staging(src.vertices.data(), vert_sz);
+  auto indx_upload = vert_upload ? _try_create_staging(src.indices.data(), indx_sz) : std::nullopt;
+  if (!indx_upload) {
+    if (vert_upload) {
+      _destroy_buffer(vert_upload->staging_buffer, vert_upload->staging_buffer_mem);
+    }
+    _destroy_buffer(_index_buffer);
+    _destroy_buffer(_vertex_buffer);
+    return std::nullopt;
+  }
 
-  _copy_buffer(staging_buffer, _index_buffer, indx_sz);
+  std::array uploads{*vert_upload, *indx_upload};
+  const buffer_copy copies[] = {
+    {vertex_buffer(), {0, 0, vert_sz}},
+    {index_buffer(), {0, 0, indx_sz}},
+  };
+  std::size_t submitted{0};
+  try {
+    for (; submitted < uploads.size(); ++submitted) {
+      _submit_upload(uploads[submitted], {&copies[submitted], 1});
+    }
+  } catch (...) {
+    _discard_geometry_uploads(uploads, submitted);
+    throw;
+  }
 
-  vkDestroyBuffer(_device, staging_buffer, nullptr);
-  vkFreeMemory(_device, staging_buffer_mem, nullptr);
+  return std::vector(uploads.begin(), uploads.end());
 }
 
 void vk_context::create_commandbuffers() {
@@ -1085,13 +2314,6 @@ void vk_context::create_commandbuffers() {
   if (vkAllocateCommandBuffers(_device, &alloc, _graphics_command_buffers.data()) != VK_SUCCESS) {
     throw std::runtime_error{"Failed to allocate graphics command buffers"};
   }
-
-  alloc.commandPool = _transfer_command_pool;
-  alloc.commandBufferCount = 1;
-
-  if (vkAllocateCommandBuffers(_device, &alloc, &_transfer_command_buffer) != VK_SUCCESS) {
-    throw std::runtime_error{"Failed to allocate transfer command buffer"};
-  }
 }
 
 void vk_context::create_sync_objects() {
@@ -1114,6 +2336,7 @@ void vk_context::create_sync_objects() {
   _image_avail_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
   _render_finish_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
   _in_flight_fences.resize(MAX_FRAMES_IN_FLIGHT);
+  _frame_arenas.resize(MAX_FRAMES_IN_FLIGHT);
 
   VkSemaphoreCreateInfo semaphore{};
   semaphore.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1125,11 +2348,11 @@ void vk_context::create_sync_objects() {
   fence.flags = VK_FENCE_CREATE_SIGNALED_BIT; 
 
   for (std::size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-    if (vkCreateSemaphore(_device, &semaphore, nullptr, &_image_avail_semaphores[i]) 
+    if (vkCreateSemaphore(_device, &semaphore, _allocator, &_image_avail_semaphores[i]) 
                         != VK_SUCCESS ||
-        vkCreateSemaphore(_device, &semaphore, nullptr, &_render_finish_semaphores[i]) 
+        vkCreateSemaphore(_device, &semaphore, _allocator, &_render_finish_semaphores[i]) 
                         != VK_SUCCESS ||
-        vkCreateFence(_device, &fence, nullptr, &_in_flight_fences[i]) != VK_SUCCESS) {
+        vkCreateFence(_device, &fence, _allocator, &_in_flight_fences[i]) != VK_SUCCESS) {
       throw std::runtime_error{"Failed to create sync objects"};
     }
   }
@@ -1137,14 +2360,14 @@ void vk_context::create_sync_objects() {
 
 void vk_context::_cleanup_swapchain() {
   for (auto fb : _swapchain_framebuffers) {
-    vkDestroyFramebuffer(_device, fb, nullptr);
+    vkDestroyFramebuffer(_device, fb, _allocator);
   }
 
   for (auto view : _swapchain_image_views) {
-    vkDestroyImageView(_device, view, nullptr);
+    vkDestroyImageView(_device, view, _allocator);
   }
 
-  vkDestroySwapchainKHR(_device, _swapchain, nullptr);
+  vkDestroySwapchainKHR(_device, _swapchain, _allocator);
 }
 
 void vk_context::_recreate_swapchain() {
@@ -1155,46 +2378,119 @@ void vk_context::_recreate_swapchain() {
   create_swapchain();
   create_imageviews();
   create_framebuffers();
+
+  ++_swapchain_generation;
 }
 
 void vk_context::destroy() {
-  _cleanup_swapchain();
+  // Null handles are fine to destroy, as long as the device they'd come from exists
+  if (_device) {
+    _destroy_device_objects();
+    vkDestroyDevice(_device, _allocator); // Cleans up device queues too
+    _device = VK_NULL_HANDLE;
+  }
 
-  vkDestroyBuffer(_device, _index_buffer, nullptr);
-  vkFreeMemory(_device, _index_buffer_mem, nullptr);
+  if (!_instance) {
+    return;
+  }
 
-  vkDestroyBuffer(_device, _vertex_buffer, nullptr);
-  vkFreeMemory(_device, _vertex_buffer_mem, nullptr);
+  if (_enable_layers && _messenger) {
+    DestroyDebugUtilsMessengerEXT(_instance, _messenger, _allocator);
+  }
 
-  for (std::size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-    vkDestroySemaphore(_device, _image_avail_semaphores[i], nullptr);
-    vkDestroySemaphore(_device, _render_finish_semaphores[i], nullptr);
-    vkDestroyFence(_device, _in_flight_fences[i], nullptr);
+  vkDestroySurfaceKHR(_instance, _surface, _allocator);
+
+  vkDestroyInstance(_instance, _allocator);
+  _instance = VK_NULL_HANDLE;
+
+  // Anything still in use here was leaked by the driver (or by us)
+  _host_allocator.print_stats();
+}
+
+void vk_context::_destroy_device_objects() {
+  _cleanup_swapchain();
+  _swapchain_framebuffers.clear();
+  _swapchain_image_views.clear();
+
+  _destroy_resources();
+
+  for (auto semaphore : _image_avail_semaphores) {
+    vkDestroySemaphore(_device, semaphore, _allocator);
+  }
+  for (auto semaphore : _render_finish_semaphores) {
+    vkDestroySemaphore(_device, semaphore, _allocator);
+  }
+  for (auto fence : _in_flight_fences) {
+    vkDestroyFence(_device, fence, _allocator);
   }
 
-  vkDestroyCommandPool(_device, _transfer_command_pool, nullptr); // Cleans up the buffer too 
-  vkDestroyCommandPool(_device, _graphics_command_pool, nullptr); // Cleans up the buffer too 
+  vkDestroyCommandPool(_device, _transfer_command_pool, _allocator);
+  vkDestroyCommandPool(_device, _graphics_command_pool, _allocator); // Cleans up the buffer too 
 
-  vkDestroyPipeline(_device, _graphics_pipeline, nullptr);
-  vkDestroyPipelineLayout(_device, _graphics_pipeline_layout, nullptr);
+  vkDestroyPipelineLayout(_device, _pipeline_layout, _allocator);
 
-  vkDestroyRenderPass(_device, _render_pass, nullptr);
+  // Linked pipelines don't need their libraries anymore, but they go last anyway
+  for (const auto& [hash, library] : _libraries) {
+    vkDestroyPipeline(_device, library.pipeline, _allocator);
+  }
+  _libraries.clear();
 
-  vkDestroyDevice(_device, nullptr); // Cleans up device queues too
+  // Kept around for new pipelines until now, the ones built with them don't need them
+  for (const auto& [hash, module] : _shader_modules) {
+    vkDestroyShaderModule(_device, module, _allocator);
+  }
+  _shader_modules.clear();
+  _save_module_identifiers();
 
-  if (_enable_layers) {
-    DestroyDebugUtilsMessengerEXT(_instance, _messenger, nullptr);
+  if (_pipeline_cache) {
+    _save_pipeline_cache();
+    vkDestroyPipelineCache(_device, _pipeline_cache, _allocator);
   }
 
-  vkDestroySurfaceKHR(_instance, _surface, nullptr);
+  vkDestroyRenderPass(_device, _render_pass, _allocator);
+}
+
+void vk_context::_record_viewport(VkCommandBuffer buffer) const {
+  // Set the dynamic states
+  VkViewport viewport{};
+  viewport.x = 0.f;
+  viewport.y = 0.f;
+  viewport.width = static_cast<float>(_swapchain_extent.width);
+  viewport.height = static_cast<float>(_swapchain_extent.height);
+  viewport.minDepth = 0.f;
+  viewport.maxDepth = 1.f;
+  vkCmdSetViewport(buffer, 0, 1, &viewport); // firstViewport, viewportCount
+
+  VkRect2D scissor{};
+  scissor.offset = {0, 0};
+  scissor.extent = _swapchain_extent;
+  vkCmdSetScissor(buffer, 0, 1, &scissor); // firstScissor, scissorCount
+}
 
-  vkDestroyInstance(_instance, nullptr);
+void vk_context::_record_dynamic_state(VkCommandBuffer buffer, const pipeline_desc& desc) const {
+  // Extended dynamic state, whatever the pipeline left out of its build
+  const auto& cmd = _dynamic_state_cmds;
+  if (_dynamic_state.raster) {
+    cmd.set_cull_mode(buffer, desc.cull_mode);
+    cmd.set_front_face(buffer, desc.front_face);
+    cmd.set_primitive_topology(buffer, desc.topology);
+  }
+  if (_dynamic_state.polygon_mode) {
+    cmd.set_polygon_mode(buffer, desc.polygon_mode);
+  }
+  if (_dynamic_state.blend) {
+    const VkBool32 blend = desc.blend ? VK_TRUE : VK_FALSE;
+    cmd.set_color_blend_enable(buffer, 0, 1, &blend);
+    cmd.set_color_blend_equation(buffer, 0, 1, &ALPHA_BLENDING);
+  }
 }
 
-void vk_context::draw_frame() {
+void vk_context::draw_frame(const render_state& state) {
   // Draw something in an image
+  _draw_stats = {};
 
-  auto record_buffer = [this](VkCommandBuffer buffer, uint32_t image_index) -> void {
+  auto record_buffer = [this](VkCommandBuffer buffer, uint32_t image_index,
+                              std::span<const draw_command> draws) -> void {
     // Write commands to a command buffer
 
     VkCommandBufferBeginInfo begin_info{};
@@ -1221,31 +2517,60 @@ void vk_context::draw_frame() {
     // VK_SUBPASS_CONTENTS_INLINE specifies that no secondary buffers will be executed
     vkCmdBeginRenderPass(buffer, &render_pass, VK_SUBPASS_CONTENTS_INLINE);
 
-    // VK_PIPELINE_BIND_POINT_GRAPHICS specifies that is a graphics pipeline (not a compute one)
-    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _graphics_pipeline);
-
-    VkBuffer vert_buffers[] = {_vertex_buffer};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(buffer, 0, 1, vert_buffers, offsets);
+    _record_viewport(buffer);
+
+    // The draws come sorted by state, so only bind what changed since the previous one
+    // Vertex buffer bindings outlive pipeline binds, so they're only made once a pipeline
+    // reading them draws a new geometry. Pipelines pulling their vertices never need them,
+    // they read the buffer address from the push constants instead
+    const auto& pipelines = _resources.pipelines;
+    pipeline_handle bound_pipeline;
+    const pipeline_desc* bound_state{nullptr};
+    uint32_t bound_geometry{UINT32_MAX}, bound_vertices{UINT32_MAX};
+    for (const auto& draw : draws) {
+      // VK_PIPELINE_BIND_POINT_GRAPHICS specifies that is a graphics pipeline
+      // (not a compute one)
+      if (draw.pipeline != bound_pipeline) {
+        vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          pipelines.get<pipeline_col::pipeline>(draw.pipeline));
+        bound_pipeline = draw.pipeline;
+        ++_draw_stats.pipeline_binds;
+      }
 
-    vkCmdBindIndexBuffer(buffer, _index_buffer, 0, VK_INDEX_TYPE_UINT16);
+      // Pipelines share the dynamic state they didn't bake in, each draw sets its own
+      if (draw.state != bound_state) {
+        _record_dynamic_state(buffer, *draw.state);
+        bound_state = draw.state;
+      }
 
-    // Set the dynamic states
-    VkViewport viewport{};
-    viewport.x = 0.f;
-    viewport.y = 0.f;
-    viewport.width = static_cast<float>(_swapchain_extent.width);
-    viewport.height = static_cast<float>(_swapchain_extent.height);
-    viewport.minDepth = 0.f;
-    viewport.maxDepth = 1.f;
-    vkCmdSetViewport(buffer, 0, 1, &viewport); // firstViewport, viewportCount
+      if (draw.geometry != bound_geometry) {
+        vkCmdBindIndexBuffer(buffer, index_buffer(), 0, VK_INDEX_TYPE_UINT16);
+        bound_geometry = draw.geometry;
+        ++_draw_stats.geometry_binds;
+      }
 
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = _swapchain_extent;
-    vkCmdSetScissor(buffer, 0, 1, &scissor); // firstScissor, scissorCount
+      // There's a single geometry for now, split vertices bind its buffer once per stream
+      const bool pulling = pipelines.get<pipeline_col::vertex_pulling>(draw.pipeline) != 0;
+      if (!pulling && draw.geometry != bound_vertices) {
+        const VkBuffer vert_buffer = vertex_buffer();
+        if (_vertex_layout == vertex_layout::split) {
+          VkBuffer vert_buffers[] = {vert_buffer, vert_buffer};
+          VkDeviceSize offsets[] = {0, _vertex_count*sizeof(vertex::pos)};
+          vkCmdBindVertexBuffers(buffer, 0, 2, vert_buffers, offsets);
+        } else {
+          VkBuffer vert_buffers[] = {vert_buffer};
+          VkDeviceSize offsets[] = {0};
+          vkCmdBindVertexBuffers(buffer, 0, 1, vert_buffers, offsets);
+        }
+        bound_vertices = draw.geometry;
+      }
 
-    vkCmdDrawIndexed(buffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+      const VkPipelineLayout layout = pipelines.get<pipeline_col::layout>(draw.pipeline);
+      vkCmdPushConstants(buffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(draw.push),
+                         &draw.push);
+      vkCmdDrawIndexed(buffer, _index_count, 1, 0, 0, 0);
+      ++_draw_stats.draws;
+    }
     // vkCmdDraw(buffer, static_cast<uint32_t>(vertices.size()), 1, 0, 0);
     // vkCmdDraw(buffer, 3, 1, 0, 0); // vertexCount, instanceCount, firstVertex, firstInstance
     vkCmdEndRenderPass(buffer);
@@ -1258,6 +2583,13 @@ void vk_context::draw_frame() {
   // Wait for 1 fence without timeout
   vkWaitForFences(_device, 1, &_in_flight_fences[_curr_frame], VK_TRUE, UINT64_MAX);
 
+  // The GPU is done with this frame, so is everything allocated for it
+  auto& arena = _frame_arenas[_curr_frame];
+  arena.reset();
+  _destroy_retired_pipelines();
+
+  _budget.update();
+
   // Reset 1 fence
   vkResetFences(_device, 1, &_in_flight_fences[_curr_frame]);
 
@@ -1278,8 +2610,37 @@ void vk_context::draw_frame() {
   // Make sure the buffer is able to be recorded, the seccond arg is some flag
   vkResetCommandBuffer(_graphics_command_buffers[_curr_frame], 0);
 
+  // Build the draw list, squash x by the aspect ratio so the quad doesn't stretch
+  // with the window. Keyed by state and sorted so recording binds as little as possible
+  draw_list draws{arena};
+  draws.reserve(1);
+
+  const float aspect = static_cast<float>(_swapchain_extent.height)/
+                       static_cast<float>(_swapchain_extent.width);
+  draw_push_constants push;
+  push.transform = glm::scale(glm::mat4{1.f}, glm::vec3{aspect, 1.f, 1.f});
+  push.transform = glm::translate(push.transform, glm::vec3{state.position, 0.f});
+  push.transform = glm::rotate(push.transform, state.rotation, glm::vec3{0.f, 0.f, 1.f});
+  push.transform = glm::scale(push.transform, glm::vec3{state.scale});
+  push.vertices = _vertex_address;
+  if (_vertex_layout == vertex_layout::split) {
+    push.position_stride = sizeof(vertex::pos)/sizeof(float);
+    push.color_offset = _vertex_count*push.position_stride;
+    push.color_stride = sizeof(vertex::color)/sizeof(float);
+  } else {
+    push.position_stride = sizeof(vertex)/sizeof(float);
+    push.color_offset = offsetof(vertex, color)/sizeof(float);
+    push.color_stride = push.position_stride;
+  }
+
+  // No descriptor sets yet and the 2D scene has no depth, both stay 0
+  constexpr uint32_t GEOMETRY = 0;
+  draws.add(draw_key::make(_draw_pipeline.index, 0, GEOMETRY, 0.f), _draw_pipeline, _draw_state,
+            GEOMETRY, push);
+  draws.sort();
+
   // Record things
-  record_buffer(_graphics_command_buffers[_curr_frame], image_index);
+  record_buffer(_graphics_command_buffers[_curr_frame], image_index, draws.commands());
 
   // Now to submit the queue
   VkSubmitInfo submit{};
@@ -1304,6 +2665,7 @@ void vk_context::draw_frame() {
       != VK_SUCCESS) {
     throw std::runtime_error{"Failed to submit draw command buffer"};
   }
+  ++_submitted_frames;
 
   VkPresentInfoKHR present{};
   present.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1329,7 +2691,202 @@ void vk_context::draw_frame() {
 }
 
 void vk_context::wait_idle() {
-  vkDeviceWaitIdle(_device);
+  if (_device) {
+    vkDeviceWaitIdle(_device);
+  }
+}
+
+std::vector<double> vk_context::time_passes(std::span<const timed_pass> passes) {
+  if (passes.empty()) {
+    return {};
+  }
+
+  // The timestamps get written from the graphics queue, its family has to support them
+  uint32_t family_count{0};
+  vkGetPhysicalDeviceQueueFamilyProperties(_physical_device, &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(_physical_device, &family_count, families.data());
+  const uint32_t valid_bits = families[_queue_families.graphics_family.value()].timestampValidBits;
+  if (valid_bits == 0) {
+    throw std::runtime_error{"Graphics queue doesn't support timestamps"};
+  }
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(_physical_device, &props);
+
+  VkImage image{VK_NULL_HANDLE};
+  VkDeviceMemory image_mem{VK_NULL_HANDLE};
+  VkImageView view{VK_NULL_HANDLE};
+  VkRenderPass render_pass{VK_NULL_HANDLE};
+  VkFramebuffer framebuffer{VK_NULL_HANDLE};
+  VkQueryPool query_pool{VK_NULL_HANDLE};
+  VkCommandBuffer cmd_buffer{VK_NULL_HANDLE};
+  VkFence fence{VK_NULL_HANDLE};
+  auto destroy_target = [&]() {
+    vkDestroyFence(_device, fence, _allocator);
+    if (cmd_buffer) {
+      vkFreeCommandBuffers(_device, _graphics_command_pool, 1, &cmd_buffer);
+    }
+    vkDestroyQueryPool(_device, query_pool, _allocator);
+    vkDestroyFramebuffer(_device, framebuffer, _allocator);
+    vkDestroyRenderPass(_device, render_pass, _allocator);
+    vkDestroyImageView(_device, view, _allocator);
+    vkDestroyImage(_device, image, _allocator);
+    if (image_mem) {
+      _budget.on_free(image_mem);
+      vkFreeMemory(_device, image_mem, _allocator);
+    }
+  };
+  auto check = [&](VkResult result, const char* what) {
+    if (result != VK_SUCCESS) {
+      destroy_target();
+      throw std::runtime_error{fmt::format("Failed to {} for timing", what)};
+    }
+  };
+
+  // Drawn offscreen so nothing waits on the swapchain. The render pass only differs from
+  // _render_pass in the final layout, so it's compatible with the pipelines built for it
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = _swapchain_format;
+  image_info.extent = {_swapchain_extent.width, _swapchain_extent.height, 1};
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  check(vkCreateImage(_device, &image_info, _allocator, &image), "create image");
+
+  VkMemoryRequirements mem_req;
+  vkGetImageMemoryRequirements(_device, image, &mem_req);
+  VkMemoryAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize = mem_req.size;
+  alloc_info.memoryTypeIndex = _find_memory_type(mem_req.memoryTypeBits,
+                                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  const uint32_t heap = _budget.heap_of(alloc_info.memoryTypeIndex);
+  if (!_budget.fits(heap, mem_req.size) && !_budget.make_room(heap, mem_req.size)) {
+    check(VK_ERROR_OUT_OF_DEVICE_MEMORY, "allocate image memory");
+  }
+  check(vkAllocateMemory(_device, &alloc_info, _allocator, &image_mem), "allocate image memory");
+  _budget.on_allocate(image_mem, alloc_info.memoryTypeIndex, memory_category::targets,
+                      mem_req.size);
+  check(vkBindImageMemory(_device, image, image_mem, 0), "bind image memory");
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = _swapchain_format;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+  check(vkCreateImageView(_device, &view_info, _allocator, &view), "create image view");
+
+  render_pass = _create_color_pass(VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+
+  VkFramebufferCreateInfo fb_info{};
+  fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  fb_info.renderPass = render_pass;
+  fb_info.attachmentCount = 1;
+  fb_info.pAttachments = &view;
+  fb_info.width = _swapchain_extent.width;
+  fb_info.height = _swapchain_extent.height;
+  fb_info.layers = 1;
+  check(vkCreateFramebuffer(_device, &fb_info, _allocator, &framebuffer), "create framebuffer");
+
+  // Two per pass, before and after the draw
+  const auto query_count = static_cast<uint32_t>(passes.size()*2);
+  VkQueryPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  pool_info.queryCount = query_count;
+  check(vkCreateQueryPool(_device, &pool_info, _allocator, &query_pool), "create query pool");
+
+  VkCommandBufferAllocateInfo cmd_info{};
+  cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_info.commandPool = _graphics_command_pool;
+  cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_info.commandBufferCount = 1;
+  check(vkAllocateCommandBuffers(_device, &cmd_info, &cmd_buffer), "allocate command buffer");
+
+  VkFenceCreateInfo fence_info{};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  check(vkCreateFence(_device, &fence_info, _allocator, &fence), "create fence");
+
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  check(vkBeginCommandBuffer(cmd_buffer, &begin_info), "begin command buffer");
+  vkCmdResetQueryPool(cmd_buffer, query_pool, 0, query_count);
+
+  const auto& pipelines = _resources.pipelines;
+  for (std::size_t i = 0; i < passes.size(); ++i) {
+    const auto& pass = passes[i];
+
+    // The first timestamp would otherwise get written while the previous pass still runs
+    if (i > 0) {
+      vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                           VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr,
+                           0, nullptr);
+    }
+
+    VkRenderPassBeginInfo pass_info{};
+    pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    pass_info.renderPass = render_pass;
+    pass_info.framebuffer = framebuffer;
+    pass_info.renderArea.extent = _swapchain_extent;
+    VkClearValue clear_color{{{.2f, .2f, .2f, 1.f}}};
+    pass_info.clearValueCount = 1;
+    pass_info.pClearValues = &clear_color;
+    vkCmdBeginRenderPass(cmd_buffer, &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+
+    _record_viewport(cmd_buffer);
+    _record_dynamic_state(cmd_buffer, pass.desc);
+    vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipelines.get<pipeline_col::pipeline>(pass.pipeline));
+    if (pass.desc.binding_count > 0) {
+      vkCmdBindVertexBuffers(cmd_buffer, 0, pass.desc.binding_count, pass.vertex_buffers.data(),
+                             pass.vertex_offsets.data());
+    }
+    vkCmdBindIndexBuffer(cmd_buffer, pass.index_buffer, 0, VK_INDEX_TYPE_UINT16);
+    vkCmdPushConstants(cmd_buffer, pipelines.get<pipeline_col::layout>(pass.pipeline),
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(pass.push), &pass.push);
+
+    const auto query = static_cast<uint32_t>(i*2);
+    vkCmdWriteTimestamp(cmd_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, query);
+    vkCmdDrawIndexed(cmd_buffer, pass.index_count, pass.instances, 0, 0, 0);
+    vkCmdWriteTimestamp(cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, query + 1);
+
+    vkCmdEndRenderPass(cmd_buffer);
+  }
+  check(vkEndCommandBuffer(cmd_buffer), "record command buffer");
+
+  VkSubmitInfo submit{};
+  submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit.commandBufferCount = 1;
+  submit.pCommandBuffers = &cmd_buffer;
+  check(vkQueueSubmit(_graphics_queue, 1, &submit, fence), "submit command buffer");
+  check(vkWaitForFences(_device, 1, &fence, VK_TRUE, UINT64_MAX), "wait for the passes");
+
+  std::vector<uint64_t> stamps(query_count);
+  check(vkGetQueryPoolResults(_device, query_pool, 0, query_count,
+                              stamps.size()*sizeof(uint64_t), stamps.data(), sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT),
+        "get timestamps");
+  destroy_target();
+
+  // Only the valid bits count, the difference wraps around within them
+  const uint64_t mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+  std::vector<double> times(passes.size());
+  for (std::size_t i = 0; i < passes.size(); ++i) {
+    const uint64_t ticks = (stamps[i*2 + 1] - stamps[i*2]) & mask;
+    times[i] = static_cast<double>(ticks)*props.limits.timestampPeriod/1e6;
+  }
+  return times;
 }
 
 } // namespace ntf
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <functional>
+#include <mutex>
+#include <unordered_map>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
@@ -8,28 +10,144 @@
 #include <vector>
 #include <optional>
 #include <array>
+#include <span>
+#include <cstddef>
 
 #include <glm/glm.hpp>
 
+#include "render_state.hpp"
+#include "linear_arena.hpp"
+#include "vk_host_allocator.hpp"
+#include "vk_memory_budget.hpp"
+#include "mapped_file.hpp"
+#include "vk_resources.hpp"
+#include "pipeline_desc.hpp"
+#include "draw_list.hpp"
+
 namespace ntf {
 
+// How the vertices are stored in the vertex buffer
+enum class vertex_layout : uint32_t {
+  interleaved, // One ntf::vertex after another, a single binding
+  split, // Every position and then every color, one binding each. Passes only needing
+         // positions read just the first stream
+};
+
 struct vertex {
   glm::vec2 pos;
   glm::vec3 color;
 
-  static VkVertexInputBindingDescription bind_description();
-  static std::array<VkVertexInputAttributeDescription, 2> attribute_descriptions();
+  static std::vector<VkVertexInputBindingDescription> bind_descriptions(vertex_layout layout);
+  static std::array<VkVertexInputAttributeDescription, 2> attribute_descriptions(
+    vertex_layout layout);
+};
+
+// A copy into a device local buffer, running on the transfer queue
+// The staging buffer (if owned) and the command buffer live until finish_upload
+struct buffer_upload {
+  VkFence fence;
+  VkCommandBuffer command_buffer;
+  VkBuffer staging_buffer;
+  VkDeviceMemory staging_buffer_mem;
+  bool owns_staging{true};
+};
+
+// One region of a copy out of a staging buffer
+struct buffer_copy {
+  VkBuffer dst;
+  VkBufferCopy region;
 };
 
+// Host visible buffer that stays mapped for as long as it lives
+struct mapped_buffer {
+  VkBuffer buffer{VK_NULL_HANDLE};
+  VkDeviceMemory memory{VK_NULL_HANDLE};
+  std::byte* data{nullptr};
+  VkDeviceSize size{0};
+};
+
+// Geometry to upload, the spans can point inside a mapped file
+// With the file set and host memory import available the copies read the file pages directly
+// The vertices get copied as they are, they have to be in the given layout already
+struct geometry_source {
+  std::span<const std::byte> vertices;
+  std::span<const uint16_t> indices;
+  const mapped_file* file{nullptr};
+  vertex_layout layout{vertex_layout::interleaved};
+};
+
+// What pipelines get built against, taken on the render thread and handed to
+// build_pipeline so compile jobs never read what swapchain recreation writes
+struct pipeline_target {
+  VkFormat color_format{VK_FORMAT_UNDEFINED};
+  VkRenderPass render_pass{VK_NULL_HANDLE};
+};
+
+// How build_pipeline links graphics pipeline libraries, ignored without them
+enum class pipeline_link : uint8_t {
+  fast, // Cheap to link, slower to draw with
+  optimized, // Link time optimized, draws as fast as a pipeline built in one go
+};
+
+// A draw timed on its own by vk_context::time_passes
+struct timed_pass {
+  pipeline_handle pipeline;
+  pipeline_desc desc; // What the pipeline was built from, for the state set while recording
+  std::array<VkBuffer, pipeline_desc::MAX_BINDINGS> vertex_buffers{}; // One per desc binding
+  std::array<VkDeviceSize, pipeline_desc::MAX_BINDINGS> vertex_offsets{};
+  VkBuffer index_buffer{VK_NULL_HANDLE}; // uint16 indices
+  uint32_t index_count{0};
+  uint32_t instances{1};
+  draw_push_constants push;
+};
 
 template<typename F>
-concept vk_surface_factory = std::is_invocable_r_v<bool, F, VkInstance, VkSurfaceKHR*>;
+concept vk_surface_factory = std::is_invocable_r_v<bool, F, VkInstance,
+                                                   const VkAllocationCallbacks*, VkSurfaceKHR*>;
 
 class vk_context {
-private:
+public:
   // Allow to render up to N frames without waiting for the next frame
   static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 2;
 
+private:
+  // Pipeline state set with extended dynamic state instead of baked in
+  struct dynamic_state_support {
+    bool raster{false}; // Cull mode, front face and topology
+    bool polygon_mode{false};
+    bool blend{false}; // Blend enable and equation
+  };
+
+  struct dynamic_state_commands {
+    PFN_vkCmdSetCullModeEXT set_cull_mode{nullptr};
+    PFN_vkCmdSetFrontFaceEXT set_front_face{nullptr};
+    PFN_vkCmdSetPrimitiveTopologyEXT set_primitive_topology{nullptr};
+    PFN_vkCmdSetPolygonModeEXT set_polygon_mode{nullptr};
+    PFN_vkCmdSetColorBlendEnableEXT set_color_blend_enable{nullptr};
+    PFN_vkCmdSetColorBlendEquationEXT set_color_blend_equation{nullptr};
+  };
+
+  // A graphics pipeline library part, parts built from equal descriptions get shared
+  // desc only has the fields the part gets built from, see library_desc
+  struct pipeline_library {
+    VkGraphicsPipelineLibraryFlagsEXT part;
+    pipeline_desc desc;
+    VkPipeline pipeline;
+  };
+
+  // Replaced while frames in flight could still draw with it
+  struct retired_pipeline {
+    VkPipeline pipeline;
+    uint64_t last_frame; // Submitted frame count once no frame can use it anymore
+  };
+
+  // What vkGetShaderModuleIdentifierEXT gave for a module, only meaningful to devices using
+  // the same identifier algorithm
+  struct module_identifier {
+    uint32_t size{0};
+    std::array<uint8_t, VK_MAX_SHADER_MODULE_IDENTIFIER_SIZE_EXT> data{};
+  };
+
   struct queue_family_indices {
     std::optional<uint32_t> graphics_family;
     std::optional<uint32_t> present_family;
@@ -49,6 +167,9 @@ private:
 
 public:
   vk_context() = default;
+
+  vk_context(const vk_context&) = delete;
+  vk_context& operator=(const vk_context&) = delete;
   
 public:
   // Context initialization
@@ -56,7 +177,7 @@ public:
 
   template<vk_surface_factory Fun>
   void create_surface(Fun&& surface_factory) {
-    if (surface_factory(_instance, &_surface)) {
+    if (surface_factory(_instance, _allocator, &_surface)) {
       throw std::runtime_error{"Failed to create window surface"};
     }
   }
@@ -69,20 +190,129 @@ public:
   // Context render configuration
   void create_renderpass();
   void create_graphics_pipeline(std::string_view vert_src, std::string_view frag_src);
+
+  // Pipelines besides the default one. build_pipeline can run on any thread once the default
+  // pipeline exists (compiles can take a while), the rest are render thread only
+  // With graphics pipeline libraries it builds the four parts on their own, each one only
+  // once, and links them. Shader modules are created once per SPIR-V hash and kept until
+  // destroy, with module identifiers from a previous run they aren't created at all as long
+  // as the driver still has the pipeline cached
+  // The layout has to match the geometry's, see geometry_layout
+  pipeline_desc default_pipeline_desc(uint64_t vert_shader, uint64_t frag_shader,
+                                      vertex_layout layout = vertex_layout::interleaved) const;
+
+  // Same without any vertex input, the vertex shader reads the vertices through the
+  // addresses in draw_push_constants. Drawing with it binds no vertex buffers, and the same
+  // pipeline works for any vertex layout. Only usable with vertex_pulling()
+  pipeline_desc pulling_pipeline_desc(uint64_t vert_shader, uint64_t frag_shader) const;
+
+  // The description with everything the device can set while drawing reset to defaults
+  // Descriptions only differing in dynamic state can share the same pipeline
+  pipeline_desc canonical_pipeline_desc(const pipeline_desc& desc) const;
+  pipeline_target current_target() const { return {_swapchain_format, _render_pass}; }
+  // Thread safe, everything else it reads is set up with the device and never changes
+  // Built with libraries the link is only optimized if asked to, once the parts exist
+  // relinking the same description optimized is all an optimized pipeline costs
+  VkPipeline build_pipeline(const pipeline_desc& desc, const pipeline_target& target,
+                            std::string_view vert_src, std::string_view frag_src,
+                            pipeline_link link = pipeline_link::fast);
+  // Destroyed along with the context, desc is what it was built from
+  pipeline_handle adopt_pipeline(VkPipeline pipeline, const pipeline_desc& desc);
+  // Draws with pipeline from now on, the old one goes once no frame in flight uses it
+  void replace_pipeline(pipeline_handle handle, VkPipeline pipeline);
+  void destroy_pipeline(VkPipeline pipeline); // For the ones never adopted
+  pipeline_handle graphics_pipeline() const { return _graphics_pipeline; }
+
+  // What the scene draws with, the default pipeline until set
+  // The state in desc that isn't baked into the pipeline gets set while recording
+  void set_draw_pipeline(pipeline_handle pipeline, const pipeline_desc& desc) {
+    _draw_pipeline = pipeline;
+    _draw_state = desc;
+  }
   void create_framebuffers();
   void create_commandpool();
-  void create_buffers();
   void create_commandbuffers();
   void create_sync_objects();
 
+  // Starts uploading the vertex and index buffers, nothing waits for them
+  // They can't be drawn until all the uploads are done and finished. There are none when
+  // the device memory can be written directly
+  // Returns std::nullopt if they don't fit in the memory budget right now
+  // The file in src has to stay mapped until the uploads are finished
+  std::optional<std::vector<buffer_upload>> create_buffers(const geometry_source& src);
+  std::optional<std::vector<buffer_upload>> create_buffers(); // The builtin quad
+  bool is_upload_done(const buffer_upload& upload);
+
+  // Pieces of create_buffers, for callers bringing the data in themselves
+  // The geometry buffers are device local transfer destinations, the copies start right away
+  // and read from a buffer the caller keeps alive until they are finished
+  bool create_geometry_buffers(VkDeviceSize vert_sz, VkDeviceSize indx_sz,
+                               vertex_layout layout = vertex_layout::interleaved);
+  vertex_layout geometry_layout() const { return _vertex_layout; }
+  VkBuffer vertex_buffer() const {
+    return _resources.buffers.get<buffer_col::buffer>(_vertex_buffer);
+  }
+  VkBuffer index_buffer() const {
+    return _resources.buffers.get<buffer_col::buffer>(_index_buffer);
+  }
+  std::optional<mapped_buffer> create_staging_buffer(VkDeviceSize size);
+  void destroy_staging_buffer(mapped_buffer& staging);
+  buffer_upload submit_copy(VkBuffer src, VkBuffer dst, const VkBufferCopy& region);
+  buffer_upload submit_copies(VkBuffer src, std::span<const buffer_copy> copies);
+
+  void finish_upload(buffer_upload& upload);
+
+  // Device local transfer destinations besides the scene geometry, for callers filling them
+  // themselves (see upload_scheduler). Destroyed along with the context
+  // Returns std::nullopt if it doesn't fit in the memory budget right now
+  std::optional<buffer_handle> create_geometry_buffer(VkDeviceSize size,
+                                                      VkBufferUsageFlags usage);
+  VkBuffer buffer(buffer_handle handle) const {
+    return _resources.buffers.get<buffer_col::buffer>(handle);
+  }
+
   // Context rendering
-  void draw_frame();
+  void draw_frame(const render_state& state);
   void wait_idle();
 
+  // Draws the passes offscreen one after another and returns how long the GPU took for each,
+  // in milliseconds. Waits for them to finish, render thread only
+  // The pipelines have to be built against current_target()
+  std::vector<double> time_passes(std::span<const timed_pass> passes);
+
+  // State changes recorded by the last draw_frame
+  const draw_stats& last_draw_stats() const { return _draw_stats; }
+
+  // Scratch memory for the frame being recorded, reset once that frame's fence signals
+  // so anything allocated here stays valid for as long as the frame is in flight
+  linear_arena& frame_arena() { return _frame_arenas[_curr_frame]; }
+
   // Context dynamic settings
   void flag_dirty_framebuffer() { _framebuffer_resized = true; }
 
-  // Destruction
+  // Device local memory is host visible, a memcpy is all an upload needs
+  bool direct_write() const { return _direct_write; }
+
+  // Buffer device addresses are available, pipelines can pull their vertices
+  bool vertex_pulling() const { return _has_device_address; }
+
+  // Pipelines get linked from graphics pipeline libraries, build_pipeline links them fast
+  // unless asked for an optimized link
+  bool pipeline_libraries() const { return _has_pipeline_library; }
+
+  // Alignment for files mapped to be imported, 0 without VK_EXT_external_memory_host
+  std::size_t host_import_alignment() const { return _host_import_alignment; }
+
+  // Device memory usage, refreshed every frame. Register evictors here
+  vk_memory_budget& memory_budget() { return _budget; }
+
+  // Every long lived buffer, image, pipeline and sampler, looked up through their handles
+  const vk_resources& resources() const { return _resources; }
+
+  // Bumped every time the swapchain gets recreated
+  uint32_t swapchain_generation() const { return _swapchain_generation; }
+
+  // Destruction, of whatever got created so far. Does nothing the second time
   void destroy();
 
 private:
@@ -98,42 +328,113 @@ private:
 
   void _cleanup_swapchain();
   void _recreate_swapchain();
-  void _create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props,
-                      VkBuffer& buffer, VkDeviceMemory& buffer_mem);
-  void _copy_buffer(VkBuffer src, VkBuffer dst, VkDeviceSize sz);
+  VkRenderPass _create_color_pass(VkImageLayout final_layout);
+  void _record_viewport(VkCommandBuffer buffer) const;
+  void _record_dynamic_state(VkCommandBuffer buffer, const pipeline_desc& desc) const;
+  uint32_t _find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags props) const;
+  bool _try_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props,
+                          memory_category category, VkBuffer& buffer, VkDeviceMemory& buffer_mem,
+                          void** mapped = nullptr);
+  void _destroy_buffer(VkBuffer buffer, VkDeviceMemory buffer_mem);
+  std::optional<buffer_handle> _try_create_pooled_buffer(VkDeviceSize size,
+                                                         VkBufferUsageFlags usage,
+                                                         VkMemoryPropertyFlags props,
+                                                         memory_category category,
+                                                         bool map = false);
+  void _destroy_buffer(buffer_handle handle);
+  VkBufferUsageFlags _geometry_usage(VkBufferUsageFlags usage) const;
+  void _set_geometry(buffer_handle vert, buffer_handle indx, VkDeviceSize vert_sz,
+                     uint32_t index_count, vertex_layout layout);
+  void _destroy_resources();
+  void _destroy_device_objects();
+  void _create_pipeline_layout();
+  void _create_pipeline_cache();
+  void _load_dynamic_state_commands();
+  void _save_pipeline_cache();
+  VkResult _link_pipeline(const pipeline_desc& desc, const VkGraphicsPipelineCreateInfo& full,
+                          pipeline_link link, VkPipeline& pipeline);
+  VkPipeline _get_library(const pipeline_desc& desc, VkGraphicsPipelineCreateInfo info,
+                          VkGraphicsPipelineLibraryFlagBitsEXT part);
+  void _destroy_retired_pipelines();
+  VkShaderModule _get_shader_module(uint64_t hash, std::string_view spirv);
+  std::optional<module_identifier> _find_module_identifier(uint64_t hash);
+  void _load_module_identifiers();
+  void _save_module_identifiers();
+  std::optional<buffer_upload> _try_create_staging(const void* data, VkDeviceSize sz);
+  // Error path of create_buffers, frees the uploads and the geometry buffers they fill
+  void _discard_geometry_uploads(std::span<buffer_upload> uploads, std::size_t submitted);
+  bool _try_import_host(const mapped_file& file, buffer_upload& upload);
+  void _submit_upload(buffer_upload& upload, std::span<const buffer_copy> copies);
 
 private:
-  bool _enable_layers;
-  VkInstance _instance;
-  VkDebugUtilsMessengerEXT _messenger;
+  // Declared first, it has to outlive every object created with it
+  vk_host_allocator _host_allocator;
+  const VkAllocationCallbacks* _allocator{_host_allocator.callbacks()};
+
+  bool _enable_layers{false};
+  bool _has_properties2{false};
+  bool _has_external_memory{false};
+  bool _has_device_group{false};
+  VkInstance _instance{VK_NULL_HANDLE};
+  VkDebugUtilsMessengerEXT _messenger{VK_NULL_HANDLE};
 
-  VkSurfaceKHR _surface;
-  VkPhysicalDevice _physical_device;
-  VkDevice _device;
+  VkSurfaceKHR _surface{VK_NULL_HANDLE};
+  VkPhysicalDevice _physical_device{VK_NULL_HANDLE};
+  VkDevice _device{VK_NULL_HANDLE};
   VkQueue _graphics_queue, _present_queue, _transfer_queue;
+  queue_family_indices _queue_families;
+  swapchain_support_details _swapchain_support;
+  std::vector<const char*> _device_extensions; // Required plus the optional ones available
+  vk_memory_budget _budget;
+  bool _direct_write{false}; // Device local memory is host visible, no staging needed
+  bool _has_pipeline_library{false}; // Only with fast linking
+  dynamic_state_support _dynamic_state; // Fixed once the device exists
+  bool _has_device_address{false};
+  PFN_vkGetBufferDeviceAddressKHR _get_buffer_address{nullptr};
+  bool _has_module_identifier{false};
+  std::array<uint8_t, VK_UUID_SIZE> _identifier_algorithm{};
+  PFN_vkGetShaderModuleIdentifierEXT _get_module_identifier{nullptr};
+  dynamic_state_commands _dynamic_state_cmds;
+  VkDeviceSize _host_import_alignment{0};
+  PFN_vkGetMemoryHostPointerPropertiesEXT _get_host_pointer_props{nullptr};
 
   VkFormat _swapchain_format;
   VkExtent2D _swapchain_extent;
-  VkSwapchainKHR _swapchain;
+  VkSwapchainKHR _swapchain{VK_NULL_HANDLE};
   std::vector<VkImage> _swapchain_images;
   std::vector<VkImageView> _swapchain_image_views;
   std::vector<VkFramebuffer> _swapchain_framebuffers;
   std::function<void(std::size_t&, std::size_t&)> _framebuffer_size_callback;
   bool _framebuffer_resized{false};
+  uint32_t _swapchain_generation{0};
 
-  VkRenderPass _render_pass;
-  VkPipelineLayout _graphics_pipeline_layout;
-  VkPipeline _graphics_pipeline;
+  VkRenderPass _render_pass{VK_NULL_HANDLE}; // Not recreated along with the swapchain
+  VkPipelineLayout _pipeline_layout{VK_NULL_HANDLE}; // Shared by every pipeline
+  VkPipelineCache _pipeline_cache{VK_NULL_HANDLE}; // Kept on disk between runs
+  std::mutex _libraries_mtx; // Parts get built from the compile jobs
+  std::unordered_multimap<uint64_t, pipeline_library> _libraries; // Equal hashes get compared
+  std::mutex _shader_modules_mtx; // Same, modules get created from the compile jobs
+  std::unordered_map<uint64_t, VkShaderModule> _shader_modules; // Keyed by shader_hash
+  std::unordered_map<uint64_t, module_identifier> _module_identifiers; // Same, kept on disk
+  std::vector<retired_pipeline> _retired_pipelines;
+  pipeline_handle _graphics_pipeline, _draw_pipeline;
+  pipeline_desc _draw_state;
+  draw_stats _draw_stats;
 
-  VkCommandPool _graphics_command_pool, _transfer_command_pool;
-  VkCommandBuffer _transfer_command_buffer;
+  VkCommandPool _graphics_command_pool{VK_NULL_HANDLE}, _transfer_command_pool{VK_NULL_HANDLE};
   std::vector<VkCommandBuffer> _graphics_command_buffers;
   std::vector<VkSemaphore> _image_avail_semaphores, _render_finish_semaphores;
   std::vector<VkFence> _in_flight_fences;
+  std::vector<linear_arena> _frame_arenas;
   uint32_t _curr_frame{0};
+  uint64_t _submitted_frames{0};
 
-  VkBuffer _vertex_buffer, _index_buffer;
-  VkDeviceMemory _vertex_buffer_mem, _index_buffer_mem;
+  vk_resources _resources;
+  buffer_handle _vertex_buffer, _index_buffer;
+  VkDeviceAddress _vertex_address{0}; // 0 without buffer device addresses
+  vertex_layout _vertex_layout{vertex_layout::interleaved};
+  uint32_t _vertex_count{0};
+  uint32_t _index_count{0};
 };
 
 } // namespace ntf
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <variant>
+
+namespace ntf {
+
+// Events produced by the GLFW callbacks on the main thread
+struct resize_event {
+  int width, height;
+};
+
+struct key_event {
+  int key, scancode, action, mods;
+};
+
+using window_event = std::variant<resize_event, key_event>;
+
+} // namespace ntf
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Builds an asset pack (see src/asset_pack.hpp) out of loose files
+# usage: make_pack.py out.pack [--codec none|lz4|zstd] [--chunk-size N] files...
+# Entries are named after the paths as given, so run it from the directory the game
+# runs from (eg. make_pack.py res/assets.pack res/shader.vs.spv res/scene.mesh)
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x504B544E # "NTKP"
+VERSION = 1
+MAX_NAME = 64
+CODECS = {"none": 0, "lz4": 1, "zstd": 2}
+
+HEADER = struct.Struct("<6I")
+ENTRY = struct.Struct(f"<{MAX_NAME}sQ4I")
+CHUNK = struct.Struct("<QII")
+
+
+def compressor(codec):
+  if codec == "none":
+    return lambda data: data
+  if codec == "lz4":
+    import lz4.block
+    return lambda data: lz4.block.compress(data, mode="high_compression", store_size=False)
+  import zstandard
+  ctx = zstandard.ZstdCompressor(level=19, write_checksum=True)
+  return ctx.compress
+
+
+def main():
+  parser = argparse.ArgumentParser()
+  parser.add_argument("out")
+  parser.add_argument("files", nargs="+")
+  parser.add_argument("--codec", choices=CODECS.keys(), default="zstd")
+  parser.add_argument("--chunk-size", type=int, default=256*1024)
+  args = parser.parse_args()
+
+  compress = compressor(args.codec)
+  entries, chunks, blobs = [], [], []
+  for path in args.files:
+    name = path.encode()
+    if len(name) >= MAX_NAME:
+      sys.exit(f"Name too long: {path}")
+    with open(path, "rb") as f:
+      data = f.read()
+
+    first = len(chunks)
+    for begin in range(0, len(data), args.chunk_size):
+      raw = data[begin:begin + args.chunk_size]
+      stored = compress(raw)
+      if len(stored) >= len(raw):
+        stored = raw # Not worth it, the loader copies chunks stored as is
+      chunks.append([0, len(stored), len(raw)])
+      blobs.append(stored)
+    entries.append((name, len(data), CODECS[args.codec], first, len(chunks) - first))
+
+  offset = HEADER.size + ENTRY.size*len(entries) + CHUNK.size*len(chunks)
+  for chunk, blob in zip(chunks, blobs):
+    chunk[0] = offset
+    offset += len(blob)
+
+  with open(args.out, "wb") as f:
+    f.write(HEADER.pack(MAGIC, VERSION, len(entries), len(chunks), args.chunk_size, 0))
+    for name, size, codec, first, count in entries:
+      f.write(ENTRY.pack(name, size, codec, first, count, 0))
+    for chunk in chunks:
+      f.write(CHUNK.pack(*chunk))
+    for blob in blobs:
+      f.write(blob)
+
+  stored = sum(len(b) for b in blobs)
+  raw = sum(e[1] for e in entries)
+  print(f"{args.out}: {len(entries)} entries, {raw} bytes in {stored} ({args.codec})")
+
+
+if __name__ == "__main__":
+  main()
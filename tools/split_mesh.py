@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# Rewrites a mesh file with its vertices split in streams (version 2, see src/asset_loader.cpp)
+# Every position goes first and then every color, so passes only needing positions fetch
+# just those. With --interleave it goes the other way
+# usage: split_mesh.py in.mesh out.mesh [--interleave]
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x4D46544E # "NTFM"
+VERSION_INTERLEAVED = 1
+VERSION_SPLIT = 2
+
+HEADER = struct.Struct("<4I")
+POSITION_SIZE = 2*4 # vec2
+COLOR_SIZE = 3*4 # vec3
+VERTEX_SIZE = POSITION_SIZE + COLOR_SIZE
+
+
+def main():
+  parser = argparse.ArgumentParser()
+  parser.add_argument("input")
+  parser.add_argument("out")
+  parser.add_argument("--interleave", action="store_true")
+  args = parser.parse_args()
+
+  with open(args.input, "rb") as f:
+    data = f.read()
+  if len(data) < HEADER.size:
+    sys.exit(f"Invalid mesh file {args.input}")
+
+  magic, version, vertex_count, index_count = HEADER.unpack_from(data)
+  vert_sz = VERTEX_SIZE*vertex_count
+  if magic != MAGIC or version not in (VERSION_INTERLEAVED, VERSION_SPLIT) or \
+     len(data) != HEADER.size + vert_sz + 2*index_count:
+    sys.exit(f"Invalid mesh file {args.input}")
+
+  vertices = data[HEADER.size:HEADER.size + vert_sz]
+  indices = data[HEADER.size + vert_sz:]
+
+  if version == VERSION_INTERLEAVED:
+    positions = [vertices[i*VERTEX_SIZE:i*VERTEX_SIZE + POSITION_SIZE]
+                 for i in range(vertex_count)]
+    colors = [vertices[i*VERTEX_SIZE + POSITION_SIZE:(i + 1)*VERTEX_SIZE]
+              for i in range(vertex_count)]
+  else:
+    color_base = POSITION_SIZE*vertex_count
+    positions = [vertices[i*POSITION_SIZE:(i + 1)*POSITION_SIZE] for i in range(vertex_count)]
+    colors = [vertices[color_base + i*COLOR_SIZE:color_base + (i + 1)*COLOR_SIZE]
+              for i in range(vertex_count)]
+
+  if args.interleave:
+    out_version = VERSION_INTERLEAVED
+    out_vertices = b"".join(p + c for p, c in zip(positions, colors))
+  else:
+    out_version = VERSION_SPLIT
+    out_vertices = b"".join(positions) + b"".join(colors)
+
+  with open(args.out, "wb") as f:
+    f.write(HEADER.pack(MAGIC, out_version, vertex_count, index_count))
+    f.write(out_vertices)
+    f.write(indices)
+
+
+if __name__ == "__main__":
+  main()